@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "decoder.h"
+
+const int kDefaultChunkSize = 64 * 1024;
+const int kFeedLeadBytes = 2 * 1024 * 1024;
+const int kWaitHeaderLength = 512 * 1024;
+const int kMaxStalledCalls = 1000;
+const int kPresentSlots = 8;
+
+typedef struct BenchContext {
+    WebDecoder *decoder;
+    unsigned char *fileData;
+    int64_t fileSize;
+    int64_t feedOffset;
+    int chunkSize;
+    int isStream;
+    int presentFps;             // Simulated display rate, 0 takes frames from the callback.
+    double presentClock;
+    double callStartUs;
+    double *latencies;
+    int latencyCount;
+    int latencyCapacity;
+    int64_t videoFrames;
+    int64_t audioFrames;
+    int64_t bytesFed;
+    int64_t videoBytesOut;
+    int64_t audioBytesOut;
+    int requests;
+} BenchContext;
+
+//Callbacks carry no user pointer, one benchmark runs at a time.
+BenchContext *bench = NULL;
+
+double nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+void onVideoFrame(unsigned char *buff, int size, double timestamp) {
+    if (bench->latencyCount == bench->latencyCapacity) {
+        bench->latencyCapacity = bench->latencyCapacity > 0 ? bench->latencyCapacity * 2 : 4096;
+        bench->latencies = (double *)realloc(bench->latencies, bench->latencyCapacity * sizeof(double));
+    }
+    bench->latencies[bench->latencyCount++] = nowUs() - bench->callStartUs;
+    bench->videoBytesOut += size;
+    ++bench->videoFrames;
+}
+
+void onAudioFrame(unsigned char *buff, int size, double timestamp) {
+    bench->audioBytesOut += size;
+    ++bench->audioFrames;
+}
+
+void onRequest(int offset, int available) {
+    // Behave like the player's downloader: follow redirects, ignore "hit in buffer".
+    if (offset >= 0 && offset <= bench->fileSize) {
+        bench->feedOffset = offset;
+        ++bench->requests;
+    }
+}
+
+int feedChunk(BenchContext *ctx) {
+    int len = 0;
+    int ret = 0;
+    if (ctx->feedOffset >= ctx->fileSize) {
+        return 0;
+    }
+
+    len = (int)(ctx->fileSize - ctx->feedOffset < ctx->chunkSize ? ctx->fileSize - ctx->feedOffset : ctx->chunkSize);
+    if (ctx->isStream) {
+        ret = sendData(ctx->decoder, ctx->fileData + ctx->feedOffset, len);
+        ctx->feedOffset += ret > 0 ? ret : 0;
+    } else {
+        int64_t offset = ctx->feedOffset;
+        ret = sendDataAt(ctx->decoder, (int)offset, ctx->fileData + offset, len);
+        // A redirect from inside sendDataAt already moved feedOffset.
+        if (ret > 0 && ctx->feedOffset == offset) {
+            ctx->feedOffset += ret;
+        }
+    }
+
+    if (ret > 0) {
+        ctx->bytesFed += ret;
+    }
+    return ret;
+}
+
+void feedAhead(BenchContext *ctx, int64_t lead) {
+    int64_t begin = ctx->feedOffset;
+    while (ctx->feedOffset < ctx->fileSize && ctx->feedOffset - begin < lead) {
+        if (feedChunk(ctx) <= 0) {
+            break;
+        }
+    }
+}
+
+//One simulated vsync, the display clock moves on and the decoder picks the frame to show.
+void presentTick(BenchContext *ctx) {
+    FrameView view;
+    ctx->presentClock += 1.0 / ctx->presentFps;
+    ctx->callStartUs = nowUs();
+    if (getFrameForTime(ctx->decoder, ctx->presentClock, &view) == 1) {
+        onVideoFrame(view.data[0], view.width * view.height * 3 / 2, view.timestamp);
+    }
+}
+
+int compareDouble(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+double percentile(double *sorted, int count, double p) {
+    int idx = 0;
+    if (count <= 0) {
+        return 0.0;
+    }
+    idx = (int)(p * (count - 1) + 0.5);
+    return sorted[idx];
+}
+
+unsigned char *loadFile(const char *path, int64_t *size) {
+    FILE *fp = fopen(path, "rb");
+    unsigned char *data = NULL;
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    data = (unsigned char *)malloc(*size > 0 ? *size : 1);
+    if (data != NULL && fread(data, 1, *size, fp) != (size_t)*size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    return data;
+}
+
+int runBench(const char *path, int chunkSize, int threadCount, int isStream, int presentFps) {
+    BenchContext ctx;
+    int params[7] = { 0 };
+    ErrorCode ret = kErrorCode_Success;
+    double beginUs = 0.0;
+    double elapsedUs = 0.0;
+    int64_t lastProgress = -1;
+    int stalledCalls = 0;
+    DecoderStats stats;
+    struct rusage usage;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.chunkSize = chunkSize;
+    ctx.isStream = isStream;
+    ctx.presentFps = presentFps;
+    ctx.fileData = loadFile(path, &ctx.fileSize);
+    if (ctx.fileData == NULL) {
+        fprintf(stderr, "Load %s failed.\n", path);
+        return 1;
+    }
+    bench = &ctx;
+
+    ctx.decoder = initDecoder(isStream ? -1 : (int)ctx.fileSize, kLogLevel_None);
+    if (ctx.decoder == NULL) {
+        fprintf(stderr, "initDecoder failed.\n");
+        free(ctx.fileData);
+        return 1;
+    }
+
+    if (presentFps > 0) {
+        setPresentQueue(ctx.decoder, kPresentSlots);
+    }
+
+    beginUs = nowUs();
+    feedAhead(&ctx, kWaitHeaderLength);
+    ret = openDecoder(ctx.decoder, params, 7, (long)onVideoFrame, (long)onAudioFrame, (long)onRequest, threadCount);
+    if (ret != kErrorCode_Success) {
+        fprintf(stderr, "openDecoder failed %d.\n", ret);
+        uninitDecoder(ctx.decoder);
+        free(ctx.fileData);
+        return 1;
+    }
+
+    while (1) {
+        feedAhead(&ctx, kFeedLeadBytes);
+        ctx.callStartUs = nowUs();
+        ret = decodeOnePacket(ctx.decoder);
+        if (ret == kErrorCode_Eof) {
+            break;
+        }
+
+        // Decoding is ahead of the display, let a refresh take a frame.
+        if (ret == kErrorCode_Frame_Pool_Full && presentFps > 0) {
+            presentTick(&ctx);
+            continue;
+        }
+
+        // Nothing left to feed and nothing buffered.
+        if (ret == kErrorCode_Invalid_State && ctx.feedOffset >= ctx.fileSize) {
+            break;
+        }
+
+        if (ret == kErrorCode_FFmpeg_Error) {
+            fprintf(stderr, "Decode error, stop.\n");
+            break;
+        }
+
+        if (ctx.videoFrames + ctx.audioFrames + ctx.bytesFed == lastProgress) {
+            if (++stalledCalls >= kMaxStalledCalls) {
+                fprintf(stderr, "No progress after %d calls, stop.\n", stalledCalls);
+                break;
+            }
+        } else {
+            lastProgress = ctx.videoFrames + ctx.audioFrames + ctx.bytesFed;
+            stalledCalls = 0;
+        }
+    }
+
+    // Show what is still queued, the last frame stays on screen.
+    getStats(ctx.decoder, &stats);
+    while (presentFps > 0 && stats.presentQueueFrames > 1) {
+        presentTick(&ctx);
+        getStats(ctx.decoder, &stats);
+    }
+    elapsedUs = nowUs() - beginUs;
+
+    qsort(ctx.latencies, ctx.latencyCount, sizeof(double), compareDouble);
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("{\"file\":\"%s\",\"mode\":\"%s\",\"chunkSize\":%d,\"threads\":%d,"
+        "\"width\":%d,\"height\":%d,\"elapsedMs\":%.3f,"
+        "\"videoFrames\":%lld,\"audioFrames\":%lld,\"fps\":%.2f,"
+        "\"latencyUs\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f},"
+        "\"bytesFed\":%lld,\"videoBytesOut\":%lld,\"audioBytesOut\":%lld,"
+        "\"requests\":%d,\"presentFps\":%d,\"lateFrames\":%.0f,\"peakRssKb\":%ld}\n",
+        path, isStream ? "stream" : "file", chunkSize, threadCount,
+        params[2], params[3], elapsedUs / 1000.0,
+        (long long)ctx.videoFrames, (long long)ctx.audioFrames,
+        elapsedUs > 0 ? ctx.videoFrames * 1000000.0 / elapsedUs : 0.0,
+        percentile(ctx.latencies, ctx.latencyCount, 0.5),
+        percentile(ctx.latencies, ctx.latencyCount, 0.9),
+        percentile(ctx.latencies, ctx.latencyCount, 0.99),
+        ctx.latencyCount > 0 ? ctx.latencies[ctx.latencyCount - 1] : 0.0,
+        (long long)ctx.bytesFed, (long long)ctx.videoBytesOut, (long long)ctx.audioBytesOut,
+        ctx.requests, presentFps, stats.lateFrames, usage.ru_maxrss);
+
+    closeDecoder(ctx.decoder);
+    uninitDecoder(ctx.decoder);
+    free(ctx.latencies);
+    free(ctx.fileData);
+    bench = NULL;
+
+    // A stream that opens but yields nothing lost sync in the ring, fail the run.
+    if (ctx.videoFrames + ctx.audioFrames == 0) {
+        fprintf(stderr, "No frames decoded from %s.\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [--chunk bytes] [--threads n] [--stream] [--present fps] file...\n", name);
+}
+
+int main(int argc, char **argv) {
+    int chunkSize   = kDefaultChunkSize;
+    int threadCount = 1;
+    int isStream    = 0;
+    int presentFps  = 0;
+    int files       = 0;
+    int failed      = 0;
+    int i           = 0;
+
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--chunk") == 0 && i + 1 < argc) {
+            chunkSize = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threadCount = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            isStream = 1;
+        } else if (strcmp(argv[i], "--present") == 0 && i + 1 < argc) {
+            presentFps = atoi(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            failed += runBench(argv[i], chunkSize > 0 ? chunkSize : kDefaultChunkSize, threadCount, isStream, presentFps > 0 ? presentFps : 0);
+            ++files;
+        }
+    }
+
+    if (files == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    return failed > 0 ? 1 : 0;
+}
@@ -1,3 +1,14 @@
+# Usage: ./build_decoder.sh [threads] [simd] [log=0|1|2]
+#   threads: build FFmpeg and the decoder with pthreads (SharedArrayBuffer required in browser).
+#   simd: build the decoder with wasm simd128.
+#   log: highest decoder log level compiled in, defaults to 2 (core and FFmpeg).
+THREAD_OPTIONS="--disable-pthreads"
+for arg in "$@"; do
+  if [ "$arg" == "threads" ]; then
+    THREAD_OPTIONS="--enable-pthreads --extra-cflags=-pthread --extra-ldflags=-pthread"
+  fi
+done
+
 echo "Beginning Build:"
 rm -r dist
 mkdir -p dist
@@ -7,7 +18,8 @@ emconfigure ./configure --cc="emcc" --cxx="em++" --ar="emar" --ranlib="emranlib"
         --arch=x86_32 --cpu=generic --enable-gpl --enable-version3 --disable-avdevice --disable-swresample --disable-postproc --disable-avfilter \
         --disable-programs --disable-logging --disable-everything --enable-avformat --enable-decoder=hevc --enable-decoder=h264 --enable-decoder=aac \
         --disable-ffplay --disable-ffprobe --disable-ffserver --disable-asm --disable-doc --disable-devices --disable-network --disable-hwaccels \
-        --disable-parsers --disable-bsfs --disable-debug --enable-protocol=file --enable-demuxer=mov --enable-demuxer=flv --disable-indevs --disable-outdevs
+        --disable-parsers --disable-bsfs --disable-debug --enable-protocol=file --enable-demuxer=mov --enable-demuxer=flv --disable-indevs --disable-outdevs \
+        ${THREAD_OPTIONS}
 if [ -f "Makefile" ]; then
   echo "make clean"
   make clean
@@ -17,4 +29,4 @@ make
 echo "make install"
 make install
 cd ../WasmVideoPlayer
-./build_decoder_wasm.sh
+./build_decoder_wasm.sh $@
@@ -1,13 +1,70 @@
-rm -rf libffmpeg.wasm libffmpeg.js
+# Usage: ./build_decoder_wasm.sh [threads] [simd] [log=0|1|2] [memory=MB]
+rm -rf libffmpeg.wasm libffmpeg.js libffmpeg.worker.js
 export TOTAL_MEMORY=67108864
+export THREAD_FLAGS=""
+export SIMD_FLAGS=""
+export LOG_FLAGS=""
+for arg in "$@"; do
+  if [ "$arg" == "threads" ]; then
+    # Decoder threads are created up front, one pool per module shared by all instances.
+    # openDecoder caps codec threads to what is left of it, a thread beyond it deadlocks.
+    export THREAD_POOL_SIZE=8
+    export THREAD_FLAGS="-pthread -s USE_PTHREADS=1 -s PTHREAD_POOL_SIZE=${THREAD_POOL_SIZE} -DDECODER_THREAD_POOL=${THREAD_POOL_SIZE}"
+  elif [ "$arg" == "simd" ]; then
+    # wasm simd128 for the native conversion kernels, needs a SIMD capable browser.
+    export SIMD_FLAGS="-msimd128"
+  elif [[ "$arg" == log=* ]]; then
+    # Highest log level compiled in, log=0 strips all logging, log=1 drops FFmpeg logs.
+    export LOG_FLAGS="-DDECODER_LOG_LEVEL=${arg#log=}"
+  elif [[ "$arg" == memory=* ]]; then
+    # Fixed module heap, size it to the sum of the instances' setMemoryBudget plus FFmpeg's tables.
+    export TOTAL_MEMORY=$(( ${arg#memory=} * 1024 * 1024 ))
+  fi
+done
 export EXPORTED_FUNCTIONS="[ \
     '_initDecoder', \
     '_uninitDecoder', \
     '_openDecoder', \
     '_closeDecoder', \
     '_sendData', \
+    '_sendDataAt', \
+    '_getWriteSpan', \
+    '_commitWrite', \
     '_decodeOnePacket', \
+    '_decodePackets', \
     '_seekTo', \
+    '_setOutputMode', \
+    '_releaseFrame', \
+    '_setAudioLayout', \
+    '_setAudioOutput', \
+    '_getLastSeekDuration', \
+    '_setCacheLimit', \
+    '_getStats', \
+    '_resetStats', \
+    '_drainLog', \
+    '_setProbeLimits', \
+    '_setStreamHint', \
+    '_getTimeToFirstFrame', \
+    '_getKeyframeIndex', \
+    '_getReadaheadPlan', \
+    '_setLiveMode', \
+    '_getLiveLatency', \
+    '_setQualityLadder', \
+    '_reportQueueDepth', \
+    '_setQualityLevel', \
+    '_getQualityLevel', \
+    '_setTrackEnabled', \
+    '_setOutputSize', \
+    '_setOutputFormat', \
+    '_getOutputSize', \
+    '_extractThumbnails', \
+    '_setMemoryBudget', \
+    '_getMemoryStats', \
+    '_setPresentQueue', \
+    '_setAudioClock', \
+    '_getFrameForTime', \
+    '_setPacketQueueLimits', \
+    '_demuxPackets', \
     '_main',
     '_malloc',
     '_free'
@@ -23,6 +80,9 @@ emcc decoder.c dist/lib/libavformat.a dist/lib/libavcodec.a dist/lib/libavutil.a
     -s EXTRA_EXPORTED_RUNTIME_METHODS="['addFunction']" \
     -s RESERVED_FUNCTION_POINTERS=14 \
     -s FORCE_FILESYSTEM=1 \
+    ${THREAD_FLAGS} \
+    ${SIMD_FLAGS} \
+    ${LOG_FLAGS} \
     -o libffmpeg.js
 
 echo "Finished Build"
@@ -32,6 +32,12 @@ const kFeedDataReq          = 4;
 const kStartDecodingReq     = 5;
 const kPauseDecodingReq     = 6;
 const kSeekToReq            = 7;
+const kGetStatsReq          = 8;
+const kGetKeyframesReq      = 9;
+const kQueueDepthReq        = 10;
+const kSetOutputSizeReq     = 11;
+const kThumbnailsReq        = 12;
+const kSetTrackReq          = 13;
 
 //Decoder response.
 const kInitDecoderRsp       = 0;
@@ -45,6 +51,70 @@ const kPauseDecodingRsp     = 7;
 const kDecodeFinishedEvt    = 8;
 const kRequestDataEvt       = 9;
 const kSeekToRsp            = 10;
+const kBufferFullEvt        = 11;
+const kStatsRsp             = 12;
+const kKeyframesRsp         = 13;
+const kReadaheadEvt         = 14;
+const kThumbnailsRsp        = 15;
+
+//Decoder error.
+const kErrorInitDecoder     = -1;
+
+//Decoder batch status, int32 fields of native DecodeStatus.
+const kDecodeStatusSize         = 32;
+const kDecodeStatusStopReason   = 6;
+const kDecodeStopEof            = 3;
+
+//Native DecoderStats, 6 stages of 19 doubles followed by 31 doubles.
+const kDecoderStatsSize         = 1160;
+
+//Native MemoryStats, 10 doubles.
+const kMemoryStatsSize          = 80;
+
+//Native KeyframeEntry, timestamp, offset, size and frames as doubles.
+const kKeyframeEntrySize        = 32;
+const kKeyframeEntryFields      = 4;
+
+//Native ReadaheadRange, offset, size and deadline as doubles.
+const kReadaheadRangeSize       = 24;
+const kReadaheadRangeFields     = 3;
+const kReadaheadMaxRanges       = 16;
+const kReadaheadHorizonMs       = 4000;
+const kReadaheadInterval        = 200;
+
+//Live catch-up defaults, stream mode.
+const kLiveDropThresholdMs      = 500;
+const kLiveJumpThresholdMs      = 1000;
+
+//Quality ladder, water marks on the player's buffered milliseconds.
+const kQualityLowWaterMs        = 300;
+const kQualityHighWaterMs       = 800;
+const kQueueDepthInterval       = 250;
+
+//Audio callback batching, the decoder hands over blocks this long.
+const kAudioBlockMs             = 100;
+
+//Native ThumbnailRequest, 6 int32 fields, missingOffset last.
+const kThumbnailRequestSize     = 24;
+const kThumbnailRequestFields   = 6;
+
+//Native StreamType, for stream hints and track switches.
+const kStreamTypeVideo          = 0;
+const kStreamTypeAudio          = 1;
+
+//Native OutputFormat, copy mode picture layout.
+const kOutputFormatYUV420P      = 0;
+const kOutputFormatNV12         = 1;
+
+//Native OutputMode, the worker only posts copy mode pictures.
+const kOutputModeCopy           = 0;
+
+//Native StreamHint, 7 int32 fields.
+const kStreamHintSize           = 28;
+
+//Native log ring drain.
+const kLogDrainSize             = 65536;
+const kLogDrainInterval         = 1000;
 
 function Logger(module) {
     this.module = module;
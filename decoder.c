@@ -1,11 +1,14 @@
 #include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
 #include <sys/time.h>
-#include <sys/timeb.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__EMSCRIPTEN__) || defined(__GLIBC__)
+#include <malloc.h>
+#endif
 
-typedef void(*VideoCallback)(unsigned char *buff, int size, double timestamp);
-typedef void(*AudioCallback)(unsigned char *buff, int size, double timestamp);
-typedef void(*RequestCallback)(int offset, int available);
+#include "decoder.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -13,42 +16,194 @@ extern "C" {
 
 #include "libavcodec/avcodec.h"
 #include "libavformat/avformat.h"
-#include "libavutil/fifo.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/intreadwrite.h"
 //#include "libswscale/swscale.h"
 
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #define MIN(X, Y)  ((X) < (Y) ? (X) : (Y))
 
+//Threads the module can start without yielding to the event loop, PTHREAD_POOL_SIZE in the
+//wasm threads build. A codec thread beyond the prewarmed pool deadlocks avcodec_open2.
+//0 is no limit.
+#ifndef DECODER_THREAD_POOL
+#define DECODER_THREAD_POOL 0
+#endif
+
+//Highest LogLevel compiled in, 0 strips logging, 1 keeps core logs only.
+#ifndef DECODER_LOG_LEVEL
+#define DECODER_LOG_LEVEL 2
+#endif
+
 const int kCustomIoBufferSize = 32 * 1024;
 const int kInitialPcmBufferSize = 128 * 1024;
-const int kDefaultFifoSize = 1 * 1024 * 1024;
-const int kMaxFifoSize = 16 * 1024 * 1024;
-
-typedef enum ErrorCode {
-    kErrorCode_Success = 0,
-    kErrorCode_Invalid_Param,
-    kErrorCode_Invalid_State,
-    kErrorCode_Invalid_Data,
-    kErrorCode_Invalid_Format,
-    kErrorCode_NULL_Pointer,
-    kErrorCode_Open_File_Error,
-    kErrorCode_Eof,
-    kErrorCode_FFmpeg_Error,
-    kErrorCode_Old_Frame
-} ErrorCode;
-
-typedef enum LogLevel {
-    kLogLevel_None, //Not logging.
-    kLogLevel_Core, //Only logging core module(without ffmpeg).
-    kLogLevel_All   //Logging all, with ffmpeg.
-} LogLevel;
+const int kStreamRingSize = 4 * 1024 * 1024;
+const int kCacheExtentSize = 256 * 1024;
+const int kDefaultCacheLimit = 16 * 1024 * 1024;
+const int kMinCacheExtents = 4;
+const int kMaxThreadCount = 16;
+const double kStatsFirstBucketUs = 64.0;
+const int kReadaheadMergeGap = 32 * 1024;
+const int kLiveProbeSize = 32 * 1024;
+const int kLiveAnalyzeDurationMs = 500;
+const int kFlvTagPeekSize = 12;     // Tag header plus the video flags byte.
+const int kQualityDownHoldMs = 500;
+const int kQualityUpHoldMs = 2000;  // Slower back up, a weak machine stays weak.
+const int kThumbnailMaxPackets = 512;
+const int kThumbnailMaxStalls = 8;
+const int kMinPooledPictures = 6;   // Floor for codecs that hold few reference pictures.
+const int kMaxDpbFrames = 16;       // H.264 and HEVC spec maximum.
+const int kPicturePadding = 16 + 64 - 1;
+const int kVideoQueueMaxBytes = 4 * 1024 * 1024;
+const int kAudioQueueMaxBytes = 512 * 1024;
+const int kPacketQueueMaxMs = 2000;
+const int kLivePacketQueueMaxMs = 200;  // Queued packets are latency the live catch-up can't see.
+const int kResampleTaps = 32;
+const int kResamplePhases = 256;
+const double kResampleCutoff = 0.9;     // Of the lower Nyquist frequency.
+const double kResampleKaiserBeta = 8.0;
+const int kMinAudioOutputRate = 8000;
+const int kMaxAudioOutputRate = 192000;
+const int kMaxAudioBlockMs = 1000;
+const double kAudioGapSec = 0.05;       // Timestamp jump that restarts the output clock.
+
+//Fixed capacity byte ring for stream ingest, never grows.
+typedef struct RingBuffer {
+    unsigned char *data;
+    int capacity;
+    int readPos;
+    int size;
+} RingBuffer;
+
+//One aligned kCacheExtentSize window of the file, [validBegin, validEnd) is downloaded.
+typedef struct CacheExtent {
+    unsigned char *data;
+    int64_t start;
+    int validBegin;
+    int validEnd;
+    unsigned long lastUse;
+} CacheExtent;
+
+//Sparse file cache, extents are indexed by offset / kCacheExtentSize and evicted LRU.
+typedef struct RangeCache {
+    CacheExtent **index;
+    int indexCount;
+    CacheExtent **extents;
+    int extentCount;
+    int maxExtents;
+    unsigned long useClock;
+} RangeCache;
+
+//Tracks FLV tag timestamps as bytes arrive, ahead of the demuxer.
+typedef struct FlvScanner {
+    int64_t pos;                // Stream bytes scanned so far.
+    int64_t nextTag;            // Offset of the next tag header, -1 until the file header is read.
+    unsigned char peek[16];
+    int peekFill;
+    int invalid;
+    int64_t newestTs;           // Milliseconds, -1 until the first audio/video tag.
+    int64_t newestKeyTs;
+} FlvScanner;
+
+enum {
+    kFramePoolSize = 8,
+    kMaxPresentSlots = 16
+};
+
+typedef struct FrameSlot {
+    AVFrame *frame;
+    FrameView view;
+    int inUse;
+} FrameSlot;
+
+//Decoded pictures waiting for their presentation time, a lock-free single producer (decoding)
+//single consumer (getFrameForTime) ring. head and tail only grow, slots are taken modulo slots.
+typedef struct PresentQueue {
+    AVFrame *frames[kMaxPresentSlots];
+    double timestamps[kMaxPresentSlots];
+    int slots;                      // 0 sends video frames to videoCallback.
+    unsigned int head;              // Consumer owned, the frame on screen while shown is set.
+    unsigned int tail;              // Producer owned.
+    unsigned int flushTail;         // Producer owned, the consumer drops everything before it.
+    int shown;                      // Consumer only.
+    int primed;                     // Consumer only, a frame was shown since the last flush.
+    // Master clock from the audio output, a seqlock since the writer may be a third thread.
+    unsigned int clockSeq;
+    double clockMedia;
+    double clockTimeUs;
+    double clockRate;
+} PresentQueue;
+
+//Scrub preview extraction, independent of the playback demuxer and decoder.
+typedef struct ThumbnailContext {
+    AVFormatContext *formatContext;
+    AVCodecContext *codecContext;
+    AVFrame *frame;
+    AVRational timeBase;
+    int64_t readPos;
+    int64_t missingPos;         // First uncached byte a read hit, -1 if none.
+    unsigned char *scratch;
+    unsigned int scratchSize;
+} ThumbnailContext;
+
+//Demuxed packet waiting for the decode stage, nodes are recycled and payloads stay refcounted.
+typedef struct PacketNode {
+    AVPacket packet;
+    double timestamp;           // Seconds, dts first, decode order across streams.
+    struct PacketNode *next;
+} PacketNode;
+
+typedef struct PacketQueue {
+    PacketNode *head;
+    PacketNode *tail;
+    int count;
+    int bytes;
+    int maxBytes;
+    int maxDurationMs;
+} PacketQueue;
+
+//Pooled pictures of one geometry, outlives the decoder's reference until its last buffer is back.
+typedef struct PicturePool {
+    struct WebDecoder *decoder;
+    AVBufferPool *pool;
+    int format;
+    int alignedWidth;
+    int alignedHeight;
+    int linesize[4];
+    int size;
+} PicturePool;
+
+//Polyphase windowed sinc resampler over planar Float32, state carries across frames.
+typedef struct AudioResampler {
+    int inRate;
+    int outRate;
+    int channels;
+    double step;                // Input samples per output sample.
+    double pos;                 // Window start of the next output in history, fractional.
+    float *filter;              // kResamplePhases + 1 phases of kResampleTaps taps.
+    float *history;             // Planar, capacity samples per channel.
+    int capacity;
+    int fill;
+} AudioResampler;
 
 typedef struct WebDecoder {
     AVFormatContext *avformatContext;
     AVCodecContext *videoCodecContext;
     AVCodecContext *audioCodecContext;
     AVFrame *avFrame;
-    int videoStreamIdx;
+    int videoStreamIdx;             // -1 when the file has no such stream.
     int audioStreamIdx;
+    int threadCount;
+    int poolThreads;                // Reserved from DECODER_THREAD_POOL until closeDecoder.
+    int trackEnabled[2];            // By StreamType, a disabled track is discarded by the demuxer.
+    int videoWaitKey;               // Video re-enabled, drop packets up to the next keyframe.
     VideoCallback videoCallback;
     AudioCallback audioCallback;
     RequestCallback requestCallback;
@@ -60,24 +215,102 @@ typedef struct WebDecoder {
     int videoSize;
     //struct SwsContext* swsCtx;
     unsigned char *customIoBuffer;
-    FILE *fp;
-    char fileName[64];
+    RangeCache cache;
     int64_t fileSize;
     int64_t fileReadPos;
     int64_t fileWritePos;
     int64_t lastRequestOffset;
     double beginTimeOffset;
+    double demuxTime;
+    // Demux stage output, decode stage input, by StreamType.
+    PacketQueue packetQueues[2];
+    PacketNode *freePacketNodes;
+    int demuxEof;
+    int drainState[2];              // By StreamType, 0 running, 1 flush packet sent, 2 drained.
+    // Copy-free ingest, the span handed out by getWriteSpan until commitWrite.
+    unsigned char *ingestSpan;
+    int ingestSpanSize;
+    int64_t ingestOffset;
     int accurateSeek;
     // For streaming.
     int isStream;
-    AVFifoBuffer *fifo;
-    int fifoSize;
+    RingBuffer ring;
+    FlvScanner flvScanner;
+    // For live catch-up, stream mode only.
+    int liveMode;
+    int liveDropThresholdMs;
+    int liveJumpThresholdMs;
+    int liveJumping;
+    int64_t liveJumpTargetTs;
+    // Degradation ladder driven by the host's queue depth.
+    int qualityAuto;
+    int qualityLowWater;
+    int qualityHighWater;
+    QualityLevel qualityLevel;
+    unsigned long qualityChangeTick;
+    int inputStarved;               // The last decode call found no demuxed packet waiting.
+    // Copy mode downscale target, 0 keeps the coded size.
+    int outputWidth;
+    int outputHeight;
+    OutputFormat outputFormat;
+    unsigned char *scaleBuffer;
+    unsigned int scaleBufferSize;
+    // For zero copy output.
+    OutputMode outputMode;
+    FrameSlot framePool[kFramePoolSize];
+    int framesInUse;
+    // Native presentation, see setPresentQueue.
+    PresentQueue present;
+    // Float32 layout handed to audioCallback.
+    AudioLayout audioLayout;
+    // Audio output target and batching, see setAudioOutput.
+    int audioOutRate;               // 0 keeps the source rate.
+    int audioOutChannels;           // 0 keeps the source channels.
+    int audioBlockMs;               // 0 calls back once per decoded frame.
+    AudioResampler resampler;
+    float *audioScratch;            // Planar source, remixed and resampled samples of one frame.
+    unsigned int audioScratchSize;
+    float *audioBlock;              // Planar, audioBlockCapacity samples per channel.
+    unsigned int audioBlockSize;
+    int audioBlockCapacity;
+    int audioBlockChannels;
+    int audioBlockFill;
+    double audioBlockTs;
+    double audioAnchorTs;           // Source time of the first sample since a reset or gap, -1 if none.
+    int64_t audioInSamples;         // Since the anchor.
+    int64_t audioOutSamples;
+    // For seeking.
+    int preRolling;
+    int64_t preRollTargetPts;
+    int seekPending;
+    unsigned long seekStartTick;
+    int lastSeekDuration;
+    // For fast open, set before openDecoder.
+    int probeSize;
+    int analyzeDurationMs;
+    StreamHint streamHints[2];
+    unsigned long openStartTick;
+    int firstFrameDuration;
+    // Keyframe previews, see extractThumbnails.
+    ThumbnailContext thumbnail;
+    // Video picture buffers and the memory budget, see setMemoryBudget.
+    PicturePool *picturePool;
+    char picturePoolLock;
+    int pictureCount;               // Atomic, frame threads allocate and free pictures too.
+    int64_t pictureBytes;
+    int pictureLimit;               // 0 is unlimited.
+    int pictureSize;                // Of the latest geometry, kept across pool retirement.
+    int64_t memoryBudget;
+    int64_t memoryPeak;
+    // Counters and stage latency histograms, see getStats.
+    DecoderStats stats;
 } WebDecoder;
 
-WebDecoder *decoder = NULL;
 LogLevel logLevel = kLogLevel_None;
+int decoderCount = 0;
+int poolThreadsInUse = 0;   // Codec threads reserved by open instances, see reservePoolThreads.
 
-int getAailableDataSize();
+int getAailableDataSize(WebDecoder *decoder);
 
 unsigned long getTickCount() {
     struct timespec ts;
@@ -85,75 +318,380 @@ unsigned long getTickCount() {
     return ts.tv_sec * (unsigned long)1000 + ts.tv_nsec / 1000000;
 }
 
-void simpleLog(const char* format, ...) {
-    if (logLevel == kLogLevel_None) {
-        return;
+double getTimeUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+void statsRecord(StageStats *stage, double us) {
+    double bound = kStatsFirstBucketUs;
+    int i = 0;
+    while (i < kStatsBucketCount - 1 && us >= bound) {
+        bound *= 2;
+        ++i;
     }
 
-    char szBuffer[1024] = { 0 };
-    char szTime[32]		= { 0 };
-    char *p				= NULL;
-    int prefixLength	= 0;
-    const char *tag		= "Core";
-    struct tm tmTime;
-    struct timeb tb;
+    stage->count    += 1;
+    stage->totalUs  += us;
+    stage->maxUs    = FFMAX(stage->maxUs, us);
+    stage->buckets[i] += 1;
+}
 
-    ftime(&tb);
-    localtime_r(&tb.time, &tmTime);
+#if DECODER_LOG_LEVEL > 0
+//Binary log events, formatted only when drained. Producers reserve a slot with an atomic
+//increment, so FFmpeg worker threads may log too; a full ring overwrites the oldest events.
+enum {
+    kLogRingSize    = 1024,     // Power of two.
+    kLogMaxArgs     = 8,
+    kLogTextSize    = 96,       // Copied %s arguments and FFmpeg item name.
+    kLogLineSize    = 1024
+};
+
+typedef enum LogTag {
+    kLogTag_Core = 0,
+    kLogTag_FFmpeg
+} LogTag;
+
+typedef enum LogArgType {
+    kLogArg_None = 0,           // "%%".
+    kLogArg_Int,
+    kLogArg_Unsigned,
+    kLogArg_Char,
+    kLogArg_Double,
+    kLogArg_Pointer,
+    kLogArg_String,
+    kLogArg_Unsupported
+} LogArgType;
+
+typedef union LogArg {
+    int64_t i;
+    double d;
+    const void *p;
+} LogArg;
+
+typedef struct LogEvent {
+    uint32_t seq;               // Write index + 1 once published, 0 while being filled.
+    LogTag tag;
+    const char *format;         // String literal, doubles as the event id.
+    double timeUs;
+    int source;                 // Offset of the item name in text, -1 if none.
+    int argCount;
+    int truncated;
+    LogArg args[kLogMaxArgs];
+    char text[kLogTextSize];
+} LogEvent;
+
+typedef struct LogRing {
+    LogEvent events[kLogRingSize];
+    uint32_t writeSeq;
+    uint32_t readSeq;           // Owned by the single drainLog caller.
+    uint32_t lost;
+} LogRing;
+
+//One printf conversion, "%-08.*lld" style.
+typedef struct LogSpec {
+    int length;                 // Characters from '%' to the conversion, inclusive.
+    int stars;                  // '*' width and precision, each takes an int argument.
+    char flags[8];              // Flags, width and precision without the length modifier.
+    char size[3];               // "hh", "h", "l", "ll", "j", "z", "t" or "".
+    char conv;
+    LogArgType type;
+} LogSpec;
+
+LogRing logRing;
+
+int logParseSpec(const char *p, LogSpec *spec) {
+    const char *begin = p;
+    int n = 0;
+
+    memset(spec, 0, sizeof(LogSpec));
+    ++p;
+    while (*p != 0 && strchr("-+ #0123456789.*", *p) != NULL) {
+        if (*p == '*') {
+            ++spec->stars;
+        }
+        if (n < (int)sizeof(spec->flags) - 1) {
+            spec->flags[n++] = *p;
+        }
+        ++p;
+    }
 
-    if (1) {
-        int tmYear		= tmTime.tm_year + 1900;
-        int tmMon		= tmTime.tm_mon + 1;
-        int tmMday		= tmTime.tm_mday;
-        int tmHour		= tmTime.tm_hour;
-        int tmMin		= tmTime.tm_min;
-        int tmSec		= tmTime.tm_sec;
-        int tmMillisec	= tb.millitm;
-        sprintf(szTime, "%d-%d-%d %d:%d:%d.%d", tmYear, tmMon, tmMday, tmHour, tmMin, tmSec, tmMillisec);
+    n = 0;
+    while (*p != 0 && strchr("hljztqL", *p) != NULL) {
+        if (n < (int)sizeof(spec->size) - 1) {
+            spec->size[n++] = *p;
+        }
+        ++p;
     }
 
-    prefixLength = sprintf(szBuffer, "[%s][%s][DT] ", szTime, tag);
-    p = szBuffer + prefixLength;
-    
-    if (1) {
-        va_list ap;
-        va_start(ap, format);
-        vsnprintf(p, 1024 - prefixLength, format, ap);
-        va_end(ap);
+    spec->conv = *p;
+    switch (*p) {
+        case '%':
+            spec->type = kLogArg_None;
+            break;
+        case 'd': case 'i':
+            spec->type = kLogArg_Int;
+            break;
+        case 'u': case 'x': case 'X': case 'o':
+            spec->type = kLogArg_Unsigned;
+            break;
+        case 'c':
+            spec->type = kLogArg_Char;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            spec->type = spec->size[0] == 'L' ? kLogArg_Unsupported : kLogArg_Double;
+            break;
+        case 'p':
+            spec->type = kLogArg_Pointer;
+            break;
+        case 's':
+            spec->type = spec->size[0] == 'l' ? kLogArg_Unsupported : kLogArg_String;
+            break;
+        default:
+            spec->type = kLogArg_Unsupported;
+            break;
     }
 
-    printf("%s\n", szBuffer);
+    spec->length = (int)(p - begin) + (*p != 0 ? 1 : 0);
+    return spec->length;
 }
 
-void ffmpegLogCallback(void* ptr, int level, const char* fmt, va_list vl) {
-    static int printPrefix	= 1;
-    static int count		= 0;
-    static char prev[1024]	= { 0 };
-    char line[1024]			= { 0 };
-    static int is_atty;
-    AVClass* avc = ptr ? *(AVClass**)ptr : NULL;
-    if (level > AV_LOG_DEBUG) {
-        return;
+int64_t logReadInteger(const LogSpec *spec, va_list *ap) {
+    int isSigned = spec->type == kLogArg_Int;
+    if (strcmp(spec->size, "ll") == 0 || spec->size[0] == 'q') {
+        return isSigned ? (int64_t)va_arg(*ap, long long) : (int64_t)va_arg(*ap, unsigned long long);
+    } else if (spec->size[0] == 'l') {
+        return isSigned ? (int64_t)va_arg(*ap, long) : (int64_t)va_arg(*ap, unsigned long);
+    } else if (spec->size[0] == 'j') {
+        return isSigned ? (int64_t)va_arg(*ap, intmax_t) : (int64_t)va_arg(*ap, uintmax_t);
+    } else if (spec->size[0] == 'z') {
+        return (int64_t)va_arg(*ap, size_t);
+    } else if (spec->size[0] == 't') {
+        return (int64_t)va_arg(*ap, ptrdiff_t);
+    } else if (strcmp(spec->size, "hh") == 0) {
+        return isSigned ? (int64_t)(signed char)va_arg(*ap, int) : (int64_t)(unsigned char)va_arg(*ap, int);
+    } else if (spec->size[0] == 'h') {
+        return isSigned ? (int64_t)(short)va_arg(*ap, int) : (int64_t)(unsigned short)va_arg(*ap, int);
+    }
+    return isSigned ? (int64_t)va_arg(*ap, int) : (int64_t)va_arg(*ap, unsigned int);
+}
+
+int logCopyText(LogEvent *ev, int *textUsed, const char *str) {
+    int offset = *textUsed;
+    int len = 0;
+    if (offset >= kLogTextSize) {
+        return -1;
+    }
+
+    str = str != NULL ? str : "(null)";
+    len = MIN((int)strlen(str), kLogTextSize - 1 - offset);
+    memcpy(ev->text + offset, str, len);
+    ev->text[offset + len] = 0;
+    *textUsed = offset + len + 1;
+    return offset;
+}
+
+void logRecordV(LogTag tag, const char *source, const char *format, va_list ap) {
+    uint32_t seq    = __atomic_fetch_add(&logRing.writeSeq, 1, __ATOMIC_RELAXED);
+    LogEvent *ev    = &logRing.events[seq & (kLogRingSize - 1)];
+    const char *p   = format;
+    int textUsed    = 0;
+    int i           = 0;
+    LogSpec spec;
+    va_list args;
+
+    __atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    ev->tag         = tag;
+    ev->format      = format;
+    ev->timeUs      = getTimeUs();
+    ev->argCount    = 0;
+    ev->truncated   = 0;
+    ev->source      = source != NULL ? logCopyText(ev, &textUsed, source) : -1;
+
+    va_copy(args, ap);
+    while (*p != 0 && !ev->truncated) {
+        if (*p != '%') {
+            ++p;
+            continue;
+        }
+
+        p += logParseSpec(p, &spec);
+        if (spec.type == kLogArg_None) {
+            continue;
+        }
+
+        if (spec.type == kLogArg_Unsupported || ev->argCount + spec.stars + 1 > kLogMaxArgs) {
+            ev->truncated = 1;
+            break;
+        }
+
+        for (i = 0; i < spec.stars; ++i) {
+            ev->args[ev->argCount++].i = va_arg(args, int);
+        }
+
+        switch (spec.type) {
+            case kLogArg_Int:
+            case kLogArg_Unsigned:
+                ev->args[ev->argCount++].i = logReadInteger(&spec, &args);
+                break;
+            case kLogArg_Char:
+                ev->args[ev->argCount++].i = va_arg(args, int);
+                break;
+            case kLogArg_Double:
+                ev->args[ev->argCount++].d = va_arg(args, double);
+                break;
+            case kLogArg_Pointer:
+                ev->args[ev->argCount++].p = va_arg(args, void *);
+                break;
+            case kLogArg_String:
+                ev->args[ev->argCount++].i = logCopyText(ev, &textUsed, va_arg(args, const char *));
+                break;
+            default:
+                break;
+        }
+    }
+    va_end(args);
+
+    __atomic_store_n(&ev->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+void logRecord(const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    logRecordV(kLogTag_Core, NULL, format, ap);
+    va_end(ap);
+}
+
+int logFormatEvent(const LogEvent *ev, double wallOffsetUs, char *line, int size) {
+    const char *p       = ev->format;
+    const char *text    = NULL;
+    char specBuf[32]    = { 0 };
+    char *s             = NULL;
+    int len             = 0;
+    int arg             = 0;
+    int stars[2]        = { 0 };
+    int starIdx         = 0;
+    int i               = 0;
+    double wallUs       = ev->timeUs + wallOffsetUs;
+    time_t wallSec      = (time_t)(wallUs / 1000000.0);
+    struct tm tmTime;
+    LogSpec spec;
+
+    localtime_r(&wallSec, &tmTime);
+    len = snprintf(line, size, "[%d-%d-%d %d:%d:%d.%d][%s][DT] ",
+        tmTime.tm_year + 1900, tmTime.tm_mon + 1, tmTime.tm_mday,
+        tmTime.tm_hour, tmTime.tm_min, tmTime.tm_sec,
+        (int)((int64_t)(wallUs / 1000.0) % 1000),
+        ev->tag == kLogTag_FFmpeg ? "FFmpeg" : "Core");
+    if (ev->source >= 0 && len < size) {
+        len += snprintf(line + len, size - len, "[%s] ", ev->text + ev->source);
     }
 
-    line[0] = 0;
+    while (*p != 0 && len < size - 1) {
+        if (*p != '%') {
+            line[len++] = *p++;
+            continue;
+        }
+
+        p += logParseSpec(p, &spec);
+        if (spec.type == kLogArg_None) {
+            line[len++] = '%';
+            continue;
+        }
+
+        if (spec.type == kLogArg_Unsupported || arg + spec.stars >= ev->argCount) {
+            break;
+        }
 
-    if (printPrefix && avc) {
-        if (avc->parent_log_context_offset) {
-            AVClass** parent = *(AVClass***)(((uint8_t*)ptr) + avc->parent_log_context_offset);
-            if (parent && *parent) {
-                snprintf(line, sizeof(line), "[%s @ %p] ", (*parent)->item_name(parent), parent);
+        // Rebuild the conversion with '*' resolved and integers widened to 64 bit.
+        s = specBuf;
+        *s++ = '%';
+        for (i = 0, starIdx = 0; spec.flags[i] != 0; ++i) {
+            if (spec.flags[i] == '*') {
+                stars[starIdx] = (int)ev->args[arg++].i;
+                s += sprintf(s, "%d", stars[starIdx++]);
+            } else {
+                *s++ = spec.flags[i];
             }
         }
-        snprintf(line + strlen(line), sizeof(line) - strlen(line), "[%s @ %p] ", avc->item_name(ptr), ptr);
+        if (spec.type == kLogArg_Int || spec.type == kLogArg_Unsigned) {
+            *s++ = 'l';
+            *s++ = 'l';
+        }
+        *s++ = spec.conv;
+        *s = 0;
+
+        switch (spec.type) {
+            case kLogArg_Int:
+                len += snprintf(line + len, size - len, specBuf, (long long)ev->args[arg].i);
+                break;
+            case kLogArg_Unsigned:
+                len += snprintf(line + len, size - len, specBuf, (unsigned long long)ev->args[arg].i);
+                break;
+            case kLogArg_Char:
+                len += snprintf(line + len, size - len, specBuf, (int)ev->args[arg].i);
+                break;
+            case kLogArg_Double:
+                len += snprintf(line + len, size - len, specBuf, ev->args[arg].d);
+                break;
+            case kLogArg_Pointer:
+                len += snprintf(line + len, size - len, specBuf, ev->args[arg].p);
+                break;
+            case kLogArg_String:
+                text = ev->args[arg].i >= 0 ? ev->text + ev->args[arg].i : "";
+                len += snprintf(line + len, size - len, specBuf, text);
+                break;
+            default:
+                break;
+        }
+        ++arg;
+    }
+
+    len = MIN(len, size - 1);
+    if (ev->truncated || *p != 0) {
+        len += snprintf(line + len, size - len, "...");
+        len = MIN(len, size - 1);
     }
 
-    vsnprintf(line + strlen(line), sizeof(line) - strlen(line), fmt, vl);
-    line[strlen(line) + 1] = 0;
-    simpleLog("%s", line);
+    // FFmpeg messages carry their own newline.
+    while (len > 0 && line[len - 1] == '\n') {
+        --len;
+    }
+    line[len] = 0;
+    return len;
+}
+
+double logWallOffsetUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0 - getTimeUs();
+}
+#endif
+
+#if DECODER_LOG_LEVEL >= 1
+#define simpleLog(...) do { if (logLevel != kLogLevel_None) { logRecord(__VA_ARGS__); } } while (0)
+#else
+#define simpleLog(...) do { } while (0)
+#endif
+
+#if DECODER_LOG_LEVEL >= 2
+void ffmpegLogCallback(void* ptr, int level, const char* fmt, va_list vl) {
+    AVClass* avc = ptr ? *(AVClass**)ptr : NULL;
+    if (level > AV_LOG_DEBUG || logLevel != kLogLevel_All) {
+        return;
+    }
+
+    logRecordV(kLogTag_FFmpeg, avc != NULL ? avc->item_name(ptr) : NULL, fmt, vl);
 }
+#endif
+
+int getPooledBuffer(AVCodecContext *ctx, AVFrame *frame, int flags);
 
-int openCodecContext(AVFormatContext *fmtCtx, enum AVMediaType type, int *streamIdx, AVCodecContext **decCtx) {
+//bufferOwner, a WebDecoder, makes the codec allocate pictures from its pool.
+int openCodecContext(AVFormatContext *fmtCtx, enum AVMediaType type, int threadCount, int lowDelay, void *bufferOwner, int *streamIdx, AVCodecContext **decCtx) {
     int ret = 0;
     do {
         int streamIndex		= -1;
@@ -191,11 +729,38 @@ int openCodecContext(AVFormatContext *fmtCtx, enum AVMediaType type, int *stream
 
         av_dict_set(&opts, "refcounted_frames", "0", 0);
 
+        // 0 lets FFmpeg pick one thread per core, only effective in a pthreads build.
+        if (threadCount != 1 && (dec->capabilities & (AV_CODEC_CAP_FRAME_THREADS | AV_CODEC_CAP_SLICE_THREADS))) {
+            (*decCtx)->thread_count = threadCount;
+            (*decCtx)->thread_type  = FF_THREAD_FRAME | FF_THREAD_SLICE;
+        }
+
+        // Frame threading holds thread_count - 1 pictures back, live keeps slice threading only.
+        if (lowDelay) {
+            (*decCtx)->flags        |= AV_CODEC_FLAG_LOW_DELAY;
+            (*decCtx)->thread_type  = FF_THREAD_SLICE;
+        }
+
+        // Set before open, frame thread contexts copy the callbacks. The pool locks itself.
+        if (bufferOwner != NULL) {
+            (*decCtx)->opaque               = bufferOwner;
+            (*decCtx)->get_buffer2          = getPooledBuffer;
+#if LIBAVCODEC_VERSION_MAJOR < 59
+            (*decCtx)->thread_safe_callbacks = 1;
+#endif
+        }
+
         if ((ret = avcodec_open2(*decCtx, dec, NULL)) != 0) {
             simpleLog("Failed to open %s codec.", av_get_media_type_string(type));
+            avcodec_free_context(decCtx);
             break;
         }
 
+        simpleLog("Opened %s codec with %d thread(s), type %d.",
+            av_get_media_type_string(type),
+            (*decCtx)->thread_count,
+            (*decCtx)->active_thread_type);
+
         *streamIdx = streamIndex;
         avcodec_flush_buffers(*decCtx);
     } while (0);
@@ -255,6 +820,390 @@ ErrorCode copyYuvData(AVFrame *frame, unsigned char *buffer, int width, int heig
     return ret;	
 }
 
+//2:1 box filter, each output pixel is (a + b + c + d + 2) >> 2 over a 2x2 block. The vector
+//paths sum in 16 bits so they round exactly like the scalar tail.
+void halvePlane(const uint8_t *src, int srcStride, uint8_t *dst, int dstStride, int dstWidth, int dstHeight) {
+    const uint8_t *r0 = NULL;
+    const uint8_t *r1 = NULL;
+    uint8_t *out = NULL;
+    int x = 0;
+    int y = 0;
+    for (y = 0; y < dstHeight; ++y) {
+        r0  = src + 2 * y * srcStride;
+        r1  = r0 + srcStride;
+        out = dst + y * dstStride;
+        x   = 0;
+#if defined(__wasm_simd128__)
+        const v128_t mask = wasm_i16x8_splat(0x00ff);
+        const v128_t two  = wasm_i16x8_splat(2);
+        for (; x + 16 <= dstWidth; x += 16) {
+            v128_t a0 = wasm_v128_load(r0 + 2 * x);
+            v128_t a1 = wasm_v128_load(r0 + 2 * x + 16);
+            v128_t b0 = wasm_v128_load(r1 + 2 * x);
+            v128_t b1 = wasm_v128_load(r1 + 2 * x + 16);
+            v128_t s0 = wasm_i16x8_add(wasm_i16x8_add(wasm_v128_and(a0, mask), wasm_u16x8_shr(a0, 8)),
+                wasm_i16x8_add(wasm_v128_and(b0, mask), wasm_u16x8_shr(b0, 8)));
+            v128_t s1 = wasm_i16x8_add(wasm_i16x8_add(wasm_v128_and(a1, mask), wasm_u16x8_shr(a1, 8)),
+                wasm_i16x8_add(wasm_v128_and(b1, mask), wasm_u16x8_shr(b1, 8)));
+            s0 = wasm_u16x8_shr(wasm_i16x8_add(s0, two), 2);
+            s1 = wasm_u16x8_shr(wasm_i16x8_add(s1, two), 2);
+            wasm_v128_store(out + x, wasm_u8x16_narrow_i16x8(s0, s1));
+        }
+#elif defined(__SSE2__) || defined(_M_X64)
+        const __m128i mask = _mm_set1_epi16(0x00ff);
+        const __m128i two  = _mm_set1_epi16(2);
+        for (; x + 16 <= dstWidth; x += 16) {
+            __m128i a0 = _mm_loadu_si128((const __m128i *)(r0 + 2 * x));
+            __m128i a1 = _mm_loadu_si128((const __m128i *)(r0 + 2 * x + 16));
+            __m128i b0 = _mm_loadu_si128((const __m128i *)(r1 + 2 * x));
+            __m128i b1 = _mm_loadu_si128((const __m128i *)(r1 + 2 * x + 16));
+            __m128i s0 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a0, mask), _mm_srli_epi16(a0, 8)),
+                _mm_add_epi16(_mm_and_si128(b0, mask), _mm_srli_epi16(b0, 8)));
+            __m128i s1 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a1, mask), _mm_srli_epi16(a1, 8)),
+                _mm_add_epi16(_mm_and_si128(b1, mask), _mm_srli_epi16(b1, 8)));
+            s0 = _mm_srli_epi16(_mm_add_epi16(s0, two), 2);
+            s1 = _mm_srli_epi16(_mm_add_epi16(s1, two), 2);
+            _mm_storeu_si128((__m128i *)(out + x), _mm_packus_epi16(s0, s1));
+        }
+#elif defined(__ARM_NEON)
+        for (; x + 16 <= dstWidth; x += 16) {
+            uint16x8_t s0 = vpadalq_u8(vpaddlq_u8(vld1q_u8(r0 + 2 * x)), vld1q_u8(r1 + 2 * x));
+            uint16x8_t s1 = vpadalq_u8(vpaddlq_u8(vld1q_u8(r0 + 2 * x + 16)), vld1q_u8(r1 + 2 * x + 16));
+            vst1q_u8(out + x, vcombine_u8(vrshrn_n_u16(s0, 2), vrshrn_n_u16(s1, 2)));
+        }
+#endif
+        for (; x < dstWidth; ++x) {
+            out[x] = (r0[2 * x] + r0[2 * x + 1] + r1[2 * x] + r1[2 * x + 1] + 2) >> 2;
+        }
+    }
+}
+
+//Fixed point 8.8 source positions for pixel centers, clamped so [pos, pos + 1] stays inside.
+void buildScaleMap(int srcSize, int dstSize, int *pos, uint8_t *frac) {
+    int64_t step    = ((int64_t)srcSize << 16) / dstSize;
+    int64_t p       = step / 2 - (1 << 15);
+    int i           = 0;
+    for (i = 0; i < dstSize; ++i, p += step) {
+        int64_t c = FFMAX(p, 0);
+        pos[i]  = (int)(c >> 16);
+        frac[i] = (uint8_t)((c >> 8) & 0xff);
+        if (pos[i] >= srcSize - 1) {
+            pos[i]  = srcSize - 1;
+            frac[i] = 0;
+        }
+    }
+}
+
+//Bilinear resample, the vertical blend is a straight loop the compiler vectorizes.
+void resizePlaneBilinear(const uint8_t *src, int srcStride, int srcWidth, int srcHeight,
+    uint8_t *dst, int dstStride, int dstWidth, int dstHeight, uint8_t *scratch) {
+    int *xPos       = (int *)scratch;
+    int *yPos       = xPos + dstWidth;
+    uint8_t *xFrac  = (uint8_t *)(yPos + dstHeight);
+    uint8_t *yFrac  = xFrac + dstWidth;
+    uint8_t *row    = yFrac + dstHeight;
+    const uint8_t *r0 = NULL;
+    const uint8_t *r1 = NULL;
+    uint8_t *out    = NULL;
+    int fy          = 0;
+    int x           = 0;
+    int y           = 0;
+
+    buildScaleMap(srcWidth, dstWidth, xPos, xFrac);
+    buildScaleMap(srcHeight, dstHeight, yPos, yFrac);
+    row[srcWidth] = 0;
+    for (y = 0; y < dstHeight; ++y) {
+        r0  = src + yPos[y] * srcStride;
+        r1  = yPos[y] + 1 < srcHeight ? r0 + srcStride : r0;
+        fy  = yFrac[y];
+        for (x = 0; x < srcWidth; ++x) {
+            row[x] = (uint8_t)((r0[x] * (256 - fy) + r1[x] * fy + 128) >> 8);
+        }
+
+        out = dst + y * dstStride;
+        for (x = 0; x < dstWidth; ++x) {
+            const uint8_t *p = row + xPos[x];
+            out[x] = (uint8_t)((p[0] * (256 - xFrac[x]) + p[1] * xFrac[x] + 128) >> 8);
+        }
+    }
+}
+
+//Scratch bytes scalePlane needs for a srcWidth x srcHeight plane.
+int scaleScratchSize(int srcWidth, int srcHeight, int dstWidth, int dstHeight) {
+    int halves = (srcWidth / 2) * (srcHeight / 2) + (srcWidth / 4) * (srcHeight / 4);
+    int bilinear = (dstWidth + dstHeight) * (sizeof(int) + 1) + srcWidth + 1;
+    return halves + bilinear + 64;
+}
+
+//Halves with the box filter while at least 2:1 remains, then bilinear for the rest.
+void scalePlane(const uint8_t *src, int srcStride, int srcWidth, int srcHeight,
+    uint8_t *dst, int dstWidth, int dstHeight, uint8_t *scratch) {
+    uint8_t *halves[2]  = { scratch, scratch + (srcWidth / 2) * (srcHeight / 2) };
+    uint8_t *bilinear   = halves[1] + (srcWidth / 4) * (srcHeight / 4);
+    uint8_t *target     = NULL;
+    int width           = srcWidth;
+    int height          = srcHeight;
+    int level           = 0;
+    int y               = 0;
+
+    bilinear = (uint8_t *)FFALIGN((uintptr_t)bilinear, sizeof(int));
+    while (width >= 2 * dstWidth && height >= 2 * dstHeight) {
+        target = (width / 2 == dstWidth && height / 2 == dstHeight) ? dst : halves[level & 1];
+        halvePlane(src, srcStride, target, width / 2, width / 2, height / 2);
+        src         = target;
+        width       /= 2;
+        height      /= 2;
+        srcStride   = width;
+        ++level;
+    }
+
+    if (src == dst) {
+        return;
+    }
+
+    if (width == dstWidth && height == dstHeight) {
+        for (y = 0; y < height; ++y) {
+            memcpy(dst + y * dstWidth, src + y * srcStride, dstWidth);
+        }
+        return;
+    }
+    resizePlaneBilinear(src, srcStride, width, height, dst, dstWidth, dstWidth, dstHeight, bilinear);
+}
+
+//How a decoded plane maps to 8-bit limited range output, out = (in * mul + add) >> 16.
+typedef struct PlaneMapping {
+    int depth;          // Source bits per sample, 8 or 10.
+    int identity;       // 8-bit limited range, a plain copy.
+    int shift;          // Limited range deeper than 8 bits, a rounding shift.
+    int mul;
+    int add;
+} PlaneMapping;
+
+//Full range is squeezed into 16-235 (luma) and 16-240 (chroma), what the renderer expects.
+void setupPlaneMapping(PlaneMapping *mapping, int depth, int fullRange, int chroma) {
+    double maxIn    = (double)((1 << depth) - 1);
+    double scale    = 1.0 / (1 << (depth - 8));
+    double bias     = 0.0;
+    if (fullRange) {
+        scale   = (chroma ? 224.0 : 219.0) / maxIn;
+        bias    = chroma ? 128.0 - (1 << (depth - 1)) * scale : 16.0;
+    }
+    mapping->depth      = depth;
+    mapping->identity   = depth == 8 && !fullRange;
+    mapping->shift      = fullRange ? 0 : depth - 8;
+    mapping->mul        = (int)(scale * 65536.0 + 0.5);
+    mapping->add        = (int)(bias * 65536.0 + 0.5) + (1 << 15);
+}
+
+int isSupportedPixelFormat(int format) {
+    return format == AV_PIX_FMT_YUV420P ||
+        format == AV_PIX_FMT_YUVJ420P ||
+        format == AV_PIX_FMT_YUV420P10LE;
+}
+
+//Little endian 16-bit samples down to 8 bits, in place is fine.
+void narrowRow(const uint16_t *src, uint8_t *dst, int count, const PlaneMapping *mapping) {
+    int x = 0;
+    if (mapping->shift > 0) {
+        const int shift = mapping->shift;
+#if defined(__wasm_simd128__)
+        const v128_t round = wasm_i16x8_splat(1 << (shift - 1));
+        for (; x + 16 <= count; x += 16) {
+            v128_t a = wasm_u16x8_shr(wasm_i16x8_add(wasm_v128_load(src + x), round), shift);
+            v128_t b = wasm_u16x8_shr(wasm_i16x8_add(wasm_v128_load(src + x + 8), round), shift);
+            wasm_v128_store(dst + x, wasm_u8x16_narrow_i16x8(a, b));
+        }
+#elif defined(__SSE2__) || defined(_M_X64)
+        const __m128i round = _mm_set1_epi16(1 << (shift - 1));
+        const __m128i count16 = _mm_cvtsi32_si128(shift);
+        for (; x + 16 <= count; x += 16) {
+            __m128i a = _mm_srl_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i *)(src + x)), round), count16);
+            __m128i b = _mm_srl_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i *)(src + x + 8)), round), count16);
+            _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(a, b));
+        }
+#elif defined(__ARM_NEON)
+        const int16x8_t right = vdupq_n_s16((int16_t)-shift);
+        for (; x + 16 <= count; x += 16) {
+            uint16x8_t a = vrshlq_u16(vld1q_u16(src + x), right);
+            uint16x8_t b = vrshlq_u16(vld1q_u16(src + x + 8), right);
+            vst1q_u8(dst + x, vcombine_u8(vqmovn_u16(a), vqmovn_u16(b)));
+        }
+#endif
+        for (; x < count; ++x) {
+            dst[x] = (uint8_t)MIN((src[x] + (1 << (shift - 1))) >> shift, 255);
+        }
+        return;
+    }
+
+    for (; x < count; ++x) {
+        dst[x] = (uint8_t)MIN((src[x] * mapping->mul + mapping->add) >> 16, 255);
+    }
+}
+
+//8-bit full range to limited, a straight loop the compiler vectorizes. In place is fine.
+void remapRow(const uint8_t *src, uint8_t *dst, int count, const PlaneMapping *mapping) {
+    const int mul = mapping->mul;
+    const int add = mapping->add;
+    int x = 0;
+    for (x = 0; x < count; ++x) {
+        dst[x] = (uint8_t)MIN((src[x] * mul + add) >> 16, 255);
+    }
+}
+
+void convertRow(const uint8_t *src, uint8_t *dst, int count, const PlaneMapping *mapping) {
+    if (mapping->identity) {
+        memcpy(dst, src, count);
+    } else if (mapping->depth > 8) {
+        narrowRow((const uint16_t *)src, dst, count, mapping);
+    } else {
+        remapRow(src, dst, count, mapping);
+    }
+}
+
+//U and V rows to the interleaved UV row of NV12.
+void interleaveUVRow(const uint8_t *u, const uint8_t *v, uint8_t *dst, int count) {
+    int x = 0;
+#if defined(__wasm_simd128__)
+    for (; x + 16 <= count; x += 16) {
+        v128_t a = wasm_v128_load(u + x);
+        v128_t b = wasm_v128_load(v + x);
+        wasm_v128_store(dst + 2 * x, wasm_i8x16_shuffle(a, b, 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23));
+        wasm_v128_store(dst + 2 * x + 16, wasm_i8x16_shuffle(a, b, 8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31));
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    for (; x + 16 <= count; x += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(u + x));
+        __m128i b = _mm_loadu_si128((const __m128i *)(v + x));
+        _mm_storeu_si128((__m128i *)(dst + 2 * x), _mm_unpacklo_epi8(a, b));
+        _mm_storeu_si128((__m128i *)(dst + 2 * x + 16), _mm_unpackhi_epi8(a, b));
+    }
+#elif defined(__ARM_NEON)
+    for (; x + 16 <= count; x += 16) {
+        uint8x16x2_t uv;
+        uv.val[0] = vld1q_u8(u + x);
+        uv.val[1] = vld1q_u8(v + x);
+        vst2q_u8(dst + 2 * x, uv);
+    }
+#endif
+    for (; x < count; ++x) {
+        dst[2 * x]      = u[x];
+        dst[2 * x + 1]  = v[x];
+    }
+}
+
+//Scratch bytes convertYuvData needs, the worst case of every path.
+int outputScratchSize(int width, int height, int dstWidth, int dstHeight) {
+    return FFALIGN(width * height, 16) +
+        2 * FFALIGN((dstWidth / 2) * (dstHeight / 2), 16) +
+        2 * FFALIGN(width / 2, 16) +
+        scaleScratchSize(width, height, dstWidth, dstHeight);
+}
+
+//One tightly packed 8-bit limited range plane. Without scaling the conversion is fused into
+//the row copy, when scaling 8-bit sources are remapped after it, on the smaller picture.
+void outputPlane(const uint8_t *src, int srcStride, int srcWidth, int srcHeight, const PlaneMapping *mapping,
+    uint8_t *dst, int dstWidth, int dstHeight, uint8_t *scratch) {
+    int y = 0;
+    if (srcWidth == dstWidth && srcHeight == dstHeight) {
+        for (y = 0; y < dstHeight; ++y) {
+            convertRow(src + y * srcStride, dst + y * dstWidth, dstWidth, mapping);
+        }
+        return;
+    }
+
+    if (mapping->depth > 8) {
+        // The scaler works on bytes, narrow first.
+        for (y = 0; y < srcHeight; ++y) {
+            convertRow(src + y * srcStride, scratch + y * srcWidth, srcWidth, mapping);
+        }
+        scalePlane(scratch, srcWidth, srcWidth, srcHeight, dst, dstWidth, dstHeight, scratch + FFALIGN(srcWidth * srcHeight, 16));
+        return;
+    }
+
+    scalePlane(src, srcStride, srcWidth, srcHeight, dst, dstWidth, dstHeight, scratch);
+    if (!mapping->identity) {
+        for (y = 0; y < dstHeight; ++y) {
+            remapRow(dst + y * dstWidth, dst + y * dstWidth, dstWidth, mapping);
+        }
+    }
+}
+
+//Every output other than a same size 8-bit limited YUV420P copy: 10-bit and full range
+//sources, downscaling and NV12. Output is 8-bit limited range, dstWidth and dstHeight even
+//unless they are the coded size.
+ErrorCode convertYuvData(AVFrame *frame, unsigned char *buffer, int width, int height,
+    int dstWidth, int dstHeight, OutputFormat format, unsigned char *scratch) {
+    ErrorCode ret           = kErrorCode_Success;
+    PlaneMapping luma;
+    PlaneMapping chroma;
+    unsigned char *dst      = buffer;
+    unsigned char *rows[2]  = { NULL, NULL };
+    const uint8_t *u        = NULL;
+    const uint8_t *v        = NULL;
+    int chromaWidth         = dstWidth / 2;
+    int chromaHeight        = dstHeight / 2;
+    int depth               = 8;
+    int fullRange           = 0;
+    int i = 0;
+    do {
+        if (frame == NULL || buffer == NULL || scratch == NULL) {
+            ret = kErrorCode_Invalid_Param;
+            break;
+        }
+
+        if (!frame->data[0] || !frame->data[1] || !frame->data[2]) {
+            ret = kErrorCode_Invalid_Param;
+            break;
+        }
+
+        depth       = frame->format == AV_PIX_FMT_YUV420P10LE ? 10 : 8;
+        fullRange   = frame->format == AV_PIX_FMT_YUVJ420P || frame->color_range == AVCOL_RANGE_JPEG;
+        setupPlaneMapping(&luma, depth, fullRange, 0);
+        setupPlaneMapping(&chroma, depth, fullRange, 1);
+
+        outputPlane(frame->data[0], frame->linesize[0], width, height, &luma, dst, dstWidth, dstHeight, scratch);
+        dst += dstWidth * dstHeight;
+
+        if (format == kOutputFormat_YUV420P) {
+            for (i = 1; i < 3; ++i) {
+                outputPlane(frame->data[i], frame->linesize[i], width / 2, height / 2, &chroma,
+                    dst, chromaWidth, chromaHeight, scratch);
+                dst += chromaWidth * chromaHeight;
+            }
+            break;
+        }
+
+        if (dstWidth == width && dstHeight == height) {
+            // Row by row, the converted rows stay in cache until interleaved.
+            rows[0] = scratch;
+            rows[1] = scratch + FFALIGN(chromaWidth, 16);
+            for (i = 0; i < chromaHeight; ++i) {
+                u = frame->data[1] + i * frame->linesize[1];
+                v = frame->data[2] + i * frame->linesize[2];
+                if (!chroma.identity) {
+                    convertRow(u, rows[0], chromaWidth, &chroma);
+                    convertRow(v, rows[1], chromaWidth, &chroma);
+                    u = rows[0];
+                    v = rows[1];
+                }
+                interleaveUVRow(u, v, dst + i * 2 * chromaWidth, chromaWidth);
+            }
+            break;
+        }
+
+        rows[0] = scratch;
+        rows[1] = scratch + FFALIGN(chromaWidth * chromaHeight, 16);
+        for (i = 0; i < 2; ++i) {
+            outputPlane(frame->data[i + 1], frame->linesize[i + 1], width / 2, height / 2, &chroma,
+                rows[i], chromaWidth, chromaHeight, rows[1] + FFALIGN(chromaWidth * chromaHeight, 16));
+        }
+        for (i = 0; i < chromaHeight; ++i) {
+            interleaveUVRow(rows[0] + i * chromaWidth, rows[1] + i * chromaWidth, dst + i * 2 * chromaWidth, chromaWidth);
+        }
+    } while (0);
+    return ret;
+}
+
 /*
 ErrorCode yuv420pToRgb32(unsigned char *yuvBuff, unsigned char *rgbBuff, int width, int height) {
     ErrorCode ret = kErrorCode_Success;
@@ -289,705 +1238,4229 @@ int roundUp(int numToRound, int multiple) {
     return (numToRound + multiple - 1) & -multiple;
 }
 
-ErrorCode processDecodedVideoFrame(AVFrame *frame) {
-    ErrorCode ret = kErrorCode_Success;
-    double timestamp = 0.0f;
-    do {
-        if (frame == NULL ||
-            decoder->videoCallback == NULL ||
-            decoder->yuvBuffer == NULL ||
-            decoder->videoBufferSize <= 0) {
-            ret = kErrorCode_Invalid_Param;
-            break;
-        }
+void initFramePool(WebDecoder *decoder) {
+    int i = 0;
+    for (i = 0; i < kFramePoolSize; ++i) {
+        decoder->framePool[i].frame = av_frame_alloc();
+        decoder->framePool[i].inUse = 0;
+    }
+    decoder->framesInUse = 0;
+}
 
-        if (decoder->videoCodecContext->pix_fmt != AV_PIX_FMT_YUV420P) {
-            simpleLog("Not YUV420P, but unsupported format %d.", decoder->videoCodecContext->pix_fmt);
-            ret = kErrorCode_Invalid_Format;
-            break;
+void uninitFramePool(WebDecoder *decoder) {
+    int i = 0;
+    for (i = 0; i < kFramePoolSize; ++i) {
+        if (decoder->framePool[i].frame != NULL) {
+            av_frame_free(&decoder->framePool[i].frame);
         }
+        decoder->framePool[i].inUse = 0;
+    }
+    decoder->framesInUse = 0;
+}
 
-        ret = copyYuvData(frame, decoder->yuvBuffer, decoder->videoCodecContext->width, decoder->videoCodecContext->height);
-        if (ret != kErrorCode_Success) {
-            break;
-        }
+void initPresentQueue(WebDecoder *decoder) {
+    PresentQueue *q = &decoder->present;
+    int i = 0;
+    for (i = 0; i < q->slots; ++i) {
+        q->frames[i] = av_frame_alloc();
+    }
+    q->head         = 0;
+    q->tail         = 0;
+    q->flushTail    = 0;
+    q->shown        = 0;
+    q->primed       = 0;
+}
 
-        /*
-        ret = yuv420pToRgb32(decoder->yuvBuffer, decoder->rgbBuffer, decoder->videoCodecContext->width, decoder->videoCodecContext->height);
-        if (ret != kErrorCode_Success) {
-            break;
+void uninitPresentQueue(WebDecoder *decoder) {
+    PresentQueue *q = &decoder->present;
+    int i = 0;
+    for (i = 0; i < kMaxPresentSlots; ++i) {
+        if (q->frames[i] != NULL) {
+            av_frame_free(&q->frames[i]);
         }
-        */
+    }
+    q->head         = 0;
+    q->tail         = 0;
+    q->flushTail    = 0;
+    q->shown        = 0;
+    q->primed       = 0;
+    q->clockSeq     = 0;
+}
 
-        timestamp = (double)frame->pts * av_q2d(decoder->avformatContext->streams[decoder->videoStreamIdx]->time_base);
+int presentQueueFull(WebDecoder *decoder) {
+    PresentQueue *q = &decoder->present;
+    return q->slots > 0 && q->tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) >= (unsigned int)q->slots;
+}
 
-        if (decoder->accurateSeek && timestamp < decoder->beginTimeOffset) {
-            //simpleLog("video timestamp %lf < %lf", timestamp, decoder->beginTimeOffset);
-            ret = kErrorCode_Old_Frame;
+//No room for another decoded picture until the host releases or presents one.
+int videoOutputFull(WebDecoder *decoder) {
+    return (decoder->outputMode == kOutputMode_Frame && decoder->framesInUse >= kFramePoolSize) ||
+        presentQueueFull(decoder);
+}
+
+//Producer side of a seek or live jump, queued frames are stale but the consumer may be
+//showing one, so it drops them itself on its next lookup.
+void flushPresentQueue(WebDecoder *decoder) {
+    PresentQueue *q = &decoder->present;
+    if (q->slots > 0) {
+        __atomic_store_n(&q->flushTail, q->tail, __ATOMIC_RELEASE);
+    }
+}
+
+//Media time now, -1 until setAudioClock is called.
+double presentationClock(PresentQueue *q) {
+    unsigned int seq    = 0;
+    double media        = 0.0;
+    double timeUs       = 0.0;
+    double rate         = 0.0;
+    do {
+        seq = __atomic_load_n(&q->clockSeq, __ATOMIC_ACQUIRE);
+        __atomic_load(&q->clockMedia, &media, __ATOMIC_RELAXED);
+        __atomic_load(&q->clockTimeUs, &timeUs, __ATOMIC_RELAXED);
+        __atomic_load(&q->clockRate, &rate, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&q->clockSeq, __ATOMIC_RELAXED));
+
+    if (seq == 0) {
+        return -1.0;
+    }
+    return media + (getTimeUs() - timeUs) * rate / 1000000.0;
+}
+
+FrameSlot *acquireFrameSlot(WebDecoder *decoder) {
+    FrameSlot *slot = NULL;
+    int i = 0;
+    for (i = 0; i < kFramePoolSize; ++i) {
+        if (!decoder->framePool[i].inUse && decoder->framePool[i].frame != NULL) {
+            slot = &decoder->framePool[i];
+            slot->inUse = 1;
+            slot->view.index = i;
+            ++decoder->framesInUse;
             break;
         }
-        decoder->videoCallback(decoder->yuvBuffer, decoder->videoSize, timestamp);
-    } while (0);
-    return ret;
+    }
+    return slot;
 }
 
-ErrorCode processDecodedAudioFrame(AVFrame *frame) {
-    ErrorCode ret       = kErrorCode_Success;
-    int sampleSize      = 0;
-    int audioDataSize   = 0;
-    int targetSize      = 0;
-    int offset          = 0;
-    int i               = 0;
-    int ch              = 0;
-    double timestamp    = 0.0f;
+int64_t resamplerMemory(const AudioResampler *r) {
+    return (int64_t)r->capacity * r->channels * sizeof(float) +
+        (r->filter != NULL ? (int64_t)(kResamplePhases + 1) * kResampleTaps * sizeof(float) : 0);
+}
+
+int64_t outputMemory(WebDecoder *decoder) {
+    return (int64_t)decoder->videoBufferSize + decoder->currentPcmBufferSize +
+        decoder->scaleBufferSize + decoder->thumbnail.scratchSize +
+        decoder->audioScratchSize + decoder->audioBlockSize + resamplerMemory(&decoder->resampler);
+}
+
+int64_t inputMemory(WebDecoder *decoder) {
+    return (decoder->isStream ? decoder->ring.capacity : (int64_t)decoder->cache.extentCount * kCacheExtentSize) +
+        decoder->packetQueues[kStreamType_Video].bytes + decoder->packetQueues[kStreamType_Audio].bytes;
+}
+
+int64_t memoryInUse(WebDecoder *decoder) {
+    return __atomic_load_n(&decoder->pictureBytes, __ATOMIC_RELAXED) + outputMemory(decoder) + inputMemory(decoder);
+}
+
+//Called where memory grows, codec threads included.
+void updateMemoryPeak(WebDecoder *decoder) {
+    int64_t current = memoryInUse(decoder);
+    int64_t peak    = __atomic_load_n(&decoder->memoryPeak, __ATOMIC_RELAXED);
+    while (current > peak &&
+        !__atomic_compare_exchange_n(&decoder->memoryPeak, &peak, current, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void lockPicturePool(WebDecoder *decoder) {
+    while (__atomic_test_and_set(&decoder->picturePoolLock, __ATOMIC_ACQUIRE)) {
+    }
+}
+
+void unlockPicturePool(WebDecoder *decoder) {
+    __atomic_clear(&decoder->picturePoolLock, __ATOMIC_RELEASE);
+}
+
+void freePicture(void *opaque, uint8_t *data) {
+    PicturePool *pool = (PicturePool *)opaque;
+    __atomic_sub_fetch(&pool->decoder->pictureCount, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&pool->decoder->pictureBytes, pool->size, __ATOMIC_RELAXED);
+    av_free(data);
+}
+
+//Pool growth, refused once the budget's picture limit is reached.
+AVBufferRef *allocPicture(void *opaque, int size) {
+    PicturePool *pool       = (PicturePool *)opaque;
+    WebDecoder *decoder     = pool->decoder;
+    AVBufferRef *buf        = NULL;
+    uint8_t *data           = NULL;
+    int count               = __atomic_add_fetch(&decoder->pictureCount, 1, __ATOMIC_RELAXED);
     do {
-        if (frame == NULL) {
+        if (decoder->pictureLimit > 0 && count > decoder->pictureLimit) {
+            simpleLog("Picture pool at its budget of %d pictures.", decoder->pictureLimit);
+            break;
+        }
+
+        data = (uint8_t *)av_malloc(size);
+        if (data == NULL) {
+            simpleLog("Allocate picture of %d bytes failed.", size);
+            break;
+        }
+
+        buf = av_buffer_create(data, size, freePicture, pool, 0);
+        if (buf == NULL) {
+            av_free(data);
+            break;
+        }
+
+        __atomic_add_fetch(&decoder->pictureBytes, size, __ATOMIC_RELAXED);
+        updateMemoryPeak(decoder);
+    } while (0);
+
+    if (buf == NULL) {
+        __atomic_sub_fetch(&decoder->pictureCount, 1, __ATOMIC_RELAXED);
+    }
+    return buf;
+}
+
+void freePicturePool(void *opaque) {
+    av_free(opaque);
+}
+
+//Drops the decoder's reference, idle pictures are freed now and borrowed ones when returned.
+void retirePicturePool(WebDecoder *decoder) {
+    if (decoder->picturePool != NULL) {
+        av_buffer_pool_uninit(&decoder->picturePool->pool);
+        decoder->picturePool = NULL;
+    }
+}
+
+//Returns the pool for this picture geometry, laid out like FFmpeg's default allocator so
+//codecs writing past the edge or reading ahead with SIMD behave the same. Call locked.
+PicturePool *getPicturePool(WebDecoder *decoder, AVCodecContext *ctx, int format, int width, int height) {
+    PicturePool *pool       = NULL;
+    uint8_t *data[4]        = { NULL };
+    int align[AV_NUM_DATA_POINTERS];
+    int linesize[4]         = { 0 };
+    int w                   = width;
+    int h                   = height;
+    int size                = 0;
+    int unaligned           = 0;
+    int i                   = 0;
+    do {
+        avcodec_align_dimensions2(ctx, &w, &h, align);
+        pool = decoder->picturePool;
+        if (pool != NULL && pool->format == format && pool->alignedWidth == w && pool->alignedHeight == h) {
+            break;
+        }
+
+        pool = (PicturePool *)av_mallocz(sizeof(PicturePool));
+        if (pool == NULL) {
+            break;
+        }
+        pool->decoder       = decoder;
+        pool->format        = format;
+        pool->alignedWidth  = w;
+        pool->alignedHeight = h;
+
+        // Widen until every plane's stride is aligned, the chroma stride follows the luma one.
+        do {
+            if (av_image_fill_linesizes(linesize, (enum AVPixelFormat)format, w) < 0) {
+                unaligned = 1;
+                break;
+            }
+            w += w & ~(w - 1);
+            unaligned = 0;
+            for (i = 0; i < 4; ++i) {
+                unaligned |= linesize[i] % align[i];
+            }
+        } while (unaligned);
+
+        size = av_image_fill_pointers(data, (enum AVPixelFormat)format, h, NULL, linesize);
+        if (unaligned || size <= 0) {
+            av_freep(&pool);
+            break;
+        }
+        memcpy(pool->linesize, linesize, sizeof(linesize));
+        pool->size = size + kPicturePadding;
+
+        pool->pool = av_buffer_pool_init2(pool->size, pool, allocPicture, freePicturePool);
+        if (pool->pool == NULL) {
+            av_freep(&pool);
+            break;
+        }
+
+        retirePicturePool(decoder);
+        decoder->picturePool = pool;
+        decoder->pictureSize = pool->size;
+        simpleLog("Picture pool for format %d %d*%d, %d bytes per picture.", format, pool->alignedWidth, h, pool->size);
+    } while (0);
+    return pool;
+}
+
+//get_buffer2 for video, formats the output path can't take still use FFmpeg's allocator.
+int getPooledBuffer(AVCodecContext *ctx, AVFrame *frame, int flags) {
+    WebDecoder *decoder     = (WebDecoder *)ctx->opaque;
+    PicturePool *pool       = NULL;
+    AVBufferRef *buf        = NULL;
+    int i                   = 0;
+
+    if (!(ctx->codec->capabilities & AV_CODEC_CAP_DR1) || !isSupportedPixelFormat(frame->format)) {
+        return avcodec_default_get_buffer2(ctx, frame, flags);
+    }
+
+    lockPicturePool(decoder);
+    pool = getPicturePool(decoder, ctx, frame->format, frame->width, frame->height);
+    if (pool != NULL) {
+        buf = av_buffer_pool_get(pool->pool);
+    }
+    unlockPicturePool(decoder);
+    if (buf == NULL) {
+        return AVERROR(ENOMEM);
+    }
+
+    // The buffer keeps its pool alive, a concurrent geometry change can't free pool here.
+    frame->buf[0] = buf;
+    av_image_fill_pointers(frame->data, (enum AVPixelFormat)frame->format, pool->alignedHeight, buf->data, pool->linesize);
+    for (i = 0; i < 4; ++i) {
+        frame->linesize[i] = pool->linesize[i];
+    }
+    frame->extended_data = frame->data;
+    return 0;
+}
+
+//Reference pictures the stream may keep. H.264 bounds its DPB by level and picture size
+//(MaxDpbMbs, Table A-1), an unknown level or HEVC takes the spec maximum.
+int maxReferencePictures(AVCodecContext *ctx) {
+    static const int kH264MaxDpbMbs[][2] = {
+        { 9, 396 }, { 10, 396 }, { 11, 900 }, { 12, 2376 }, { 13, 2376 }, { 20, 2376 },
+        { 21, 4752 }, { 22, 8100 }, { 30, 8100 }, { 31, 18000 }, { 32, 20480 }, { 40, 32768 },
+        { 41, 32768 }, { 42, 34816 }, { 50, 110400 }, { 51, 184320 }, { 52, 184320 }
+    };
+    int mbs     = ((ctx->width + 15) / 16) * ((ctx->height + 15) / 16);
+    int dpb     = kMaxDpbFrames;
+    int i       = 0;
+
+    switch (ctx->codec_id) {
+        case AV_CODEC_ID_H264:
+            for (i = 0; i < (int)(sizeof(kH264MaxDpbMbs) / sizeof(kH264MaxDpbMbs[0])); ++i) {
+                if (kH264MaxDpbMbs[i][0] == ctx->level && mbs > 0) {
+                    dpb = FFMIN(FFMAX(kH264MaxDpbMbs[i][1] / mbs, 1), kMaxDpbFrames);
+                    break;
+                }
+            }
+            break;
+        case AV_CODEC_ID_HEVC:
+            break;
+        case AV_CODEC_ID_VP9:
+            dpb = 8;
+            break;
+        default:
+            dpb = 0;
+            break;
+    }
+    return FFMAX(ctx->refs, dpb);
+}
+
+//Pictures the codec may hold at once: reference pictures, reorder delay, the picture being
+//decoded, one per extra frame thread and every lendable or queued picture.
+int minPooledPictures(WebDecoder *decoder) {
+    int count = kMinPooledPictures;
+    AVCodecContext *ctx = decoder->videoCodecContext;
+    if (ctx != NULL) {
+        count = FFMAX(count, maxReferencePictures(ctx) + ctx->has_b_frames + 1);
+        if (ctx->active_thread_type & FF_THREAD_FRAME) {
+            count += ctx->thread_count - 1;
+        }
+    }
+    if (decoder->outputMode == kOutputMode_Frame) {
+        count += kFramePoolSize;
+    }
+    return count + decoder->present.slots;
+}
+
+//Fills the pool up front so pictures sit in one early stretch of the heap.
+void preallocatePictures(WebDecoder *decoder, int count) {
+    AVBufferRef *bufs[64] = { NULL };
+    int i = 0;
+    count = FFMIN(count, 64);
+    lockPicturePool(decoder);
+    for (i = 0; i < count && decoder->picturePool != NULL; ++i) {
+        bufs[i] = av_buffer_pool_get(decoder->picturePool->pool);
+        if (bufs[i] == NULL) {
+            break;
+        }
+    }
+    unlockPicturePool(decoder);
+
+    simpleLog("Preallocated %d of %d pictures.", i, count);
+    while (--i >= 0) {
+        av_buffer_unref(&bufs[i]);
+    }
+}
+
+ErrorCode lendDecodedVideoFrame(WebDecoder *decoder, AVFrame *frame, double timestamp) {
+    ErrorCode ret = kErrorCode_Success;
+    FrameSlot *slot = NULL;
+    double beginUs = getTimeUs();
+    double outputUs = 0.0;
+    int i = 0;
+    do {
+        slot = acquireFrameSlot(decoder);
+        if (slot == NULL) {
+            simpleLog("Frame pool exhausted, drop frame %lf.", timestamp);
+            ++decoder->stats.droppedFrames;
+            ret = kErrorCode_Frame_Pool_Full;
+            break;
+        }
+
+        // Take over the decoder's reference, the picture buffer stays alive until released.
+        av_frame_move_ref(slot->frame, frame);
+        for (i = 0; i < 3; ++i) {
+            slot->view.data[i]      = slot->frame->data[i];
+            slot->view.linesize[i]  = slot->frame->linesize[i];
+        }
+        slot->view.width        = slot->frame->width;
+        slot->view.height       = slot->frame->height;
+        slot->view.format       = slot->frame->format;
+        slot->view.timestamp    = timestamp;
+
+        outputUs = getTimeUs();
+        statsRecord(&decoder->stats.stages[kStatsStage_VideoOutput], outputUs - beginUs);
+        decoder->videoCallback((unsigned char *)&slot->view, sizeof(FrameView), timestamp);
+        statsRecord(&decoder->stats.stages[kStatsStage_VideoCallback], getTimeUs() - outputUs);
+        ++decoder->stats.videoFrames;
+    } while (0);
+    return ret;
+}
+
+//Producer side, takes over the decoder's reference like lending does.
+ErrorCode queueDecodedVideoFrame(WebDecoder *decoder, AVFrame *frame, double timestamp) {
+    PresentQueue *q = &decoder->present;
+    unsigned int slot = q->tail % q->slots;
+    double beginUs = getTimeUs();
+    if (presentQueueFull(decoder)) {
+        simpleLog("Presentation queue full, drop frame %lf.", timestamp);
+        ++decoder->stats.droppedFrames;
+        return kErrorCode_Frame_Pool_Full;
+    }
+
+    av_frame_move_ref(q->frames[slot], frame);
+    q->timestamps[slot] = timestamp;
+    __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+    statsRecord(&decoder->stats.stages[kStatsStage_VideoOutput], getTimeUs() - beginUs);
+    ++decoder->stats.videoFrames;
+    return kErrorCode_Success;
+}
+
+//Seek pre-roll and live catch-up ask for a discard level, the quality ladder sets a floor.
+void setSkipFrame(WebDecoder *decoder, enum AVDiscard discard) {
+    enum AVDiscard floor = AVDISCARD_DEFAULT;
+    if (decoder->videoCodecContext == NULL) {
+        return;
+    }
+
+    if (decoder->qualityLevel >= kQualityLevel_KeyframeOnly) {
+        floor = AVDISCARD_NONKEY;
+    } else if (decoder->qualityLevel >= kQualityLevel_SkipNonRef) {
+        floor = AVDISCARD_NONREF;
+    }
+    decoder->videoCodecContext->skip_frame = FFMAX(discard, floor);
+}
+
+void updateQualityDiscard(WebDecoder *decoder) {
+    if (decoder->videoCodecContext != NULL) {
+        decoder->videoCodecContext->skip_loop_filter = decoder->qualityLevel >= kQualityLevel_SkipLoopFilter ?
+            AVDISCARD_ALL : AVDISCARD_DEFAULT;
+        setSkipFrame(decoder, AVDISCARD_DEFAULT);
+    }
+}
+
+void applyQualityLevel(WebDecoder *decoder, QualityLevel level) {
+    if (level == decoder->qualityLevel) {
+        return;
+    }
+
+    simpleLog("Quality level %d -> %d.", decoder->qualityLevel, level);
+    decoder->qualityLevel       = level;
+    decoder->qualityChangeTick  = getTickCount();
+    decoder->stats.qualityLevel = level;
+    ++decoder->stats.qualitySteps;
+    updateQualityDiscard(decoder);
+}
+
+void finishSeek(WebDecoder *decoder) {
+    if (decoder->preRolling) {
+        decoder->preRolling = 0;
+        setSkipFrame(decoder, AVDISCARD_DEFAULT);
+    }
+
+    if (decoder->seekPending) {
+        decoder->seekPending = 0;
+        decoder->lastSeekDuration = (int)(getTickCount() - decoder->seekStartTick);
+        decoder->stats.lastSeekMs = decoder->lastSeekDuration;
+        decoder->stats.totalSeekMs += decoder->lastSeekDuration;
+        simpleLog("Seek finished in %dms.", decoder->lastSeekDuration);
+    }
+}
+
+//Requested output size clamped to the coded size, even so chroma halves exactly.
+void getEffectiveOutputSize(WebDecoder *decoder, int *width, int *height) {
+    int codedWidth  = decoder->videoCodecContext->width;
+    int codedHeight = decoder->videoCodecContext->height;
+    *width  = codedWidth;
+    *height = codedHeight;
+    if (decoder->outputWidth > 0 && decoder->outputHeight > 0) {
+        *width  = MIN(decoder->outputWidth, codedWidth) & ~1;
+        *height = MIN(decoder->outputHeight, codedHeight) & ~1;
+        if (*width < 2 || *height < 2) {
+            *width  = codedWidth;
+            *height = codedHeight;
+        }
+    }
+}
+
+ErrorCode processDecodedVideoFrame(WebDecoder *decoder, AVFrame *frame) {
+    ErrorCode ret = kErrorCode_Success;
+    double timestamp = 0.0f;
+    double beginUs = 0.0;
+    double outputUs = 0.0;
+    int width = 0;
+    int height = 0;
+    int outputSize = 0;
+    unsigned int scratchSize = 0;
+    do {
+        if (frame == NULL ||
+            decoder->videoCallback == NULL ||
+            decoder->yuvBuffer == NULL ||
+            decoder->videoBufferSize <= 0) {
             ret = kErrorCode_Invalid_Param;
             break;
         }
 
-        sampleSize = av_get_bytes_per_sample(decoder->audioCodecContext->sample_fmt);
-        if (sampleSize < 0) {
-            simpleLog("Failed to calculate data size.");
-            ret = kErrorCode_Invalid_Data;
+        if (!isSupportedPixelFormat(frame->format)) {
+            simpleLog("Unsupported pixel format %d.", frame->format);
+            ret = kErrorCode_Invalid_Format;
+            break;
+        }
+
+        // Check before any output work, pre-roll frames are thrown away anyway.
+        timestamp = (double)frame->pts * av_q2d(decoder->avformatContext->streams[decoder->videoStreamIdx]->time_base);
+        if (decoder->accurateSeek && timestamp < decoder->beginTimeOffset) {
+            //simpleLog("video timestamp %lf < %lf", timestamp, decoder->beginTimeOffset);
+            ret = kErrorCode_Old_Frame;
+            break;
+        }
+
+        finishSeek(decoder);
+
+        if (decoder->firstFrameDuration < 0) {
+            decoder->firstFrameDuration = (int)(getTickCount() - decoder->openStartTick);
+            decoder->stats.firstFrameMs = decoder->firstFrameDuration;
+            simpleLog("First frame after %dms.", decoder->firstFrameDuration);
+        }
+
+        if (decoder->present.slots > 0) {
+            ret = queueDecodedVideoFrame(decoder, frame, timestamp);
+            break;
+        }
+
+        if (decoder->outputMode == kOutputMode_Frame) {
+            ret = lendDecodedVideoFrame(decoder, frame, timestamp);
+            break;
+        }
+
+        beginUs = getTimeUs();
+        getEffectiveOutputSize(decoder, &width, &height);
+        outputSize = width * height + 2 * (width / 2) * (height / 2);
+
+        // Sized exactly at open, only a mid-stream resolution change can outgrow it.
+        if (outputSize > decoder->videoBufferSize) {
+            av_free(decoder->yuvBuffer);
+            decoder->yuvBuffer = (unsigned char *)av_mallocz(outputSize);
+            decoder->videoBufferSize = decoder->yuvBuffer != NULL ? outputSize : 0;
+            if (decoder->yuvBuffer == NULL) {
+                ret = kErrorCode_NULL_Pointer;
+                break;
+            }
+            simpleLog("Output buffer grown to %d bytes.", outputSize);
+            updateMemoryPeak(decoder);
+        }
+
+        if (frame->format == AV_PIX_FMT_YUV420P &&
+            frame->color_range != AVCOL_RANGE_JPEG &&
+            decoder->outputFormat == kOutputFormat_YUV420P &&
+            width == decoder->videoCodecContext->width &&
+            height == decoder->videoCodecContext->height) {
+            ret = copyYuvData(frame, decoder->yuvBuffer, width, height);
+        } else {
+            scratchSize = decoder->scaleBufferSize;
+            av_fast_malloc(&decoder->scaleBuffer, &decoder->scaleBufferSize,
+                outputScratchSize(decoder->videoCodecContext->width, decoder->videoCodecContext->height, width, height));
+            if (decoder->scaleBufferSize != scratchSize) {
+                updateMemoryPeak(decoder);
+            }
+            ret = convertYuvData(frame, decoder->yuvBuffer, decoder->videoCodecContext->width, decoder->videoCodecContext->height,
+                width, height, decoder->outputFormat, decoder->scaleBuffer);
+        }
+        if (ret != kErrorCode_Success) {
+            break;
+        }
+        outputUs = getTimeUs();
+        statsRecord(&decoder->stats.stages[kStatsStage_VideoOutput], outputUs - beginUs);
+
+        /*
+        ret = yuv420pToRgb32(decoder->yuvBuffer, decoder->rgbBuffer, decoder->videoCodecContext->width, decoder->videoCodecContext->height);
+        if (ret != kErrorCode_Success) {
+            break;
+        }
+        */
+
+        decoder->videoCallback(decoder->yuvBuffer, outputSize, timestamp);
+        statsRecord(&decoder->stats.stages[kStatsStage_VideoCallback], getTimeUs() - outputUs);
+        ++decoder->stats.videoFrames;
+        decoder->stats.videoBytesOut += outputSize;
+    } while (0);
+    return ret;
+}
+
+void interleaveFloatPlanes(const float **planes, float *dst, int channels, int samples) {
+    int i   = 0;
+    int ch  = 0;
+    if (channels == 1) {
+        memcpy(dst, planes[0], samples * sizeof(float));
+        return;
+    }
+
+    if (channels == 2) {
+        const float *l = planes[0];
+        const float *r = planes[1];
+#if defined(__wasm_simd128__)
+        for (; i + 4 <= samples; i += 4) {
+            v128_t vl = wasm_v128_load(l + i);
+            v128_t vr = wasm_v128_load(r + i);
+            wasm_v128_store(dst + 2 * i, wasm_i32x4_shuffle(vl, vr, 0, 4, 1, 5));
+            wasm_v128_store(dst + 2 * i + 4, wasm_i32x4_shuffle(vl, vr, 2, 6, 3, 7));
+        }
+#elif defined(__SSE2__) || defined(_M_X64)
+        for (; i + 4 <= samples; i += 4) {
+            __m128 vl = _mm_loadu_ps(l + i);
+            __m128 vr = _mm_loadu_ps(r + i);
+            _mm_storeu_ps(dst + 2 * i, _mm_unpacklo_ps(vl, vr));
+            _mm_storeu_ps(dst + 2 * i + 4, _mm_unpackhi_ps(vl, vr));
+        }
+#elif defined(__ARM_NEON)
+        for (; i + 4 <= samples; i += 4) {
+            float32x4x2_t v;
+            v.val[0] = vld1q_f32(l + i);
+            v.val[1] = vld1q_f32(r + i);
+            vst2q_f32(dst + 2 * i, v);
+        }
+#endif
+        for (; i < samples; ++i) {
+            dst[2 * i]      = l[i];
+            dst[2 * i + 1]  = r[i];
+        }
+        return;
+    }
+
+    for (i = 0; i < samples; ++i) {
+        for (ch = 0; ch < channels; ++ch) {
+            *dst++ = planes[ch][i];
+        }
+    }
+}
+
+void deinterleaveFloat(const float *src, float *dst, int channels, int samples) {
+    int i   = 0;
+    int ch  = 0;
+    for (ch = 0; ch < channels; ++ch) {
+        float *out = dst + ch * samples;
+        for (i = 0; i < samples; ++i) {
+            out[i] = src[i * channels + ch];
+        }
+    }
+}
+
+void convertS16ToFloat(const int16_t *src, float *dst, int count) {
+    const float scale = 1.0f / 32768.0f;
+    int i = 0;
+#if !defined(__wasm_simd128__) && (defined(__SSE2__) || defined(_M_X64))
+    const __m128 vscale = _mm_set1_ps(scale);
+    for (; i + 8 <= count; i += 8) {
+        __m128i v   = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i lo  = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi  = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), vscale));
+        _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), vscale));
+    }
+#endif
+    for (; i < count; ++i) {
+        dst[i] = src[i] * scale;
+    }
+}
+
+int isFloatConvertible(enum AVSampleFormat fmt) {
+    return fmt == AV_SAMPLE_FMT_FLTP || fmt == AV_SAMPLE_FMT_FLT ||
+        fmt == AV_SAMPLE_FMT_S16P || fmt == AV_SAMPLE_FMT_S16;
+}
+
+//What audioCallback will get, from the stream parameters while the audio decoder is closed.
+enum AVSampleFormat getOutputSampleFormat(WebDecoder *decoder) {
+    enum AVSampleFormat fmt = AV_SAMPLE_FMT_NONE;
+    if (decoder->audioCodecContext != NULL) {
+        fmt = decoder->audioCodecContext->sample_fmt;
+    } else if (decoder->audioStreamIdx >= 0) {
+        fmt = (enum AVSampleFormat)decoder->avformatContext->streams[decoder->audioStreamIdx]->codecpar->format;
+    }
+
+    if (fmt == AV_SAMPLE_FMT_NONE) {
+        return fmt;
+    }
+
+    if (isFloatConvertible(fmt)) {
+        return decoder->audioLayout == kAudioLayout_Planar ? AV_SAMPLE_FMT_FLTP : AV_SAMPLE_FMT_FLT;
+    }
+    return av_get_packed_sample_fmt(fmt);
+}
+
+//Convert one frame to Float32, planes of nb_samples or interleaved, single pass over the samples.
+void convertAudioToFloat(WebDecoder *decoder, AVFrame *frame, float *dst, int planar) {
+    enum AVSampleFormat fmt = decoder->audioCodecContext->sample_fmt;
+    int channels            = decoder->audioCodecContext->channels;
+    int samples             = frame->nb_samples;
+    int ch                  = 0;
+
+    switch (fmt) {
+        case AV_SAMPLE_FMT_FLTP:
+            if (planar) {
+                for (ch = 0; ch < channels; ++ch) {
+                    memcpy(dst + ch * samples, frame->extended_data[ch], samples * sizeof(float));
+                }
+            } else {
+                interleaveFloatPlanes((const float **)frame->extended_data, dst, channels, samples);
+            }
+            break;
+        case AV_SAMPLE_FMT_FLT:
+            if (planar) {
+                deinterleaveFloat((const float *)frame->data[0], dst, channels, samples);
+            } else {
+                memcpy(dst, frame->data[0], samples * channels * sizeof(float));
+            }
+            break;
+        case AV_SAMPLE_FMT_S16P:
+            if (planar) {
+                for (ch = 0; ch < channels; ++ch) {
+                    convertS16ToFloat((const int16_t *)frame->extended_data[ch], dst + ch * samples, samples);
+                }
+            } else {
+                int i = 0;
+                for (i = 0; i < samples; ++i) {
+                    for (ch = 0; ch < channels; ++ch) {
+                        *dst++ = ((const int16_t *)frame->extended_data[ch])[i] * (1.0f / 32768.0f);
+                    }
+                }
+            }
+            break;
+        case AV_SAMPLE_FMT_S16:
+            if (planar) {
+                int i = 0;
+                for (ch = 0; ch < channels; ++ch) {
+                    const int16_t *src = (const int16_t *)frame->data[0] + ch;
+                    float *out = dst + ch * samples;
+                    for (i = 0; i < samples; ++i) {
+                        out[i] = src[i * channels] * (1.0f / 32768.0f);
+                    }
+                }
+            } else {
+                convertS16ToFloat((const int16_t *)frame->data[0], dst, samples * channels);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+//Zeroth order modified Bessel function of the first kind, for the Kaiser window.
+double besselI0(double x) {
+    double sum  = 1.0;
+    double term = 1.0;
+    int k       = 0;
+    for (k = 1; k < 32; ++k) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+//Phase p is the kernel shifted by p / kResamplePhases samples, each phase sums to 1.
+float *buildResampleFilter(int inRate, int outRate) {
+    const int half  = kResampleTaps / 2;
+    double cutoff   = kResampleCutoff * FFMIN(1.0, (double)outRate / inRate);
+    double norm     = besselI0(kResampleKaiserBeta);
+    float *filter   = (float *)av_malloc((kResamplePhases + 1) * kResampleTaps * sizeof(float));
+    int p           = 0;
+    int t           = 0;
+    if (filter == NULL) {
+        return NULL;
+    }
+
+    for (p = 0; p <= kResamplePhases; ++p) {
+        float *taps = filter + p * kResampleTaps;
+        double sum  = 0.0;
+        for (t = 0; t < kResampleTaps; ++t) {
+            double x = t - (half - 1) - (double)p / kResamplePhases;
+            double r = x / half;
+            double w = r * r < 1.0 ? besselI0(kResampleKaiserBeta * sqrt(1.0 - r * r)) / norm : 0.0;
+            double k = x == 0.0 ? cutoff : sin(M_PI * cutoff * x) / (M_PI * x);
+            taps[t] = (float)(k * w);
+            sum += k * w;
+        }
+        for (t = 0; t < kResampleTaps; ++t) {
+            taps[t] = (float)(taps[t] / sum);
+        }
+    }
+    return filter;
+}
+
+float dotResampleTaps(const float *x, const float *h) {
+    float sum   = 0.0f;
+    int t       = 0;
+#if defined(__wasm_simd128__)
+    v128_t acc = wasm_f32x4_splat(0.0f);
+    for (; t + 4 <= kResampleTaps; t += 4) {
+        acc = wasm_f32x4_add(acc, wasm_f32x4_mul(wasm_v128_load(x + t), wasm_v128_load(h + t)));
+    }
+    sum = wasm_f32x4_extract_lane(acc, 0) + wasm_f32x4_extract_lane(acc, 1) +
+        wasm_f32x4_extract_lane(acc, 2) + wasm_f32x4_extract_lane(acc, 3);
+#elif defined(__SSE2__) || defined(_M_X64)
+    __m128 acc = _mm_setzero_ps();
+    for (; t + 4 <= kResampleTaps; t += 4) {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x + t), _mm_loadu_ps(h + t)));
+    }
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    sum = _mm_cvtss_f32(acc);
+#elif defined(__ARM_NEON)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; t + 4 <= kResampleTaps; t += 4) {
+        acc = vmlaq_f32(acc, vld1q_f32(x + t), vld1q_f32(h + t));
+    }
+    sum = vgetq_lane_f32(acc, 0) + vgetq_lane_f32(acc, 1) + vgetq_lane_f32(acc, 2) + vgetq_lane_f32(acc, 3);
+#endif
+    for (; t < kResampleTaps; ++t) {
+        sum += x[t] * h[t];
+    }
+    return sum;
+}
+
+void resetResampler(AudioResampler *r) {
+    // Zeros ahead of the first sample center the first window on it, no delay to compensate.
+    r->fill = kResampleTaps / 2 - 1;
+    r->pos  = 0.0;
+    if (r->history != NULL) {
+        memset(r->history, 0, (size_t)r->capacity * r->channels * sizeof(float));
+    }
+}
+
+void freeResampler(AudioResampler *r) {
+    av_freep(&r->filter);
+    av_freep(&r->history);
+    r->inRate   = 0;
+    r->outRate  = 0;
+    r->channels = 0;
+    r->capacity = 0;
+    r->fill     = 0;
+}
+
+//Rebuilds the filter when the conversion changes and grows history to take samples more.
+ErrorCode prepareResampler(AudioResampler *r, int inRate, int outRate, int channels, int samples) {
+    float *history  = NULL;
+    int capacity    = 0;
+    int ch          = 0;
+    if (r->inRate != inRate || r->outRate != outRate || r->channels != channels) {
+        freeResampler(r);
+        r->filter = buildResampleFilter(inRate, outRate);
+        if (r->filter == NULL) {
+            return kErrorCode_NULL_Pointer;
+        }
+        r->inRate   = inRate;
+        r->outRate  = outRate;
+        r->channels = channels;
+        r->step     = (double)inRate / outRate;
+        resetResampler(r);
+        simpleLog("Audio resampler %d to %d Hz, %d channels.", inRate, outRate, channels);
+    }
+
+    if (r->capacity >= r->fill + samples) {
+        return kErrorCode_Success;
+    }
+
+    capacity = FFMAX(r->fill + samples, kResampleTaps * 4);
+    history = (float *)av_mallocz((size_t)capacity * channels * sizeof(float));
+    if (history == NULL) {
+        return kErrorCode_NULL_Pointer;
+    }
+    for (ch = 0; ch < channels && r->history != NULL; ++ch) {
+        memcpy(history + ch * capacity, r->history + ch * r->capacity, r->fill * sizeof(float));
+    }
+    av_free(r->history);
+    r->history  = history;
+    r->capacity = capacity;
+    return kErrorCode_Success;
+}
+
+//Outputs runResampler may write for samples more input.
+int resamplerMaxOutput(const AudioResampler *r, int samples) {
+    return (int)((r->fill + samples) / r->step) + 2;
+}
+
+//Appends planar input (stride samples) to the history and writes every output whose window is
+//complete to dst planes of dstStride, returns the outputs per channel.
+int runResampler(AudioResampler *r, const float *src, int samples, float *dst, int dstStride) {
+    int count   = 0;
+    int start   = 0;
+    int ch      = 0;
+    for (ch = 0; ch < r->channels; ++ch) {
+        memcpy(r->history + ch * r->capacity + r->fill, src + ch * samples, samples * sizeof(float));
+    }
+    r->fill += samples;
+
+    while ((int)r->pos + kResampleTaps <= r->fill) {
+        double phase    = (r->pos - (int)r->pos) * kResamplePhases;
+        int p           = (int)phase;
+        float frac      = (float)(phase - p);
+        const float *h0 = r->filter + p * kResampleTaps;
+        start = (int)r->pos;
+        for (ch = 0; ch < r->channels; ++ch) {
+            const float *x  = r->history + ch * r->capacity + start;
+            float a         = dotResampleTaps(x, h0);
+            float b         = dotResampleTaps(x, h0 + kResampleTaps);
+            dst[ch * dstStride + count] = a + frac * (b - a);
+        }
+        ++count;
+        r->pos += r->step;
+    }
+
+    start = (int)r->pos;
+    for (ch = 0; ch < r->channels; ++ch) {
+        float *history = r->history + ch * r->capacity;
+        memmove(history, history + start, (r->fill - start) * sizeof(float));
+    }
+    r->fill -= start;
+    r->pos -= start;
+    return count;
+}
+
+//Maps planar channels onto mono or stereo, 5.1 and up downmix center and surrounds into stereo.
+void remixAudioPlanes(const float *src, int inChannels, float *dst, int outChannels, int samples) {
+    const float *in[6];
+    float *l    = dst;
+    float *r    = dst + samples;
+    float scale = 0.0f;
+    int i       = 0;
+    int ch      = 0;
+    for (ch = 0; ch < 6; ++ch) {
+        in[ch] = src + FFMIN(ch, inChannels - 1) * samples;
+    }
+
+    if (outChannels == 1) {
+        scale = 1.0f / inChannels;
+        memset(l, 0, samples * sizeof(float));
+        for (ch = 0; ch < inChannels; ++ch) {
+            const float *plane = src + ch * samples;
+            for (i = 0; i < samples; ++i) {
+                l[i] += plane[i] * scale;
+            }
+        }
+    } else if (inChannels >= 6) {
+        // FL FR FC LFE BL BR, LFE dropped.
+        const float c = 0.70710678f;
+        scale = 1.0f / (1.0f + 2.0f * c);
+        for (i = 0; i < samples; ++i) {
+            float center = c * in[2][i];
+            l[i] = (in[0][i] + center + c * in[4][i]) * scale;
+            r[i] = (in[1][i] + center + c * in[5][i]) * scale;
+        }
+    } else {
+        memcpy(l, in[0], samples * sizeof(float));
+        memcpy(r, in[1], samples * sizeof(float));
+    }
+}
+
+//Native conversion needs Float32 samples, other formats keep the per frame path.
+int audioOutputActive(WebDecoder *decoder) {
+    enum AVSampleFormat fmt = getOutputSampleFormat(decoder);
+    return (fmt == AV_SAMPLE_FMT_FLT || fmt == AV_SAMPLE_FMT_FLTP) &&
+        (decoder->audioOutRate > 0 || decoder->audioOutChannels > 0 || decoder->audioBlockMs > 0);
+}
+
+//Doubles so an odd oversized frame doesn't start a free and allocate cycle.
+ErrorCode ensurePcmBuffer(WebDecoder *decoder, int size) {
+    int targetSize = 0;
+    if (decoder->pcmBuffer != NULL && decoder->currentPcmBufferSize >= size) {
+        return kErrorCode_Success;
+    }
+
+    targetSize = FFMAX(FFMAX(decoder->currentPcmBufferSize * 2, kInitialPcmBufferSize), roundUp(size, 4));
+    simpleLog("Current PCM buffer size %d not sufficient for data size %d, grow to %d.",
+        decoder->currentPcmBufferSize,
+        size,
+        targetSize);
+    av_free(decoder->pcmBuffer);
+    decoder->pcmBuffer = (unsigned char*)av_mallocz(targetSize);
+    decoder->currentPcmBufferSize = decoder->pcmBuffer != NULL ? targetSize : 0;
+    if (decoder->pcmBuffer == NULL) {
+        return kErrorCode_NULL_Pointer;
+    }
+    updateMemoryPeak(decoder);
+    return kErrorCode_Success;
+}
+
+//Hands the pending block to audioCallback in the requested layout, a partial block too.
+ErrorCode flushAudioBlock(WebDecoder *decoder) {
+    ErrorCode ret       = kErrorCode_Success;
+    int channels        = decoder->audioBlockChannels;
+    int samples         = decoder->audioBlockFill;
+    int capacity        = decoder->audioBlockCapacity;
+    int size            = samples * channels * sizeof(float);
+    float *dst          = NULL;
+    int ch              = 0;
+    double beginUs      = 0.0;
+    do {
+        if (samples == 0 || decoder->audioCallback == NULL) {
+            break;
+        }
+
+        ret = ensurePcmBuffer(decoder, size);
+        if (ret != kErrorCode_Success) {
+            break;
+        }
+
+        dst = (float *)decoder->pcmBuffer;
+        if (decoder->audioLayout == kAudioLayout_Planar) {
+            for (ch = 0; ch < channels; ++ch) {
+                memcpy(dst + ch * samples, decoder->audioBlock + ch * capacity, samples * sizeof(float));
+            }
+        } else if (channels <= 2) {
+            const float *planes[2] = { decoder->audioBlock, decoder->audioBlock + capacity };
+            interleaveFloatPlanes(planes, dst, channels, samples);
+        } else {
+            int i = 0;
+            for (i = 0; i < samples; ++i) {
+                for (ch = 0; ch < channels; ++ch) {
+                    *dst++ = decoder->audioBlock[ch * capacity + i];
+                }
+            }
+        }
+
+        beginUs = getTimeUs();
+        decoder->audioCallback(decoder->pcmBuffer, size, decoder->audioBlockTs);
+        statsRecord(&decoder->stats.stages[kStatsStage_AudioCallback], getTimeUs() - beginUs);
+        ++decoder->stats.audioFrames;
+        decoder->stats.audioBytesOut += size;
+    } while (0);
+    decoder->audioBlockFill = 0;
+    return ret;
+}
+
+//Drops pending output and resampler state, the next frame starts a new output clock.
+void resetAudioOutput(WebDecoder *decoder) {
+    decoder->audioBlockFill = 0;
+    decoder->audioAnchorTs  = -1.0;
+    resetResampler(&decoder->resampler);
+}
+
+void freeAudioOutput(WebDecoder *decoder) {
+    resetAudioOutput(decoder);
+    freeResampler(&decoder->resampler);
+    av_freep(&decoder->audioScratch);
+    av_freep(&decoder->audioBlock);
+    decoder->audioScratchSize   = 0;
+    decoder->audioBlockSize     = 0;
+    decoder->audioBlockCapacity = 0;
+    decoder->audioBlockChannels = 0;
+}
+
+//Converts, remixes and resamples one frame into the pending block, calling back whenever a
+//block of audioBlockMs fills or after every frame without batching.
+ErrorCode processAudioOutput(WebDecoder *decoder, AVFrame *frame, double timestamp) {
+    ErrorCode ret       = kErrorCode_Success;
+    int inChannels      = decoder->audioCodecContext->channels;
+    int inRate          = decoder->audioCodecContext->sample_rate;
+    int channels        = decoder->audioOutChannels > 0 ? decoder->audioOutChannels : inChannels;
+    int rate            = decoder->audioOutRate > 0 ? decoder->audioOutRate : inRate;
+    int samples         = frame->nb_samples;
+    int resample        = rate != inRate;
+    int remix           = channels != inChannels;
+    int count           = samples;
+    int stride          = samples;
+    int capacity        = 0;
+    int offset          = 0;
+    int n               = 0;
+    int ch              = 0;
+    unsigned int scratchSize = decoder->audioScratchSize;
+    unsigned int blockSize = decoder->audioBlockSize;
+    float *source       = NULL;
+    float *mixed        = NULL;
+    float *out          = NULL;
+    double expected     = 0.0;
+    double beginUs      = getTimeUs();
+    do {
+        if (inRate <= 0 || inChannels <= 0 || samples <= 0) {
+            ret = kErrorCode_Invalid_Data;
+            break;
+        }
+
+        // A gap or overlap in the source restarts the clock, the block so far goes out as is.
+        expected = decoder->audioAnchorTs + (double)decoder->audioInSamples / inRate;
+        if (decoder->audioAnchorTs < 0.0 || fabs(timestamp - expected) > kAudioGapSec) {
+            if (decoder->audioAnchorTs >= 0.0) {
+                simpleLog("Audio timestamp %lf, expected %lf, restart output clock.", timestamp, expected);
+            }
+            flushAudioBlock(decoder);
+            resetAudioOutput(decoder);
+            decoder->audioAnchorTs      = timestamp;
+            decoder->audioInSamples     = 0;
+            decoder->audioOutSamples    = 0;
+        }
+        decoder->audioInSamples += samples;
+
+        if (resample) {
+            ret = prepareResampler(&decoder->resampler, inRate, rate, channels, samples);
+            if (ret != kErrorCode_Success) {
+                break;
+            }
+            stride = resamplerMaxOutput(&decoder->resampler, samples);
+        }
+
+        av_fast_malloc(&decoder->audioScratch, &decoder->audioScratchSize,
+            ((size_t)inChannels * samples + (remix ? channels * samples : 0) + (resample ? channels * stride : 0)) * sizeof(float));
+        if (decoder->audioScratch == NULL) {
+            decoder->audioScratchSize = 0;
+            ret = kErrorCode_NULL_Pointer;
+            break;
+        }
+
+        source = decoder->audioScratch;
+        convertAudioToFloat(decoder, frame, source, 1);
+        mixed = source;
+        if (remix) {
+            mixed = source + inChannels * samples;
+            remixAudioPlanes(source, inChannels, mixed, channels, samples);
+        }
+        out = mixed;
+        if (resample) {
+            out = mixed + (remix ? channels : inChannels) * samples;
+            count = runResampler(&decoder->resampler, mixed, samples, out, stride);
+        }
+
+        capacity = decoder->audioBlockMs > 0 ? FFMAX(1, rate * decoder->audioBlockMs / 1000) : FFMAX(count, 1);
+        if (capacity != decoder->audioBlockCapacity || channels != decoder->audioBlockChannels) {
+            flushAudioBlock(decoder);
+            av_fast_malloc(&decoder->audioBlock, &decoder->audioBlockSize, (size_t)capacity * channels * sizeof(float));
+            if (decoder->audioBlock == NULL) {
+                decoder->audioBlockSize = 0;
+                decoder->audioBlockCapacity = 0;
+                ret = kErrorCode_NULL_Pointer;
+                break;
+            }
+            decoder->audioBlockCapacity = capacity;
+            decoder->audioBlockChannels = channels;
+        }
+
+        if (decoder->audioScratchSize != scratchSize || decoder->audioBlockSize != blockSize) {
+            updateMemoryPeak(decoder);
+        }
+        statsRecord(&decoder->stats.stages[kStatsStage_AudioOutput], getTimeUs() - beginUs);
+
+        for (offset = 0; offset < count; offset += n) {
+            n = FFMIN(count - offset, capacity - decoder->audioBlockFill);
+            if (decoder->audioBlockFill == 0) {
+                decoder->audioBlockTs = decoder->audioAnchorTs + (double)decoder->audioOutSamples / rate;
+            }
+            for (ch = 0; ch < channels; ++ch) {
+                memcpy(decoder->audioBlock + ch * capacity + decoder->audioBlockFill,
+                    out + ch * stride + offset, n * sizeof(float));
+            }
+            decoder->audioBlockFill += n;
+            decoder->audioOutSamples += n;
+            if (decoder->audioBlockFill == capacity) {
+                ret = flushAudioBlock(decoder);
+            }
+        }
+
+        if (decoder->audioBlockMs == 0) {
+            ret = flushAudioBlock(decoder);
+        }
+    } while (0);
+    return ret;
+}
+
+ErrorCode processDecodedAudioFrame(WebDecoder *decoder, AVFrame *frame) {
+    ErrorCode ret       = kErrorCode_Success;
+    int sampleSize      = 0;
+    int audioDataSize   = 0;
+    int offset          = 0;
+    int i               = 0;
+    int ch              = 0;
+    double timestamp    = 0.0f;
+    double beginUs      = 0.0;
+    double outputUs     = 0.0;
+    do {
+        if (frame == NULL) {
+            ret = kErrorCode_Invalid_Param;
+            break;
+        }
+
+        timestamp = (double)frame->pts * av_q2d(decoder->avformatContext->streams[decoder->audioStreamIdx]->time_base);
+
+        if (decoder->accurateSeek && timestamp < decoder->beginTimeOffset) {
+            //simpleLog("audio timestamp %lf < %lf", timestamp, decoder->beginTimeOffset);
+            ret = kErrorCode_Old_Frame;
+            break;
+        }
+
+        if (audioOutputActive(decoder)) {
+            ret = processAudioOutput(decoder, frame, timestamp);
+            break;
+        }
+
+        sampleSize = av_get_bytes_per_sample(getOutputSampleFormat(decoder));
+        if (sampleSize <= 0) {
+            simpleLog("Failed to calculate data size.");
+            ret = kErrorCode_Invalid_Data;
+            break;
+        }
+
+        audioDataSize = frame->nb_samples * decoder->audioCodecContext->channels * sampleSize;
+        ret = ensurePcmBuffer(decoder, audioDataSize);
+        if (ret != kErrorCode_Success) {
+            break;
+        }
+
+        beginUs = getTimeUs();
+        if (isFloatConvertible(decoder->audioCodecContext->sample_fmt)) {
+            convertAudioToFloat(decoder, frame, (float *)decoder->pcmBuffer, decoder->audioLayout == kAudioLayout_Planar);
+        } else {
+            for (i = 0; i < frame->nb_samples; i++) {
+                for (ch = 0; ch < decoder->audioCodecContext->channels; ch++) {
+                    memcpy(decoder->pcmBuffer + offset, frame->data[ch] + sampleSize * i, sampleSize);
+                    offset += sampleSize;
+                }
+            }
+        }
+
+        outputUs = getTimeUs();
+        statsRecord(&decoder->stats.stages[kStatsStage_AudioOutput], outputUs - beginUs);
+
+        if (decoder->audioCallback != NULL) {
+            decoder->audioCallback(decoder->pcmBuffer, audioDataSize, timestamp);
+            statsRecord(&decoder->stats.stages[kStatsStage_AudioCallback], getTimeUs() - outputUs);
+            ++decoder->stats.audioFrames;
+            decoder->stats.audioBytesOut += audioDataSize;
+        }
+    } while (0);
+    return ret;
+}
+
+ErrorCode decodePacket(WebDecoder *decoder, AVPacket *pkt, int *decodedLen) {
+    int ret = 0;
+    int isVideo = 0;
+    int oldFrames = 0;
+    int newFrames = 0;
+    double beginUs = 0.0;
+    double decodeUs = 0.0;
+    AVCodecContext *codecContext = NULL;
+
+    if (pkt == NULL || decodedLen == NULL) {
+        simpleLog("decodePacket invalid param.");
+        return kErrorCode_Invalid_Param;
+    }
+
+    *decodedLen = 0;
+
+    if (pkt->stream_index == decoder->videoStreamIdx) {
+        codecContext = decoder->videoCodecContext;
+        isVideo = 1;
+    } else if (pkt->stream_index == decoder->audioStreamIdx) {
+        codecContext = decoder->audioCodecContext;
+        isVideo = 0;
+    } else {
+        return kErrorCode_Invalid_Data;
+    }
+
+    // Only pictures before the seek target may be skipped, they would be dropped anyway.
+    if (isVideo && decoder->preRolling) {
+        setSkipFrame(decoder, (pkt->pts != AV_NOPTS_VALUE && pkt->pts < decoder->preRollTargetPts) ?
+            AVDISCARD_NONREF : AVDISCARD_DEFAULT);
+    }
+
+    beginUs = getTimeUs();
+    ret = avcodec_send_packet(codecContext, pkt);
+    decodeUs = getTimeUs() - beginUs;
+    if (ret < 0) {
+        simpleLog("Error sending a packet for decoding %d.", ret);
+        return kErrorCode_FFmpeg_Error;
+    }
+
+    // Always drain every pending frame, otherwise the next send_packet gets EAGAIN.
+    // Only codec time is recorded for the packet, output work has its own stages.
+    while (ret >= 0) {
+        beginUs = getTimeUs();
+        ret = avcodec_receive_frame(codecContext, decoder->avFrame);
+        decodeUs += getTimeUs() - beginUs;
+        if (ret == AVERROR(EAGAIN)) {
+            break;
+        } else if (ret == AVERROR_EOF) {
+            return kErrorCode_Eof;
+        } else if (ret < 0) {
+            simpleLog("Error during decoding %d.", ret);
+            return kErrorCode_FFmpeg_Error;
+        } else {
+            int r = isVideo ? processDecodedVideoFrame(decoder, decoder->avFrame) : processDecodedAudioFrame(decoder, decoder->avFrame);
+            if (r == kErrorCode_Old_Frame) {
+                ++oldFrames;
+                ++decoder->stats.oldFrames;
+            } else {
+                ++newFrames;
+            }
+        }
+    }
+
+    statsRecord(&decoder->stats.stages[kStatsStage_Decode], decodeUs);
+
+    if (oldFrames > 0 && newFrames == 0) {
+        return kErrorCode_Old_Frame;
+    }
+
+    *decodedLen = pkt->size;
+    return kErrorCode_Success;
+}
+
+//Pushes out the frames still in the codec after end of stream, frame threading keeps up to
+//thread_count - 1 pictures in flight. Stops while the video output is full and resumes on the
+//next call, returns 1 once the codec is empty.
+int drainCodecContext(WebDecoder *decoder, AVCodecContext *codecContext, int isVideo) {
+    int *state = &decoder->drainState[isVideo ? kStreamType_Video : kStreamType_Audio];
+    if (codecContext == NULL || *state == 2) {
+        return 1;
+    }
+
+    if (*state == 0) {
+        if (avcodec_send_packet(codecContext, NULL) < 0) {
+            *state = 2;
+            return 1;
+        }
+        *state = 1;
+    }
+
+    while (!(isVideo && videoOutputFull(decoder))) {
+        if (avcodec_receive_frame(codecContext, decoder->avFrame) != 0) {
+            *state = 2;
+            return 1;
+        }
+
+        if (isVideo) {
+            processDecodedVideoFrame(decoder, decoder->avFrame);
+        } else {
+            processDecodedAudioFrame(decoder, decoder->avFrame);
+        }
+    }
+    return 0;
+}
+
+int ringInit(RingBuffer *ring, int capacity) {
+    ring->data      = (unsigned char *)av_malloc(capacity);
+    ring->capacity  = ring->data != NULL ? capacity : 0;
+    ring->readPos   = 0;
+    ring->size      = 0;
+    return ring->data != NULL ? 0 : -1;
+}
+
+void ringFree(RingBuffer *ring) {
+    av_freep(&ring->data);
+    ring->capacity  = 0;
+    ring->readPos   = 0;
+    ring->size      = 0;
+}
+
+int ringSpace(RingBuffer *ring) {
+    return ring->capacity - ring->size;
+}
+
+//Contiguous readable span starting at the read position.
+int ringReadSpan(RingBuffer *ring, unsigned char **span) {
+    *span = ring->data + ring->readPos;
+    return MIN(ring->size, ring->capacity - ring->readPos);
+}
+
+//Contiguous writable span starting at the write position.
+int ringWriteSpan(RingBuffer *ring, unsigned char **span) {
+    int writePos = (ring->readPos + ring->size) % ring->capacity;
+    *span = ring->data + writePos;
+    return MIN(ringSpace(ring), ring->capacity - writePos);
+}
+
+void ringConsume(RingBuffer *ring, int len) {
+    ring->readPos = (ring->readPos + len) % ring->capacity;
+    ring->size -= len;
+}
+
+void ringCommit(RingBuffer *ring, int len) {
+    ring->size += len;
+}
+
+//Write as much as fits, returns accepted bytes.
+int ringWrite(RingBuffer *ring, const unsigned char *buff, int size) {
+    int written = 0;
+    while (written < size) {
+        unsigned char *span = NULL;
+        int len = MIN(ringWriteSpan(ring, &span), size - written);
+        if (len <= 0) {
+            break;
+        }
+        memcpy(span, buff + written, len);
+        ringCommit(ring, len);
+        written += len;
+    }
+    return written;
+}
+
+int rangeCacheInit(RangeCache *cache, int64_t fileSize, int limit) {
+    memset(cache, 0, sizeof(RangeCache));
+    cache->indexCount   = (int)((fileSize + kCacheExtentSize - 1) / kCacheExtentSize);
+    cache->maxExtents   = FFMAX(limit / kCacheExtentSize, kMinCacheExtents);
+    cache->index        = (CacheExtent **)av_mallocz_array(FFMAX(cache->indexCount, 1), sizeof(CacheExtent *));
+    cache->extents      = (CacheExtent **)av_mallocz_array(cache->maxExtents, sizeof(CacheExtent *));
+    if (cache->index == NULL || cache->extents == NULL) {
+        av_freep(&cache->index);
+        av_freep(&cache->extents);
+        return -1;
+    }
+    return 0;
+}
+
+void rangeCacheFree(RangeCache *cache) {
+    int i = 0;
+    for (i = 0; i < cache->extentCount; ++i) {
+        av_freep(&cache->extents[i]->data);
+        av_freep(&cache->extents[i]);
+    }
+    av_freep(&cache->index);
+    av_freep(&cache->extents);
+    cache->indexCount   = 0;
+    cache->extentCount  = 0;
+}
+
+void rangeCacheEvictOne(RangeCache *cache) {
+    int i       = 0;
+    int lru     = -1;
+    CacheExtent *ext = NULL;
+    for (i = 0; i < cache->extentCount; ++i) {
+        if (lru < 0 || cache->extents[i]->lastUse < cache->extents[lru]->lastUse) {
+            lru = i;
+        }
+    }
+
+    if (lru < 0) {
+        return;
+    }
+
+    ext = cache->extents[lru];
+    simpleLog("Evict cache extent %lld-%lld.", ext->start + ext->validBegin, ext->start + ext->validEnd);
+    cache->index[ext->start / kCacheExtentSize] = NULL;
+    cache->extents[lru] = cache->extents[--cache->extentCount];
+    av_freep(&ext->data);
+    av_freep(&ext);
+}
+
+CacheExtent *rangeCacheGetExtent(RangeCache *cache, int64_t offset, int create) {
+    int idx = (int)(offset / kCacheExtentSize);
+    CacheExtent *ext = NULL;
+    do {
+        if (offset < 0 || idx >= cache->indexCount) {
+            break;
+        }
+
+        ext = cache->index[idx];
+        if (ext != NULL || !create) {
+            break;
+        }
+
+        if (cache->extentCount >= cache->maxExtents) {
+            rangeCacheEvictOne(cache);
+        }
+
+        ext = (CacheExtent *)av_mallocz(sizeof(CacheExtent));
+        if (ext == NULL) {
+            break;
+        }
+
+        ext->data = (unsigned char *)av_malloc(kCacheExtentSize);
+        if (ext->data == NULL) {
+            av_freep(&ext);
+            break;
+        }
+
+        ext->start = (int64_t)idx * kCacheExtentSize;
+        cache->index[idx] = ext;
+        cache->extents[cache->extentCount++] = ext;
+    } while (0);
+
+    if (ext != NULL) {
+        ext->lastUse = ++cache->useClock;
+    }
+    return ext;
+}
+
+//Bytes available without a gap from offset on.
+int64_t rangeCacheContiguous(RangeCache *cache, int64_t offset, int64_t fileSize) {
+    int64_t pos = offset;
+    while (pos < fileSize) {
+        CacheExtent *ext = rangeCacheGetExtent(cache, pos, 0);
+        int inner = (int)(pos % kCacheExtentSize);
+        if (ext == NULL || inner < ext->validBegin || inner >= ext->validEnd) {
+            break;
+        }
+        pos = ext->start + ext->validEnd;
+    }
+    return pos - offset;
+}
+
+void rangeCacheMarkValid(CacheExtent *ext, int inner, int len) {
+    if (ext->validEnd <= ext->validBegin || inner > ext->validEnd || inner + len < ext->validBegin) {
+        // Not touching what is there, keep only the newest range.
+        ext->validBegin = inner;
+        ext->validEnd   = inner + len;
+    } else {
+        ext->validBegin = FFMIN(ext->validBegin, inner);
+        ext->validEnd   = FFMAX(ext->validEnd, inner + len);
+    }
+}
+
+int rangeCacheWrite(RangeCache *cache, int64_t offset, const unsigned char *buff, int size, int64_t fileSize) {
+    int written = 0;
+    while (written < size && offset < fileSize) {
+        int inner   = (int)(offset % kCacheExtentSize);
+        int len     = (int)MIN(MIN(kCacheExtentSize - inner, size - written), fileSize - offset);
+        CacheExtent *ext = rangeCacheGetExtent(cache, offset, 1);
+        if (ext == NULL) {
+            break;
+        }
+
+        memcpy(ext->data + inner, buff + written, len);
+        rangeCacheMarkValid(ext, inner, len);
+        written += len;
+        offset  += len;
+    }
+    return written;
+}
+
+int rangeCacheRead(RangeCache *cache, int64_t offset, unsigned char *data, int len, int64_t fileSize) {
+    int read = 0;
+    while (read < len && offset < fileSize) {
+        CacheExtent *ext = rangeCacheGetExtent(cache, offset, 0);
+        int inner = (int)(offset % kCacheExtentSize);
+        int spanLen = 0;
+        if (ext == NULL || inner < ext->validBegin || inner >= ext->validEnd) {
+            break;
+        }
+
+        spanLen = MIN(ext->validEnd - inner, len - read);
+        memcpy(data + read, ext->data + inner, spanLen);
+        read    += spanLen;
+        offset  += spanLen;
+    }
+    return read;
+}
+
+//Ask the host to download from offset, once per distinct offset.
+void requestRange(WebDecoder *decoder, int64_t offset) {
+    if (offset == decoder->lastRequestOffset || offset > decoder->fileSize) {
+        return;
+    }
+
+    decoder->lastRequestOffset  = offset;
+    decoder->fileWritePos       = offset;
+    simpleLog("Request data from %lld.", offset);
+    if (decoder->requestCallback != NULL) {
+        decoder->requestCallback((int)offset, getAailableDataSize(decoder));
+    }
+}
+
+int readFromCache(WebDecoder *decoder, uint8_t *data, int len) {
+    //simpleLog("readFromCache %d.", len);
+    int32_t ret = -1;
+    do {
+        if (decoder->cache.index == NULL) {
+            break;
+        }
+
+        ret = rangeCacheRead(&decoder->cache, decoder->fileReadPos, data, len, decoder->fileSize);
+        if (ret <= 0) {
+            // Hit a hole, redirect the download unless it is already heading here.
+            if (decoder->fileReadPos < decoder->fileSize && decoder->fileReadPos != decoder->fileWritePos) {
+                requestRange(decoder, decoder->fileReadPos);
+            }
+            ret = -1;
+            break;
+        }
+
+        decoder->fileReadPos += ret;
+    } while (0);
+    //simpleLog("readFromCache ret %d.", ret);
+    return ret;
+}
+
+int readFromRing(WebDecoder *decoder, uint8_t *data, int len) {
+    //simpleLog("readFromRing %d.", len);
+    int32_t ret = -1;
+    do {
+        if (decoder->ring.data == NULL || decoder->ring.size <= 0) {
+            break;
+        }
+
+        // At most two spans, copied straight into the AVIO buffer.
+        ret = 0;
+        while (ret < len) {
+            unsigned char *span = NULL;
+            int spanLen = MIN(ringReadSpan(&decoder->ring, &span), len - ret);
+            if (spanLen <= 0) {
+                break;
+            }
+            memcpy(data + ret, span, spanLen);
+            ringConsume(&decoder->ring, spanLen);
+            ret += spanLen;
+        }
+    } while (0);
+    //simpleLog("readFromRing ret %d, left %d.", ret, decoder->ring.size);
+    return ret;
+}
+
+int readCallback(void *opaque, uint8_t *data, int len) {
+    //simpleLog("readCallback %d.", len);
+    WebDecoder *decoder = (WebDecoder *)opaque;
+    int32_t ret         = -1;
+    do {
+        if (decoder == NULL) {
+            break;
+        }
+
+        if (data == NULL || len <= 0) {
+            break;
+        }		
+
+        ret = decoder->isStream ? readFromRing(decoder, data, len) : readFromCache(decoder, data, len);
+    } while (0);
+    //simpleLog("readCallback ret %d.", ret);
+    return ret;
+}
+
+int64_t seekCallback(void *opaque, int64_t offset, int whence) {
+    WebDecoder *decoder = (WebDecoder *)opaque;
+    int64_t ret         = -1;
+    int64_t pos         = -1;
+    int64_t req_pos     = -1;
+    int64_t cached      = 0;
+    //simpleLog("seekCallback %lld %d.", offset, whence);
+    do {
+        if (decoder == NULL || decoder->isStream || decoder->cache.index == NULL) {
+            break;
+        }
+
+        if (whence == AVSEEK_SIZE) {
+            ret = decoder->fileSize;
+            break;
+        }
+
+        if (whence == SEEK_SET) {
+            pos = offset;
+        } else if (whence == SEEK_CUR) {
+            pos = decoder->fileReadPos + offset;
+        } else if (whence == SEEK_END) {
+            pos = decoder->fileSize + offset;
+        } else {
+            break;
+        }
+
+        if (pos < 0 || pos > decoder->fileSize) {
+            break;
+        }
+
+        decoder->fileReadPos = pos;
+        cached = rangeCacheContiguous(&decoder->cache, pos, decoder->fileSize);
+        if (cached <= 0) {
+            req_pos = pos;
+            ret     = -1;  // Forcing not to call read at once.
+            simpleLog("Will request %lld and return %lld.", pos, ret);
+            break;
+        }
+
+        // Served from cache, only fetch the hole right after the cached run.
+        if (pos + cached < decoder->fileSize && pos + cached != decoder->fileWritePos) {
+            req_pos = pos + cached;
+        }
+        ret = pos;
+    } while (0);
+    //simpleLog("seekCallback return %lld.", ret);
+
+    if (decoder != NULL && decoder->requestCallback != NULL) {
+        if (req_pos >= 0) {
+            decoder->lastRequestOffset  = req_pos;
+            decoder->fileWritePos       = req_pos;
+        }
+        decoder->requestCallback(req_pos, getAailableDataSize(decoder));
+    }
+    return ret;
+}
+
+//Download bookkeeping once [offset, offset + size) is in the cache.
+void cacheWritten(WebDecoder *decoder, int64_t offset, int size) {
+    int64_t next    = offset + size;
+    int64_t cached  = 0;
+
+    updateMemoryPeak(decoder);
+    if (offset == decoder->lastRequestOffset) {
+        decoder->lastRequestOffset = -1;  // Request served, allow asking again later.
+    }
+    decoder->fileWritePos = next;
+
+    // Download ran into data already cached, skip to the next hole.
+    cached = rangeCacheContiguous(&decoder->cache, next, decoder->fileSize);
+    if (cached > 0) {
+        requestRange(decoder, next + cached);
+    }
+}
+
+int writeToCache(WebDecoder *decoder, int64_t offset, unsigned char *buff, int size) {
+    int ret = 0;
+    do {
+        if (decoder->cache.index == NULL) {
+            ret = -1;
+            break;
+        }
+
+        ret = rangeCacheWrite(&decoder->cache, offset, buff, size, decoder->fileSize);
+        cacheWritten(decoder, offset, ret);
+    } while (0);
+    return ret;
+}
+
+void flvScannerInit(FlvScanner *scanner) {
+    memset(scanner, 0, sizeof(FlvScanner));
+    scanner->nextTag        = -1;
+    scanner->newestTs       = -1;
+    scanner->newestKeyTs    = -1;
+}
+
+//Reads FLV tag headers from data appended to the stream, tags may straddle chunks.
+void flvScannerFeed(FlvScanner *scanner, const unsigned char *buff, int size) {
+    const unsigned char *p  = NULL;
+    int64_t end             = scanner->pos + size;
+    int64_t at              = 0;
+    int need                = 0;
+    int n                   = 0;
+    int type                = 0;
+    int dataSize            = 0;
+    int64_t ts              = 0;
+
+    while (!scanner->invalid) {
+        // File header: "FLV", version, flags, 4 byte header size, then PreviousTagSize0.
+        at      = scanner->nextTag < 0 ? 0 : scanner->nextTag;
+        need    = scanner->nextTag < 0 ? 9 : kFlvTagPeekSize;
+        if (at + scanner->peekFill >= end) {
+            break;
+        }
+
+        if (at + scanner->peekFill >= scanner->pos) {
+            n = (int)MIN(need - scanner->peekFill, end - (at + scanner->peekFill));
+            memcpy(scanner->peek + scanner->peekFill, buff + (at + scanner->peekFill - scanner->pos), n);
+            scanner->peekFill += n;
+        }
+
+        if (scanner->peekFill < need) {
+            break;
+        }
+
+        p = scanner->peek;
+        scanner->peekFill = 0;
+        if (scanner->nextTag < 0) {
+            if (p[0] != 'F' || p[1] != 'L' || p[2] != 'V') {
+                scanner->invalid = 1;
+                break;
+            }
+            scanner->nextTag = AV_RB32(p + 5) + 4;
+            continue;
+        }
+
+        type        = p[0] & 0x1f;
+        dataSize    = AV_RB24(p + 1);
+        ts          = AV_RB24(p + 4) | ((int64_t)p[7] << 24);
+        if (type == 8 || type == 9) {
+            scanner->newestTs = FFMAX(scanner->newestTs, ts);
+            if (type == 9 && dataSize > 0 && (p[11] >> 4) == 1) {
+                scanner->newestKeyTs = ts;
+            }
+        }
+        scanner->nextTag += 11 + dataSize + 4;
+    }
+    scanner->pos = end;
+}
+
+int getLiveLatency(WebDecoder *decoder);
+
+int packetQueueDurationMs(PacketQueue *queue) {
+    if (queue->count < 2) {
+        return 0;
+    }
+    return (int)((queue->tail->timestamp - queue->head->timestamp) * 1000);
+}
+
+int packetQueueFull(WebDecoder *decoder, PacketQueue *queue) {
+    int maxMs = decoder->liveMode ? FFMIN(queue->maxDurationMs, kLivePacketQueueMaxMs) : queue->maxDurationMs;
+    return (queue->maxBytes > 0 && queue->bytes >= queue->maxBytes) ||
+        (maxMs > 0 && packetQueueDurationMs(queue) >= maxMs);
+}
+
+//Takes over the packet's reference.
+int packetQueuePush(WebDecoder *decoder, PacketQueue *queue, AVPacket *pkt, double timestamp) {
+    PacketNode *node = decoder->freePacketNodes;
+    if (node != NULL) {
+        decoder->freePacketNodes = node->next;
+    } else {
+        node = (PacketNode *)av_mallocz(sizeof(PacketNode));
+        if (node == NULL) {
+            return -1;
+        }
+    }
+
+    av_packet_move_ref(&node->packet, pkt);
+    node->timestamp = timestamp;
+    node->next      = NULL;
+    if (queue->tail != NULL) {
+        queue->tail->next = node;
+    } else {
+        queue->head = node;
+    }
+    queue->tail = node;
+    ++queue->count;
+    queue->bytes += node->packet.size;
+    return 0;
+}
+
+void packetQueuePop(WebDecoder *decoder, PacketQueue *queue, AVPacket *pkt) {
+    PacketNode *node = queue->head;
+    queue->head = node->next;
+    if (queue->head == NULL) {
+        queue->tail = NULL;
+    }
+    --queue->count;
+    queue->bytes -= node->packet.size;
+
+    av_packet_move_ref(pkt, &node->packet);
+    node->next = decoder->freePacketNodes;
+    decoder->freePacketNodes = node;
+}
+
+void packetQueueFlush(WebDecoder *decoder, PacketQueue *queue) {
+    AVPacket packet;
+    av_init_packet(&packet);
+    while (queue->head != NULL) {
+        packetQueuePop(decoder, queue, &packet);
+        av_packet_unref(&packet);
+    }
+}
+
+void flushPacketQueues(WebDecoder *decoder) {
+    packetQueueFlush(decoder, &decoder->packetQueues[kStreamType_Video]);
+    packetQueueFlush(decoder, &decoder->packetQueues[kStreamType_Audio]);
+}
+
+void freePacketQueues(WebDecoder *decoder) {
+    PacketNode *node = NULL;
+    flushPacketQueues(decoder);
+    while (decoder->freePacketNodes != NULL) {
+        node = decoder->freePacketNodes;
+        decoder->freePacketNodes = node->next;
+        av_free(node);
+    }
+}
+
+void flushCodecContexts(WebDecoder *decoder) {
+    if (decoder->videoCodecContext != NULL) {
+        avcodec_flush_buffers(decoder->videoCodecContext);
+    }
+
+    if (decoder->audioCodecContext != NULL) {
+        avcodec_flush_buffers(decoder->audioCodecContext);
+    }
+    decoder->drainState[kStreamType_Video] = 0;
+    decoder->drainState[kStreamType_Audio] = 0;
+    resetAudioOutput(decoder);
+    flushPresentQueue(decoder);
+}
+
+//Returns 1 when a live packet should be dropped to get back to the live edge.
+int liveCatchUp(WebDecoder *decoder, AVPacket *pkt) {
+    int latency = getLiveLatency(decoder);
+    int isVideo = pkt->stream_index == decoder->videoStreamIdx;
+    int64_t ts  = 0;
+
+    if (latency < 0) {
+        return 0;
+    }
+
+    if (!decoder->liveJumping &&
+        decoder->liveJumpThresholdMs > 0 &&
+        latency > decoder->liveJumpThresholdMs &&
+        decoder->flvScanner.newestKeyTs > (int64_t)(decoder->demuxTime * 1000)) {
+        decoder->liveJumping        = 1;
+        decoder->liveJumpTargetTs   = decoder->flvScanner.newestKeyTs;
+        ++decoder->stats.liveJumps;
+        simpleLog("Live latency %dms, jump to keyframe at %lldms.", latency, decoder->liveJumpTargetTs);
+    }
+
+    if (decoder->liveJumping) {
+        ts = (int64_t)(decoder->demuxTime * 1000);
+        if (!isVideo || !(pkt->flags & AV_PKT_FLAG_KEY) || ts < decoder->liveJumpTargetTs) {
+            if (isVideo) {
+                ++decoder->stats.droppedFrames;
+            }
+            return 1;
+        }
+
+        decoder->liveJumping = 0;
+        flushPacketQueues(decoder);
+        flushCodecContexts(decoder);
+    }
+
+    // Mildly behind, non-reference pictures can go without breaking the prediction chain.
+    if (isVideo) {
+        setSkipFrame(decoder, (decoder->liveDropThresholdMs > 0 && latency > decoder->liveDropThresholdMs) ?
+            AVDISCARD_NONREF : AVDISCARD_DEFAULT);
+    }
+    return 0;
+}
+
+int writeToRing(WebDecoder *decoder, unsigned char *buff, int size) {
+    int ret = 0;
+    do {
+        if (decoder->ring.data == NULL) {
+            ret = -1;
+            break;
+        }
+
+        // Partial acceptance when full, the caller keeps the rest and backs off.
+        ret = ringWrite(&decoder->ring, buff, size);
+        flvScannerFeed(&decoder->flvScanner, buff, ret);
+        if (ret < size) {
+            simpleLog("Ring full, accepted %d of %d bytes.", ret, size);
+            decoder->stats.bytesRejected += size - ret;
+        }
+        decoder->stats.ringPeak = FFMAX(decoder->stats.ringPeak, decoder->ring.size);
+    } while (0);
+    return ret;
+}
+
+int getAailableDataSize(WebDecoder *decoder) {
+    int ret = 0;
+    do {
+        if (decoder == NULL) {
+            break;
+        }
+
+        if (decoder->isStream) {
+            ret = decoder->ring.size;
+        } else {
+            ret = (int)rangeCacheContiguous(&decoder->cache, decoder->fileReadPos, decoder->fileSize);
+        }
+    } while (0);
+    return ret;
+}
+
+int isTrackActive(WebDecoder *decoder, int streamIdx) {
+    if (streamIdx == decoder->videoStreamIdx) {
+        return decoder->videoCodecContext != NULL && decoder->trackEnabled[kStreamType_Video];
+    } else if (streamIdx == decoder->audioStreamIdx) {
+        return decoder->audioCodecContext != NULL && decoder->trackEnabled[kStreamType_Audio];
+    }
+    return 0;
+}
+
+//Filters a demuxed packet and queues it for the decode stage. Inactive tracks, video up to
+//a wanted keyframe and live catch-up drops never reach a queue. Takes over the reference.
+void queueDemuxedPacket(WebDecoder *decoder, AVPacket *pkt) {
+    AVStream *st        = NULL;
+    PacketQueue *queue  = NULL;
+    double timestamp    = 0.0;
+    do {
+        if (pkt->stream_index >= decoder->avformatContext->nb_streams) {
+            break;
+        }
+        st = decoder->avformatContext->streams[pkt->stream_index];
+        ++decoder->stats.packets;
+
+        // Index timestamps are dts, the readahead plan starts from here.
+        if (pkt->dts != AV_NOPTS_VALUE) {
+            decoder->demuxTime = pkt->dts * av_q2d(st->time_base);
+        }
+
+        // Queued by the demuxer before its track was turned off.
+        if (!isTrackActive(decoder, pkt->stream_index)) {
+            break;
+        }
+
+        if (decoder->videoWaitKey && pkt->stream_index == decoder->videoStreamIdx) {
+            if (!(pkt->flags & AV_PKT_FLAG_KEY)) {
+                break;
+            }
+            decoder->videoWaitKey = 0;
+        }
+
+        if (decoder->liveMode && liveCatchUp(decoder, pkt)) {
+            break;
+        }
+
+        queue = &decoder->packetQueues[pkt->stream_index == decoder->videoStreamIdx ? kStreamType_Video : kStreamType_Audio];
+        if (pkt->dts != AV_NOPTS_VALUE) {
+            timestamp = pkt->dts * av_q2d(st->time_base);
+        } else if (pkt->pts != AV_NOPTS_VALUE) {
+            timestamp = pkt->pts * av_q2d(st->time_base);
+        } else {
+            timestamp = queue->tail != NULL ? queue->tail->timestamp : decoder->demuxTime;
+        }
+
+        if (packetQueuePush(decoder, queue, pkt, timestamp) != 0) {
+            simpleLog("Queue packet failed, dropped.");
+        }
+    } while (0);
+    av_packet_unref(pkt);
+}
+
+//Demux stage, reads one packet. kErrorCode_Invalid_State when the input ran dry.
+ErrorCode demuxPacket(WebDecoder *decoder) {
+    ErrorCode ret   = kErrorCode_Success;
+    int r           = 0;
+    double beginUs  = 0.0;
+
+    AVPacket packet;
+    av_init_packet(&packet);
+    do {
+        if (decoder->demuxEof) {
+            ret = kErrorCode_Eof;
+            break;
+        }
+
+        if (getAailableDataSize(decoder) <= 0) {
+            ret = kErrorCode_Invalid_State;
+            break;
+        }
+
+        packet.data = NULL;
+        packet.size = 0;
+
+        beginUs = getTimeUs();
+        r = av_read_frame(decoder->avformatContext, &packet);
+        statsRecord(&decoder->stats.stages[kStatsStage_Demux], getTimeUs() - beginUs);
+        if (r == AVERROR_EOF) {
+            decoder->demuxEof = 1;
+            ret = kErrorCode_Eof;
+            break;
+        }
+
+        if (r < 0 || packet.size == 0) {
+            ret = kErrorCode_Invalid_State;
+            break;
+        }
+
+        queueDemuxedPacket(decoder, &packet);
+    } while (0);
+    av_packet_unref(&packet);
+    return ret;
+}
+
+int packetQueuesFull(WebDecoder *decoder) {
+    return packetQueueFull(decoder, &decoder->packetQueues[kStreamType_Video]) ||
+        packetQueueFull(decoder, &decoder->packetQueues[kStreamType_Audio]);
+}
+
+//Decode stage order: the queued packet with the earliest timestamp. An active track with an
+//empty queue demuxes on demand, but once the demuxer can't go on the other track is decoded
+//regardless, so audio never waits behind video and a dry network doesn't stall what's queued.
+PacketQueue *nextPacketQueue(WebDecoder *decoder) {
+    PacketQueue *video = &decoder->packetQueues[kStreamType_Video];
+    PacketQueue *audio = &decoder->packetQueues[kStreamType_Audio];
+    while ((video->count == 0 && isTrackActive(decoder, decoder->videoStreamIdx)) ||
+        (audio->count == 0 && isTrackActive(decoder, decoder->audioStreamIdx))) {
+        if (packetQueuesFull(decoder) || demuxPacket(decoder) != kErrorCode_Success) {
+            break;
+        }
+    }
+
+    if (video->count == 0) {
+        return audio->count > 0 ? audio : NULL;
+    }
+
+    if (audio->count == 0) {
+        return video;
+    }
+    return audio->head->timestamp <= video->head->timestamp ? audio : video;
+}
+
+//Decode stage, decodes one queued packet.
+ErrorCode decodeNextPacket(WebDecoder *decoder, int *packetSize) {
+    ErrorCode ret       = kErrorCode_Success;
+    PacketQueue *queue  = NULL;
+    int decodedLen      = 0;
+
+    AVPacket packet;
+    av_init_packet(&packet);
+    do {
+        if (decoder == NULL || decoder->avformatContext == NULL) {
+            ret = kErrorCode_Invalid_State;
+            break;
+        }
+
+        // Don't decode more until the host gives back a borrowed frame.
+        if (videoOutputFull(decoder)) {
+            ret = kErrorCode_Frame_Pool_Full;
+            break;
+        }
+
+        queue = nextPacketQueue(decoder);
+        if (queue == NULL) {
+            if (decoder->demuxEof) {
+                // The remaining pictures wait in the codec until the host frees output slots.
+                if (!drainCodecContext(decoder, decoder->videoCodecContext, 1)) {
+                    ret = kErrorCode_Frame_Pool_Full;
+                    break;
+                }
+                drainCodecContext(decoder, decoder->audioCodecContext, 0);
+                flushAudioBlock(decoder);
+                ret = kErrorCode_Eof;
+            } else {
+                decoder->inputStarved = 1;
+                ret = kErrorCode_Invalid_State;
+            }
+            break;
+        }
+
+        decoder->inputStarved = 0;
+        packetQueuePop(decoder, queue, &packet);
+        *packetSize = packet.size;
+
+        do {
+            ret = decodePacket(decoder, &packet, &decodedLen);
+            if (ret != kErrorCode_Success) {
+                break;
+            }
+
+            if (decodedLen <= 0) {
+                break;
+            }
+
+            packet.data += decodedLen;
+            packet.size -= decodedLen;
+        } while (packet.size > 0);
+    } while (0);
+    av_packet_unref(&packet);
+    return ret;
+}
+
+void freeStreamHint(StreamHint *hint) {
+    av_freep(&hint->extradata);
+    memset(hint, 0, sizeof(StreamHint));
+}
+
+StreamHint *getStreamHint(WebDecoder *decoder, enum AVMediaType type) {
+    if (type == AVMEDIA_TYPE_VIDEO) {
+        return &decoder->streamHints[kStreamType_Video];
+    } else if (type == AVMEDIA_TYPE_AUDIO) {
+        return &decoder->streamHints[kStreamType_Audio];
+    }
+    return NULL;
+}
+
+//True when every audio/video stream is known, either from the header or from a hint.
+int streamsDescribed(WebDecoder *decoder) {
+    AVFormatContext *fmtCtx = decoder->avformatContext;
+    AVCodecParameters *par  = NULL;
+    StreamHint *hint        = NULL;
+    int hinted              = 0;
+    int i                   = 0;
+
+    // FLV creates its streams from packets, there is nothing to describe yet.
+    if (fmtCtx->nb_streams == 0 || (fmtCtx->ctx_flags & AVFMTCTX_NOHEADER)) {
+        return 0;
+    }
+
+    for (i = 0; i < fmtCtx->nb_streams; ++i) {
+        par  = fmtCtx->streams[i]->codecpar;
+        hint = getStreamHint(decoder, par->codec_type);
+        if (hint == NULL) {
+            continue;
+        }
+
+        if (hint->codecId == AV_CODEC_ID_NONE) {
+            return 0;
+        }
+        hinted = 1;
+    }
+    return hinted;
+}
+
+void applyStreamHints(WebDecoder *decoder) {
+    AVFormatContext *fmtCtx = decoder->avformatContext;
+    AVCodecParameters *par  = NULL;
+    StreamHint *hint        = NULL;
+    int i                   = 0;
+
+    for (i = 0; i < fmtCtx->nb_streams; ++i) {
+        par  = fmtCtx->streams[i]->codecpar;
+        hint = getStreamHint(decoder, par->codec_type);
+        if (hint == NULL || hint->codecId == AV_CODEC_ID_NONE) {
+            continue;
+        }
+
+        // Only fill what the demuxer left unknown.
+        if (par->codec_id == AV_CODEC_ID_NONE) {
+            par->codec_id = hint->codecId;
+        }
+
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+            if (par->width <= 0 || par->height <= 0) {
+                par->width  = hint->width;
+                par->height = hint->height;
+            }
+        } else {
+            if (par->sample_rate <= 0) {
+                par->sample_rate = hint->sampleRate;
+            }
+
+            if (par->channels <= 0 && hint->channels > 0) {
+                par->channels       = hint->channels;
+                par->channel_layout = av_get_default_channel_layout(hint->channels);
+            }
+        }
+
+        if (par->extradata_size <= 0 && hint->extradataSize > 0) {
+            par->extradata = (uint8_t *)av_mallocz(hint->extradataSize + AV_INPUT_BUFFER_PADDING_SIZE);
+            if (par->extradata != NULL) {
+                memcpy(par->extradata, hint->extradata, hint->extradataSize);
+                par->extradata_size = hint->extradataSize;
+            }
+        }
+    }
+}
+
+//The demuxer index left the public AVStream fields in lavf 59, the accessors came in 58.78.
+int streamIndexCount(AVStream *st) {
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+    return avformat_index_get_entries_count(st);
+#else
+    return st->nb_index_entries;
+#endif
+}
+
+const AVIndexEntry *streamIndexEntry(AVStream *st, int idx) {
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+    return avformat_index_get_entry(st, idx);
+#else
+    return idx >= 0 && idx < st->nb_index_entries ? &st->index_entries[idx] : NULL;
+#endif
+}
+
+//Demuxing from a video keyframe also needs the audio interleaved before it.
+int64_t keyframeOffset(WebDecoder *decoder, const AVIndexEntry *entry) {
+    AVStream *video = decoder->avformatContext->streams[decoder->videoStreamIdx];
+    AVStream *audio = NULL;
+    const AVIndexEntry *ie = NULL;
+    int64_t pos     = entry->pos;
+    int idx         = 0;
+
+    if (decoder->audioStreamIdx >= 0) {
+        audio = decoder->avformatContext->streams[decoder->audioStreamIdx];
+        idx = av_index_search_timestamp(audio,
+            av_rescale_q(entry->timestamp, video->time_base, audio->time_base),
+            AVSEEK_FLAG_BACKWARD);
+        ie = streamIndexEntry(audio, idx);
+        if (ie != NULL) {
+            pos = FFMIN(pos, ie->pos);
+        }
+    }
+    return pos;
+}
+
+//Adds the uncached part of [start, end) to the plan. Returns 0 once the plan is full.
+int planReadahead(WebDecoder *decoder, ReadaheadRange *ranges, int *count, int maxCount, int64_t start, int64_t end, double deadline) {
+    ReadaheadRange *last = *count > 0 ? &ranges[*count - 1] : NULL;
+    int i = 0;
+
+    start += rangeCacheContiguous(&decoder->cache, start, decoder->fileSize);
+    for (i = 0; i < *count && start < end; ++i) {
+        if (start >= (int64_t)ranges[i].offset && start < (int64_t)(ranges[i].offset + ranges[i].size)) {
+            start = (int64_t)(ranges[i].offset + ranges[i].size);
+        }
+    }
+
+    if (start >= end) {
+        return 1;
+    }
+
+    // Close enough behind the previous range, one request is cheaper than two.
+    if (last != NULL && start >= (int64_t)last->offset && start <= (int64_t)(last->offset + last->size) + kReadaheadMergeGap) {
+        last->size = (double)FFMAX(end, (int64_t)(last->offset + last->size)) - last->offset;
+        return 1;
+    }
+
+    if (*count >= maxCount) {
+        return 0;
+    }
+
+    ranges[*count].offset   = (double)start;
+    ranges[*count].size     = (double)(end - start);
+    ranges[*count].deadline = deadline;
+    ++(*count);
+    return 1;
+}
+
+//Reads through the thumbnail demuxer only see what is cached, holes end the batch.
+int thumbnailReadCallback(void *opaque, uint8_t *data, int len) {
+    WebDecoder *decoder         = (WebDecoder *)opaque;
+    ThumbnailContext *thumb     = &decoder->thumbnail;
+    int ret = rangeCacheRead(&decoder->cache, thumb->readPos, data, len, decoder->fileSize);
+    if (ret <= 0) {
+        if (thumb->readPos < decoder->fileSize && thumb->missingPos < 0) {
+            thumb->missingPos = thumb->readPos;
+        }
+        return AVERROR_EOF;
+    }
+
+    thumb->readPos += ret;
+    return ret;
+}
+
+int64_t thumbnailSeekCallback(void *opaque, int64_t offset, int whence) {
+    WebDecoder *decoder         = (WebDecoder *)opaque;
+    ThumbnailContext *thumb     = &decoder->thumbnail;
+    int64_t pos                 = -1;
+    switch (whence) {
+        case AVSEEK_SIZE:
+            return decoder->fileSize;
+        case SEEK_SET:
+            pos = offset;
+            break;
+        case SEEK_CUR:
+            pos = thumb->readPos + offset;
+            break;
+        case SEEK_END:
+            pos = decoder->fileSize + offset;
+            break;
+        default:
+            return -1;
+    }
+
+    if (pos < 0 || pos > decoder->fileSize) {
+        return -1;
+    }
+
+    thumb->readPos = pos;
+    return pos;
+}
+
+void closeThumbnailContext(WebDecoder *decoder) {
+    ThumbnailContext *thumb = &decoder->thumbnail;
+    if (thumb->codecContext != NULL) {
+        avcodec_free_context(&thumb->codecContext);
+    }
+
+    if (thumb->formatContext != NULL) {
+        if (thumb->formatContext->pb != NULL) {
+            av_freep(&thumb->formatContext->pb->buffer);
+            av_freep(&thumb->formatContext->pb);
+        }
+        avformat_close_input(&thumb->formatContext);
+    }
+
+    av_frame_free(&thumb->frame);
+    av_freep(&thumb->scratch);
+    thumb->scratchSize = 0;
+}
+
+//A second demuxer over the same cache plus a keyframe only decoder, opened on first use.
+//Takes codec parameters from the playback decoder, no probing and no stream info pass.
+ErrorCode openThumbnailContext(WebDecoder *decoder) {
+    ThumbnailContext *thumb     = &decoder->thumbnail;
+    AVCodecParameters *par      = NULL;
+    AVCodec *codec              = NULL;
+    AVIOContext *pb             = NULL;
+    unsigned char *ioBuffer     = NULL;
+    AVPacket pkt;
+    int packets                 = 0;
+    ErrorCode ret               = kErrorCode_Success;
+
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+    do {
+        if (thumb->codecContext != NULL) {
+            break;
+        }
+
+        thumb->readPos      = 0;
+        thumb->missingPos   = -1;
+        ioBuffer = (unsigned char *)av_malloc(kCustomIoBufferSize);
+        thumb->formatContext = avformat_alloc_context();
+        if (ioBuffer == NULL || thumb->formatContext == NULL) {
+            av_free(ioBuffer);
+            ret = kErrorCode_FFmpeg_Error;
+            break;
+        }
+
+        pb = avio_alloc_context(ioBuffer, kCustomIoBufferSize, 0, decoder, thumbnailReadCallback, NULL, thumbnailSeekCallback);
+        if (pb == NULL) {
+            av_free(ioBuffer);
+            ret = kErrorCode_FFmpeg_Error;
+            break;
+        }
+
+        thumb->formatContext->pb    = pb;
+        thumb->formatContext->flags = AVFMT_FLAG_CUSTOM_IO;
+        if (avformat_open_input(&thumb->formatContext, NULL, decoder->avformatContext->iformat, NULL) != 0) {
+            simpleLog("Thumbnail demuxer open failed, header at %lld not cached.", thumb->missingPos);
+            // The format context is gone, a custom IO context stays the caller's to free.
+            av_freep(&pb->buffer);
+            av_freep(&pb);
+            ret = kErrorCode_FFmpeg_Error;
+            break;
+        }
+
+        // FLV creates its streams with their first packets, seeking needs one.
+        while (thumb->formatContext->nb_streams == 0 && packets++ < kThumbnailMaxPackets &&
+            av_read_frame(thumb->formatContext, &pkt) >= 0) {
+            av_packet_unref(&pkt);
+        }
+
+        codec = avcodec_find_decoder(decoder->videoCodecContext->codec_id);
+        par = avcodec_parameters_alloc();
+        thumb->codecContext = codec != NULL ? avcodec_alloc_context3(codec) : NULL;
+        thumb->frame = av_frame_alloc();
+        if (par == NULL || thumb->codecContext == NULL || thumb->frame == NULL ||
+            avcodec_parameters_from_context(par, decoder->videoCodecContext) < 0 ||
+            avcodec_parameters_to_context(thumb->codecContext, par) < 0) {
+            avcodec_parameters_free(&par);
+            ret = kErrorCode_FFmpeg_Error;
+            break;
+        }
+        avcodec_parameters_free(&par);
+
+        thumb->codecContext->thread_count   = 1;
+        thumb->codecContext->skip_frame     = AVDISCARD_NONKEY;
+        if (avcodec_open2(thumb->codecContext, codec, NULL) != 0) {
+            ret = kErrorCode_FFmpeg_Error;
+            break;
+        }
+        simpleLog("Thumbnail context opened.");
+    } while (0);
+
+    if (ret != kErrorCode_Success) {
+        closeThumbnailContext(decoder);
+    }
+    return ret;
+}
+
+//One keyframe in, its picture out. Draining and flushing every time keeps nothing buffered
+//across seeks, delayed output decoders included.
+int decodeThumbnail(ThumbnailContext *thumb, AVPacket *pkt) {
+    int ret = avcodec_send_packet(thumb->codecContext, pkt);
+    if (ret == 0) {
+        avcodec_send_packet(thumb->codecContext, NULL);
+        ret = avcodec_receive_frame(thumb->codecContext, thumb->frame);
+    }
+    avcodec_flush_buffers(thumb->codecContext);
+    return ret;
+}
+
+//Demuxes forward from the last seek to the first video keyframe and decodes it.
+int readThumbnail(ThumbnailContext *thumb) {
+    AVPacket pkt;
+    AVStream *st    = NULL;
+    int packets     = 0;
+    int ret         = AVERROR_EOF;
+
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+    while (packets++ < kThumbnailMaxPackets && av_read_frame(thumb->formatContext, &pkt) >= 0) {
+        st = thumb->formatContext->streams[pkt.stream_index];
+        if (st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && (pkt.flags & AV_PKT_FLAG_KEY)) {
+            ret = decodeThumbnail(thumb, &pkt);
+            if (ret == 0) {
+                thumb->timeBase = st->time_base;
+            }
+            av_packet_unref(&pkt);
+            break;
+        }
+        av_packet_unref(&pkt);
+    }
+    return ret;
+}
+
+//Evicts down to maxExtents and resizes the LRU list.
+ErrorCode resizeCache(RangeCache *cache, int maxExtents) {
+    CacheExtent **extents = NULL;
+    maxExtents = FFMAX(maxExtents, kMinCacheExtents);
+    while (cache->extentCount > maxExtents) {
+        rangeCacheEvictOne(cache);
+    }
+
+    extents = (CacheExtent **)av_realloc_array(cache->extents, maxExtents, sizeof(CacheExtent *));
+    if (extents == NULL) {
+        return kErrorCode_NULL_Pointer;
+    }
+
+    cache->extents      = extents;
+    cache->maxExtents   = maxExtents;
+    return kErrorCode_Success;
+}
+
+//Splits the budget: output buffers, the stream ring and the packet queue limits are fixed
+//once open, the file cache and the picture pool share the rest. The cache gives way, down
+//to its minimum, before the pool drops below what the codec needs.
+ErrorCode applyMemoryBudget(WebDecoder *decoder) {
+    ErrorCode ret       = kErrorCode_Success;
+    int64_t available   = 0;
+    int64_t cacheBytes  = 0;
+    int64_t pictures    = 0;
+    int minPictures     = 0;
+    int pictureSize     = decoder->pictureSize;
+    do {
+        if (decoder->memoryBudget <= 0) {
+            decoder->pictureLimit = 0;
+            break;
+        }
+
+        minPictures = pictureSize > 0 ? minPooledPictures(decoder) : 0;
+        available   = decoder->memoryBudget - outputMemory(decoder) - (decoder->isStream ? decoder->ring.capacity : 0) -
+            decoder->packetQueues[kStreamType_Video].maxBytes - decoder->packetQueues[kStreamType_Audio].maxBytes;
+        if (!decoder->isStream && decoder->cache.extents != NULL) {
+            cacheBytes = (int64_t)decoder->cache.maxExtents * kCacheExtentSize;
+            if (available - cacheBytes < (int64_t)minPictures * pictureSize) {
+                resizeCache(&decoder->cache, (int)((available - (int64_t)minPictures * pictureSize) / kCacheExtentSize));
+                cacheBytes = (int64_t)decoder->cache.maxExtents * kCacheExtentSize;
+                simpleLog("Cache limited to %d extents by the memory budget.", decoder->cache.maxExtents);
+            }
+        }
+
+        available -= cacheBytes;
+        pictures = pictureSize > 0 ? available / pictureSize : 0;
+        if (available < 0 || pictures < minPictures) {
+            simpleLog("Memory budget %lld too small, %lld bytes left for at least %d pictures of %d bytes.",
+                decoder->memoryBudget, available, minPictures, pictureSize);
+            ret = kErrorCode_Memory_Budget;
+            break;
+        }
+
+        decoder->pictureLimit = (int)FFMIN(pictures, INT_MAX);
+        simpleLog("Memory budget %lld, cache %lld bytes, %d pictures.", decoder->memoryBudget, cacheBytes, decoder->pictureLimit);
+
+        // A lower limit frees idle pictures now, the pool is rebuilt on the next picture.
+        if (__atomic_load_n(&decoder->pictureCount, __ATOMIC_RELAXED) > decoder->pictureLimit) {
+            lockPicturePool(decoder);
+            retirePicturePool(decoder);
+            unlockPicturePool(decoder);
+        }
+    } while (0);
+    return ret;
+}
+
+//Opens one track's decoder and lets the demuxer deliver its packets, video also gets its
+//output buffer. Disabled and missing tracks stay closed, only a failing codec is an error.
+ErrorCode openTrack(WebDecoder *decoder, StreamType type) {
+    ErrorCode ret                   = kErrorCode_Success;
+    int isVideo                     = type == kStreamType_Video;
+    int *streamIdx                  = isVideo ? &decoder->videoStreamIdx : &decoder->audioStreamIdx;
+    AVCodecContext **codecContext   = isVideo ? &decoder->videoCodecContext : &decoder->audioCodecContext;
+    const char *name                = isVideo ? "video" : "audio";
+    do {
+        if (*streamIdx < 0) {
+            simpleLog("No %s stream, %s track skipped.", name, name);
+            break;
+        }
+
+        if (!decoder->trackEnabled[type]) {
+            simpleLog("The %s track is disabled, codec not opened.", name);
+            break;
+        }
+
+        if (*codecContext == NULL) {
+            if (openCodecContext(decoder->avformatContext,
+                isVideo ? AVMEDIA_TYPE_VIDEO : AVMEDIA_TYPE_AUDIO,
+                isVideo ? decoder->threadCount : 1,
+                decoder->liveMode,
+                isVideo ? decoder : NULL,
+                streamIdx,
+                codecContext) != 0) {
+                simpleLog("Open %s codec context failed.", name);
+                ret = kErrorCode_FFmpeg_Error;
+                break;
+            }
+
+            if (isVideo) {
+                simpleLog("Video stream index:%d pix_fmt:%d resolution:%d*%d.",
+                    *streamIdx,
+                    (*codecContext)->pix_fmt,
+                    (*codecContext)->width,
+                    (*codecContext)->height);
+            } else {
+                simpleLog("Audio stream index:%d sample_fmt:%d channel:%d, sample rate:%d.",
+                    *streamIdx,
+                    (*codecContext)->sample_fmt,
+                    (*codecContext)->channels,
+                    (*codecContext)->sample_rate);
+            }
+        }
+        decoder->avformatContext->streams[*streamIdx]->discard = AVDISCARD_DEFAULT;
+
+        // Sized for a full frame of the widest sample format, AAC never grows it.
+        if (!isVideo && decoder->pcmBuffer == NULL) {
+            decoder->currentPcmBufferSize = FFMAX(kInitialPcmBufferSize,
+                roundUp(decoder->audioCodecContext->frame_size * decoder->audioCodecContext->channels * 8, 4));
+            decoder->pcmBuffer = (unsigned char *)av_mallocz(decoder->currentPcmBufferSize);
+            if (decoder->pcmBuffer == NULL) {
+                decoder->currentPcmBufferSize = 0;
+                ret = kErrorCode_NULL_Pointer;
+                break;
+            }
+            updateMemoryPeak(decoder);
+        }
+
+        if (!isVideo || decoder->yuvBuffer != NULL) {
+            break;
+        }
+
+        // Without probing H.264/HEVC only learn the format from the first slice, the decoder overwrites this.
+        if (decoder->videoCodecContext->pix_fmt == AV_PIX_FMT_NONE) {
+            decoder->videoCodecContext->pix_fmt = AV_PIX_FMT_YUV420P;
+        }
+
+        // The ladder level outlives close and reopen.
+        updateQualityDiscard(decoder);
+
+        // Output is always 8-bit 4:2:0, 10-bit pictures are narrowed on the way out.
+        decoder->videoSize = av_image_get_buffer_size(
+            AV_PIX_FMT_YUV420P,
+            decoder->videoCodecContext->width,
+            decoder->videoCodecContext->height,
+            1);
+        if (decoder->videoSize <= 0) {
+            simpleLog("Unknown picture size, raise probe limits or give a video hint.");
+            ret = kErrorCode_Invalid_Format;
+            break;
+        }
+
+        decoder->videoBufferSize = decoder->videoSize;
+        decoder->yuvBuffer = (unsigned char *)av_mallocz(decoder->videoBufferSize);
+        if (decoder->yuvBuffer == NULL) {
+            ret = kErrorCode_NULL_Pointer;
+            break;
+        }
+
+        // Geometry only, the budget needs the picture size before anything is allocated.
+        lockPicturePool(decoder);
+        getPicturePool(decoder,
+            decoder->videoCodecContext,
+            decoder->videoCodecContext->pix_fmt,
+            decoder->videoCodecContext->width,
+            decoder->videoCodecContext->height);
+        unlockPicturePool(decoder);
+
+        ret = applyMemoryBudget(decoder);
+        if (ret != kErrorCode_Success) {
+            break;
+        }
+
+        preallocatePictures(decoder, decoder->pictureLimit > 0 ?
+            FFMIN(minPooledPictures(decoder), decoder->pictureLimit) : minPooledPictures(decoder));
+        updateMemoryPeak(decoder);
+    } while (0);
+    return ret;
+}
+
+//////////////////////////////////Export methods////////////////////////////////////////
+WebDecoder *initDecoder(int fileSize, int logLv) {
+    WebDecoder *decoder = NULL;
+    do {
+        //Log level.
+        logLevel = logLv;
+
+        decoder = (WebDecoder *)av_mallocz(sizeof(WebDecoder));
+        if (decoder == NULL) {
+            simpleLog("Allocate decoder failed.");
+            break;
+        }
+
+        if (fileSize >= 0) {
+            decoder->fileSize = fileSize;
+            decoder->lastRequestOffset = -1;
+            if (rangeCacheInit(&decoder->cache, fileSize, kDefaultCacheLimit) != 0) {
+                simpleLog("Allocate range cache for %d bytes failed.", fileSize);
+                av_freep(&decoder);
+            }
+        } else {
+            decoder->isStream = 1;
+            flvScannerInit(&decoder->flvScanner);
+            if (ringInit(&decoder->ring, kStreamRingSize) != 0) {
+                simpleLog("Allocate stream ring of %d bytes failed.", kStreamRingSize);
+                av_freep(&decoder);
+            }
+        }
+
+        if (decoder != NULL) {
+            decoder->videoStreamIdx = -1;
+            decoder->audioStreamIdx = -1;
+            decoder->audioAnchorTs = -1.0;
+            decoder->trackEnabled[kStreamType_Video] = 1;
+            decoder->trackEnabled[kStreamType_Audio] = 1;
+            decoder->packetQueues[kStreamType_Video].maxBytes       = kVideoQueueMaxBytes;
+            decoder->packetQueues[kStreamType_Video].maxDurationMs  = kPacketQueueMaxMs;
+            decoder->packetQueues[kStreamType_Audio].maxBytes       = kAudioQueueMaxBytes;
+            decoder->packetQueues[kStreamType_Audio].maxDurationMs  = kPacketQueueMaxMs;
+            ++decoderCount;
+        }
+    } while (0);
+    simpleLog("Decoder initialized %p, instance count %d.", decoder, decoderCount);
+    return decoder;
+}
+
+ErrorCode uninitDecoder(WebDecoder *decoder) {
+    if (decoder != NULL) {
+        closeDecoder(decoder);
+
+        rangeCacheFree(&decoder->cache);
+
+        ringFree(&decoder->ring);
+
+        freeStreamHint(&decoder->streamHints[kStreamType_Video]);
+        freeStreamHint(&decoder->streamHints[kStreamType_Audio]);
+
+        av_freep(&decoder);
+        --decoderCount;
+    }
+
+    // The log callback is process wide, keep it until the last instance goes away.
+    if (decoderCount <= 0) {
+        decoderCount = 0;
+        av_log_set_callback(NULL);
+    }
+
+    simpleLog("Decoder uninitialized, instance count %d.", decoderCount);
+    return kErrorCode_Success;
+}
+
+//Caps the codec threads to what is left of the module's pool, instances share it. Auto (0)
+//asks for one per core. Fewer than 2 decode on the calling thread and need none.
+int reservePoolThreads(WebDecoder *decoder, int threadCount) {
+#if DECODER_THREAD_POOL > 0
+    int available = DECODER_THREAD_POOL - poolThreadsInUse;
+    if (threadCount == 0) {
+        threadCount = FFMIN(av_cpu_count(), kMaxThreadCount);
+    }
+
+    threadCount = FFMIN(threadCount, available);
+    if (threadCount < 2) {
+        threadCount = 1;
+    } else {
+        decoder->poolThreads = threadCount;
+        poolThreadsInUse += threadCount;
+    }
+    simpleLog("Codec threads %d, pool threads in use %d of %d.", threadCount, poolThreadsInUse, DECODER_THREAD_POOL);
+#endif
+    return threadCount;
+}
+
+void releasePoolThreads(WebDecoder *decoder) {
+    poolThreadsInUse -= decoder->poolThreads;
+    decoder->poolThreads = 0;
+}
+
+ErrorCode openDecoder(WebDecoder *decoder, int *paramArray, int paramCount, long videoCallback, long audioCallback, long requestCallback, int threadCount) {
+    ErrorCode ret = kErrorCode_Success;
+    int r = 0;
+    int i = 0;
+    int params[7] = { 0 };
+    AVCodecParameters *par = NULL;
+    do {
+        simpleLog("Opening decoder.");
+
+        if (decoder == NULL) {
+            ret = kErrorCode_Invalid_State;
+            break;
+        }
+
+        decoder->openStartTick      = getTickCount();
+        decoder->firstFrameDuration = -1;
+        decoder->stats.firstFrameMs = -1;
+
+#if LIBAVFORMAT_VERSION_MAJOR < 58
+        av_register_all();
+        avcodec_register_all();
+#endif
+
+#if DECODER_LOG_LEVEL >= 2
+        if (logLevel == kLogLevel_All) {
+            av_log_set_callback(ffmpegLogCallback);
+        }
+#endif
+        
+        decoder->avformatContext = avformat_alloc_context();
+        decoder->customIoBuffer = (unsigned char*)av_mallocz(kCustomIoBufferSize);
+
+        AVIOContext* ioContext = avio_alloc_context(
+            decoder->customIoBuffer,
+            kCustomIoBufferSize,
+            0,
+            decoder,
+            readCallback,
+            NULL,
+            seekCallback);
+        if (ioContext == NULL) {
+            av_freep(&decoder->customIoBuffer);
+            ret = kErrorCode_FFmpeg_Error;
+            simpleLog("avio_alloc_context failed.");
+            break;
+        }
+
+        // Keep buffered IO in both modes. Direct IO sends every avio_skip to seekCallback, which
+        // can't rewind the ring, and reads larger than customIoBuffer already bypass it.
+        ioContext->direct = 0;
+
+        decoder->avformatContext->pb = ioContext;
+        decoder->avformatContext->flags = AVFMT_FLAG_CUSTOM_IO;
+
+        // Also bounds input format probing in avformat_open_input.
+        if (decoder->probeSize > 0 || decoder->liveMode) {
+            decoder->avformatContext->probesize = decoder->probeSize > 0 ? decoder->probeSize : kLiveProbeSize;
+        }
+
+        if (decoder->analyzeDurationMs > 0 || decoder->liveMode) {
+            decoder->avformatContext->max_analyze_duration =
+                (int64_t)(decoder->analyzeDurationMs > 0 ? decoder->analyzeDurationMs : kLiveAnalyzeDurationMs) * 1000;
+        }
+
+        if (decoder->liveMode) {
+            decoder->avformatContext->flags |= AVFMT_FLAG_NOBUFFER;
+        }
+
+        r = avformat_open_input(&decoder->avformatContext, NULL, NULL, NULL);
+        if (r != 0) {
+            ret = kErrorCode_FFmpeg_Error;
+            char err_info[32] = { 0 };
+            av_strerror(r, err_info, 32);
+            simpleLog("avformat_open_input failed %d %s.", r, err_info);
+            // The format context is gone and closeDecoder skips, a custom IO context stays ours to free.
+            av_freep(&ioContext->buffer);
+            av_freep(&ioContext);
+            decoder->customIoBuffer = NULL;
+            break;
+        }
+        
+        simpleLog("avformat_open_input success.");
+
+        if (streamsDescribed(decoder)) {
+            simpleLog("All streams hinted, skip avformat_find_stream_info.");
+        } else {
+            r = avformat_find_stream_info(decoder->avformatContext, NULL);
+            if (r < 0) {
+                ret = kErrorCode_FFmpeg_Error;
+                simpleLog("av_find_stream_info failed %d.", ret);
+                break;
+            }
+
+            simpleLog("avformat_find_stream_info success.");
+        }
+        applyStreamHints(decoder);
+
+        // Only the tracks we decode are demuxed, openTrack turns them back on.
+        for (i = 0; i < decoder->avformatContext->nb_streams; i++) {
+            decoder->avformatContext->streams[i]->discard = AVDISCARD_ALL;
+        }
+
+        // Negative is auto like 0.
+        threadCount = FFMIN(FFMAX(threadCount, 0), kMaxThreadCount);
+        decoder->threadCount    = reservePoolThreads(decoder, threadCount);
+        decoder->videoWaitKey   = 0;
+
+        decoder->videoStreamIdx = FFMAX(av_find_best_stream(decoder->avformatContext, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0), -1);
+        decoder->audioStreamIdx = FFMAX(av_find_best_stream(decoder->avformatContext, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0), -1);
+        if (decoder->videoStreamIdx < 0 && decoder->audioStreamIdx < 0) {
+            simpleLog("Neither video nor audio stream found.");
+            ret = kErrorCode_Invalid_Format;
+            break;
+        }
+
+        decoder->demuxEof = 0;
+        decoder->drainState[kStreamType_Video] = 0;
+        decoder->drainState[kStreamType_Audio] = 0;
+        ret = openTrack(decoder, kStreamType_Video);
+        if (ret != kErrorCode_Success) {
+            break;
+        }
+
+        ret = openTrack(decoder, kStreamType_Audio);
+        if (ret != kErrorCode_Success) {
+            break;
+        }
+
+        // Again with the audio buffer counted, and for files without video.
+        ret = applyMemoryBudget(decoder);
+        if (ret != kErrorCode_Success) {
+            break;
+        }
+
+        av_seek_frame(decoder->avformatContext, -1, 0, AVSEEK_FLAG_BACKWARD);
+
+        /* For RGB Renderer(2D WebGL).
+        decoder->swsCtx = sws_getContext(
+            decoder->videoCodecContext->width,
+            decoder->videoCodecContext->height,
+            decoder->videoCodecContext->pix_fmt, 
+            decoder->videoCodecContext->width,
+            decoder->videoCodecContext->height,
+            AV_PIX_FMT_RGB32,
+            SWS_BILINEAR, 
+            0, 
+            0, 
+            0);
+        if (decoder->swsCtx == NULL) {
+            simpleLog("sws_getContext failed.");
+            ret = kErrorCode_FFmpeg_Error;
+            break;
+        }
+        */
+
+        decoder->avFrame = av_frame_alloc();
+        initFramePool(decoder);
+        initPresentQueue(decoder);
+        
+        // A disabled track reports its stream parameters, a missing one zeros.
+        params[0] = 1000 * (decoder->avformatContext->duration + 5000) / AV_TIME_BASE;
+        params[1] = AV_PIX_FMT_NONE;
+        params[4] = getOutputSampleFormat(decoder);
+        if (decoder->videoCodecContext != NULL) {
+            params[1] = decoder->videoCodecContext->pix_fmt;
+            params[2] = decoder->videoCodecContext->width;
+            params[3] = decoder->videoCodecContext->height;
+        } else if (decoder->videoStreamIdx >= 0) {
+            par = decoder->avformatContext->streams[decoder->videoStreamIdx]->codecpar;
+            params[1] = par->format;
+            params[2] = par->width;
+            params[3] = par->height;
+        }
+
+        if (decoder->audioCodecContext != NULL) {
+            params[5] = decoder->audioCodecContext->channels;
+            params[6] = decoder->audioCodecContext->sample_rate;
+        } else if (decoder->audioStreamIdx >= 0) {
+            par = decoder->avformatContext->streams[decoder->audioStreamIdx]->codecpar;
+            params[5] = par->channels;
+            params[6] = par->sample_rate;
+        }
+
+        // What audioCallback will deliver, not what the stream carries.
+        if (params[5] > 0 && audioOutputActive(decoder)) {
+            params[5] = decoder->audioOutChannels > 0 ? decoder->audioOutChannels : params[5];
+            params[6] = decoder->audioOutRate > 0 ? decoder->audioOutRate : params[6];
+        }
+
+        if (paramArray != NULL && paramCount > 0) {
+            for (int i = 0; i < paramCount; ++i) {
+                paramArray[i] = params[i];
+            }
+        }
+
+        decoder->videoCallback = (VideoCallback)videoCallback;
+        decoder->audioCallback = (AudioCallback)audioCallback;
+        decoder->requestCallback = (RequestCallback)requestCallback;
+
+        decoder->stats.openMs       = (double)(getTickCount() - decoder->openStartTick);
+        decoder->stats.openBytes    = (double)decoder->avformatContext->pb->bytes_read;
+        simpleLog("Decoder opened in %dms after %d bytes, duration %ds, picture size %d.",
+            (int)decoder->stats.openMs, (int)decoder->stats.openBytes, params[0], decoder->videoSize);
+    } while (0);
+
+    if (ret != kErrorCode_Success && decoder != NULL) {
+        closeDecoder(decoder);
+    }
+    return ret;
+}
+
+ErrorCode closeDecoder(WebDecoder *decoder) {
+    ErrorCode ret = kErrorCode_Success;
+    do {
+        if (decoder == NULL || decoder->avformatContext == NULL) {
+            break;
+        }
+
+        closeThumbnailContext(decoder);
+        freePacketQueues(decoder);
+        decoder->demuxEof = 0;
+        decoder->drainState[kStreamType_Video] = 0;
+        decoder->drainState[kStreamType_Audio] = 0;
+
+        if (decoder->videoCodecContext != NULL) {
+            closeCodecContext(decoder->avformatContext, decoder->videoCodecContext, decoder->videoStreamIdx);
+            decoder->videoCodecContext = NULL;
+            simpleLog("Video codec context closed.");
+        }
+
+        if (decoder->audioCodecContext != NULL) {
+            closeCodecContext(decoder->avformatContext, decoder->audioCodecContext, decoder->audioStreamIdx);
+            decoder->audioCodecContext = NULL;
+            simpleLog("Audio codec context closed.");
+        }
+
+        AVIOContext *pb = decoder->avformatContext->pb;
+        if (pb != NULL) {
+            if (pb->buffer != NULL) {
+                av_freep(&pb->buffer);
+                decoder->customIoBuffer = NULL;
+            }
+            av_freep(&decoder->avformatContext->pb);
+            simpleLog("IO context released.");
+        }
+
+        avformat_close_input(&decoder->avformatContext);
+        decoder->avformatContext = NULL;
+        simpleLog("Input closed.");
+
+        if (decoder->yuvBuffer != NULL) {
+            av_freep(&decoder->yuvBuffer);
+        }
+
+        if (decoder->pcmBuffer != NULL) {
+            av_freep(&decoder->pcmBuffer);
+        }
+        freeAudioOutput(decoder);
+
+        if (decoder->scaleBuffer != NULL) {
+            av_freep(&decoder->scaleBuffer);
+            decoder->scaleBufferSize = 0;
+        }
+        
+        if (decoder->avFrame != NULL) {
+            av_frame_free(&decoder->avFrame);
+        }
+
+        uninitFramePool(decoder);
+        uninitPresentQueue(decoder);
+        releasePoolThreads(decoder);
+
+        // Codecs and lent frames are gone, every picture is back and the pool frees at once.
+        retirePicturePool(decoder);
+        decoder->pictureSize            = 0;
+        decoder->pictureLimit           = 0;
+        decoder->videoBufferSize        = 0;
+        decoder->currentPcmBufferSize   = 0;
+        simpleLog("All buffer released.");
+    } while (0);
+    return ret;
+}
+
+//Returns accepted bytes, in stream mode it is less than size when the ring is full.
+int sendData(WebDecoder *decoder, unsigned char *buff, int size) {
+    int ret = 0;
+    int64_t leftBytes = 0;
+    int canWriteBytes = 0;
+    do {
+        if (decoder == NULL) {
+            ret = -1;
+            break;
+        }
+
+        if (buff == NULL || size == 0) {
+            ret = -2;
+            break;
+        }
+
+        ret = decoder->isStream ? writeToRing(decoder, buff, size) : writeToCache(decoder, decoder->fileWritePos, buff, size);
+        if (ret > 0) {
+            decoder->stats.bytesIn += ret;
+        }
+    } while (0);
+    return ret;
+}
+
+//File mode only, places the chunk at its byte offset so out of order downloads land right.
+int sendDataAt(WebDecoder *decoder, int offset, unsigned char *buff, int size) {
+    int ret = 0;
+    do {
+        if (decoder == NULL || decoder->isStream) {
+            ret = -1;
+            break;
+        }
+
+        if (buff == NULL || size == 0 || offset < 0) {
+            ret = -2;
+            break;
+        }
+
+        ret = writeToCache(decoder, offset, buff, size);
+        if (ret > 0) {
+            decoder->stats.bytesIn += ret;
+        }
+    } while (0);
+    return ret;
+}
+
+//Copy-free ingest, the host copies downloaded bytes straight into decoder storage: a ring
+//span in stream mode, a cache extent at offset in file mode. Sets *span and returns its
+//writable length, 0 when the ring is full, negative on error. At most one span is open, it
+//stays valid until commitWrite and must not outlive other sendData calls.
+int getWriteSpan(WebDecoder *decoder, int offset, unsigned char **span) {
+    int ret             = 0;
+    CacheExtent *ext    = NULL;
+    int inner           = 0;
+    do {
+        if (decoder == NULL || span == NULL) {
+            ret = -1;
+            break;
+        }
+
+        *span = NULL;
+        decoder->ingestSpan     = NULL;
+        decoder->ingestSpanSize = 0;
+        if (decoder->isStream) {
+            if (decoder->ring.data == NULL) {
+                ret = -1;
+                break;
+            }
+            ret = ringWriteSpan(&decoder->ring, span);
+        } else {
+            if (decoder->cache.index == NULL || offset < 0 || offset >= decoder->fileSize) {
+                ret = -2;
+                break;
+            }
+
+            ext = rangeCacheGetExtent(&decoder->cache, offset, 1);
+            if (ext == NULL) {
+                ret = -1;
+                break;
+            }
+            inner   = offset % kCacheExtentSize;
+            *span   = ext->data + inner;
+            ret     = (int)MIN(kCacheExtentSize - inner, decoder->fileSize - offset);
+        }
+
+        decoder->ingestSpan     = *span;
+        decoder->ingestSpanSize = ret;
+        decoder->ingestOffset   = offset;
+    } while (0);
+    return ret;
+}
+
+//Publishes the first size bytes written into the span from getWriteSpan, returns size.
+int commitWrite(WebDecoder *decoder, int size) {
+    int ret             = 0;
+    CacheExtent *ext    = NULL;
+    int inner           = 0;
+    do {
+        if (decoder == NULL || decoder->ingestSpan == NULL) {
+            ret = -1;
+            break;
+        }
+
+        if (size < 0 || size > decoder->ingestSpanSize) {
+            ret = -2;
+            break;
+        }
+
+        if (decoder->isStream) {
+            ringCommit(&decoder->ring, size);
+            flvScannerFeed(&decoder->flvScanner, decoder->ingestSpan, size);
+            decoder->stats.ringPeak = FFMAX(decoder->stats.ringPeak, decoder->ring.size);
+        } else {
+            inner   = (int)(decoder->ingestOffset % kCacheExtentSize);
+            ext     = rangeCacheGetExtent(&decoder->cache, decoder->ingestOffset, 0);
+            if (ext == NULL || ext->data + inner != decoder->ingestSpan) {
+                ret = -1;
+                break;
+            }
+            rangeCacheMarkValid(ext, inner, size);
+            cacheWritten(decoder, decoder->ingestOffset, size);
+        }
+
+        decoder->ingestSpan     = NULL;
+        decoder->ingestSpanSize = 0;
+        decoder->stats.bytesIn += size;
+        ret = size;
+    } while (0);
+    return ret;
+}
+
+ErrorCode decodeOnePacket(WebDecoder *decoder) {
+    int packetSize = 0;
+    return decodeNextPacket(decoder, &packetSize);
+}
+
+ErrorCode decodePackets(WebDecoder *decoder, int maxFrames, int timeBudgetMs, DecodeStatus *status) {
+    ErrorCode ret               = kErrorCode_Success;
+    DecodeStatus localStatus    = { 0 };
+    DecodeStatus *st            = status != NULL ? status : &localStatus;
+    unsigned long startTick     = getTickCount();
+    double videoFramesBegin     = 0;
+    double audioFramesBegin     = 0;
+    int packetSize              = 0;
+
+    memset(st, 0, sizeof(DecodeStatus));
+    do {
+        if (decoder == NULL || decoder->avformatContext == NULL) {
+            ret = kErrorCode_Invalid_State;
+            st->stopReason = kDecodeStop_Error;
+            break;
+        }
+
+        videoFramesBegin = decoder->stats.videoFrames;
+        audioFramesBegin = decoder->stats.audioFrames;
+
+        while (1) {
+            st->videoFrames = (int)(decoder->stats.videoFrames - videoFramesBegin);
+            st->audioFrames = (int)(decoder->stats.audioFrames - audioFramesBegin);
+            st->framesOut   = st->videoFrames + st->audioFrames;
+
+            if (maxFrames > 0 && st->framesOut >= maxFrames) {
+                st->stopReason = kDecodeStop_FrameLimit;
+                break;
+            }
+
+            if (timeBudgetMs > 0 && getTickCount() - startTick >= (unsigned long)timeBudgetMs) {
+                st->stopReason = kDecodeStop_TimeBudget;
+                break;
+            }
+
+            packetSize = 0;
+            ret = decodeNextPacket(decoder, &packetSize);
+            if (ret == kErrorCode_Success || ret == kErrorCode_Old_Frame) {
+                // A read that returned no packet means the IO ran dry.
+                if (packetSize <= 0) {
+                    ret = kErrorCode_Success;
+                    st->stopReason = kDecodeStop_Starved;
+                    break;
+                }
+                ++st->packets;
+                st->bytesConsumed += packetSize;
+                ret = kErrorCode_Success;
+            } else if (ret == kErrorCode_Invalid_State) {
+                ret = kErrorCode_Success;
+                st->stopReason = kDecodeStop_Starved;
+                break;
+            } else if (ret == kErrorCode_Eof) {
+                st->stopReason = kDecodeStop_Eof;
+                break;
+            } else if (ret == kErrorCode_Frame_Pool_Full) {
+                st->stopReason = kDecodeStop_PoolFull;
+                break;
+            } else {
+                st->stopReason = kDecodeStop_Error;
+                break;
+            }
+        }
+
+        st->videoFrames = (int)(decoder->stats.videoFrames - videoFramesBegin);
+        st->audioFrames = (int)(decoder->stats.audioFrames - audioFramesBegin);
+        st->framesOut   = st->videoFrames + st->audioFrames;
+    } while (0);
+
+    st->elapsedMs = (int)(getTickCount() - startTick);
+    st->lastError = ret;
+    return ret;
+}
+
+ErrorCode seekTo(WebDecoder *decoder, int ms, int accurateSeek) {
+    int ret = 0;
+    int64_t pts = (int64_t)ms * 1000;
+    if (decoder == NULL || decoder->avformatContext == NULL) {
+        return kErrorCode_Invalid_State;
+    }
+
+    decoder->accurateSeek = accurateSeek;
+    ret = avformat_seek_file(decoder->avformatContext,
+                                 -1,
+                                 INT64_MIN,
+                                 pts,
+                                 pts,
+                                 AVSEEK_FLAG_BACKWARD);
+    simpleLog("Native seek to %d return %d %d.", ms, ret, decoder->accurateSeek);
+    if (ret == -1) {
+        return kErrorCode_FFmpeg_Error;
+    } else {
+        flushPacketQueues(decoder);
+        flushCodecContexts(decoder);
+
+        decoder->demuxEof       = 0;
+        decoder->seekPending    = 1;
+        decoder->seekStartTick  = getTickCount();
+        ++decoder->stats.seekCount;
+        decoder->preRolling     = accurateSeek && decoder->videoStreamIdx >= 0;
+        decoder->preRollTargetPts = decoder->videoStreamIdx < 0 ? 0 : av_rescale_q(pts,
+            AV_TIME_BASE_Q,
+            decoder->avformatContext->streams[decoder->videoStreamIdx]->time_base);
+
+        decoder->beginTimeOffset = (double)ms / 1000;
+        decoder->demuxTime = decoder->beginTimeOffset;
+
+        // Trigger seek callback, the packet read is the one at the seek point, keep it.
+        AVPacket packet;
+        av_init_packet(&packet);
+        if (av_read_frame(decoder->avformatContext, &packet) >= 0) {
+            queueDemuxedPacket(decoder, &packet);
+        }
+        av_packet_unref(&packet);
+        return kErrorCode_Success;
+    }
+}
+
+ErrorCode setOutputMode(WebDecoder *decoder, int mode) {
+    ErrorCode ret = kErrorCode_Success;
+    do {
+        if (decoder == NULL) {
+            ret = kErrorCode_Invalid_State;
+            break;
+        }
+
+        if (mode != kOutputMode_Copy && mode != kOutputMode_Frame) {
+            ret = kErrorCode_Invalid_Param;
             break;
         }
 
-        if (decoder->pcmBuffer == NULL) {
-            decoder->pcmBuffer = (unsigned char*)av_mallocz(kInitialPcmBufferSize);
-            decoder->currentPcmBufferSize = kInitialPcmBufferSize;
-            simpleLog("Initial PCM buffer size %d.", decoder->currentPcmBufferSize);
-        }
-
-        audioDataSize = frame->nb_samples * decoder->audioCodecContext->channels * sampleSize;
-        if (decoder->currentPcmBufferSize < audioDataSize) {
-            targetSize = roundUp(audioDataSize, 4);
-            simpleLog("Current PCM buffer size %d not sufficient for data size %d, round up to target %d.",
-                decoder->currentPcmBufferSize,
-                audioDataSize,
-                targetSize);
-            decoder->currentPcmBufferSize = targetSize;
-            av_free(decoder->pcmBuffer);
-            decoder->pcmBuffer = (unsigned char*)av_mallocz(decoder->currentPcmBufferSize);
-        }
+        decoder->outputMode = (OutputMode)mode;
+        simpleLog("Output mode set to %d.", mode);
+    } while (0);
+    return ret;
+}
 
-        for (i = 0; i < frame->nb_samples; i++) {
-            for (ch = 0; ch < decoder->audioCodecContext->channels; ch++) {
-                memcpy(decoder->pcmBuffer + offset, frame->data[ch] + sampleSize * i, sampleSize);
-                offset += sampleSize;
-            }
+ErrorCode setAudioLayout(WebDecoder *decoder, int layout) {
+    ErrorCode ret = kErrorCode_Success;
+    do {
+        if (decoder == NULL) {
+            ret = kErrorCode_Invalid_State;
+            break;
         }
 
-        timestamp = (double)frame->pts * av_q2d(decoder->avformatContext->streams[decoder->audioStreamIdx]->time_base);
-
-        if (decoder->accurateSeek && timestamp < decoder->beginTimeOffset) {
-            //simpleLog("audio timestamp %lf < %lf", timestamp, decoder->beginTimeOffset);
-            ret = kErrorCode_Old_Frame;
+        if (layout != kAudioLayout_Interleaved && layout != kAudioLayout_Planar) {
+            ret = kErrorCode_Invalid_Param;
             break;
         }
-        if (decoder->audioCallback != NULL) {
-            decoder->audioCallback(decoder->pcmBuffer, audioDataSize, timestamp);
-        }
+
+        decoder->audioLayout = (AudioLayout)layout;
+        simpleLog("Audio layout set to %d.", layout);
     } while (0);
     return ret;
 }
 
-ErrorCode decodePacket(AVPacket *pkt, int *decodedLen) {
-    int ret = 0;
-    int isVideo = 0;
-    AVCodecContext *codecContext = NULL;
-
-    if (pkt == NULL || decodedLen == NULL) {
-        simpleLog("decodePacket invalid param.");
-        return kErrorCode_Invalid_Param;
-    }
-
-    *decodedLen = 0;
-
-    if (pkt->stream_index == decoder->videoStreamIdx) {
-        codecContext = decoder->videoCodecContext;
-        isVideo = 1;
-    } else if (pkt->stream_index == decoder->audioStreamIdx) {
-        codecContext = decoder->audioCodecContext;
-        isVideo = 0;
-    } else {
-        return kErrorCode_Invalid_Data;
-    }
+//Native audio conversion, sampleRate and channels (1 or 2) set before openDecoder, 0 keeps the
+//source's. blockMs batches callbacks into blocks of that many milliseconds, 0 calls back per
+//decoded frame. Applies to Float32 convertible sources only, openDecoder reports the result.
+ErrorCode setAudioOutput(WebDecoder *decoder, int sampleRate, int channels, int blockMs) {
+    ErrorCode ret = kErrorCode_Success;
+    do {
+        if (decoder == NULL) {
+            ret = kErrorCode_Invalid_State;
+            break;
+        }
 
-    ret = avcodec_send_packet(codecContext, pkt);
-    if (ret < 0) {
-        simpleLog("Error sending a packet for decoding %d.", ret);
-        return kErrorCode_FFmpeg_Error;
-    }
+        if ((sampleRate != 0 && (sampleRate < kMinAudioOutputRate || sampleRate > kMaxAudioOutputRate)) ||
+            channels < 0 || channels > 2 ||
+            blockMs < 0 || blockMs > kMaxAudioBlockMs) {
+            ret = kErrorCode_Invalid_Param;
+            break;
+        }
 
-    while (ret >= 0) {
-        ret = avcodec_receive_frame(codecContext, decoder->avFrame);
-        if (ret == AVERROR(EAGAIN)) {
-            return kErrorCode_Success;
-        } else if (ret == AVERROR_EOF) {
-            return kErrorCode_Eof;
-        } else if (ret < 0) {
-            simpleLog("Error during decoding %d.", ret);
-            return kErrorCode_FFmpeg_Error;
-        } else {
-            int r = isVideo ? processDecodedVideoFrame(decoder->avFrame) : processDecodedAudioFrame(decoder->avFrame);
-            if (r == kErrorCode_Old_Frame) {
-                return r;
-            }
+        // The host set up its audio output from the open parameters.
+        if (decoder->avformatContext != NULL &&
+            (sampleRate != decoder->audioOutRate || channels != decoder->audioOutChannels)) {
+            ret = kErrorCode_Invalid_State;
+            break;
         }
-    }
 
-    *decodedLen = pkt->size;
-    return kErrorCode_Success;
+        flushAudioBlock(decoder);
+        decoder->audioOutRate       = sampleRate;
+        decoder->audioOutChannels   = channels;
+        decoder->audioBlockMs       = blockMs;
+        simpleLog("Audio output %d Hz, %d channels, %dms blocks.", sampleRate, channels, blockMs);
+    } while (0);
+    return ret;
 }
 
-int readFromFile(uint8_t *data, int len) {
-    //simpleLog("readFromFile %d.", len);
-    int32_t ret         = -1;
-    int availableBytes  = 0;
-    int canReadLen      = 0;
+int getLastSeekDuration(WebDecoder *decoder) {
+    return decoder == NULL ? -1 : decoder->lastSeekDuration;
+}
+
+//File mode cache budget in bytes, shrinking evicts least recently used extents.
+ErrorCode setCacheLimit(WebDecoder *decoder, int limit) {
+    ErrorCode ret = kErrorCode_Success;
     do {
-        if (decoder->fp == NULL) {
+        if (decoder == NULL || decoder->isStream || decoder->cache.index == NULL) {
+            ret = kErrorCode_Invalid_State;
             break;
         }
 
-        availableBytes = decoder->fileWritePos - decoder->fileReadPos;
-        if (availableBytes <= 0) {
+        ret = resizeCache(&decoder->cache, limit / kCacheExtentSize);
+        if (ret != kErrorCode_Success) {
             break;
         }
 
-        fseek(decoder->fp, decoder->fileReadPos, SEEK_SET);
-        canReadLen = MIN(availableBytes, len);
-        fread(data, canReadLen, 1, decoder->fp);
-        decoder->fileReadPos += canReadLen;
-        ret = canReadLen;
+        // Under a budget a bigger cache leaves fewer pictures, never fewer than needed.
+        applyMemoryBudget(decoder);
+        simpleLog("Cache limit set to %d extents.", decoder->cache.maxExtents);
     } while (0);
-    //simpleLog("readFromFile ret %d.", ret);
     return ret;
 }
 
-int readFromFifo(uint8_t *data, int len) {
-    //simpleLog("readFromFifo %d.", len);
-    int32_t ret         = -1;
-    int availableBytes  = 0;
-    int canReadLen      = 0;
+ErrorCode releaseFrame(WebDecoder *decoder, int index) {
+    ErrorCode ret = kErrorCode_Success;
+    FrameSlot *slot = NULL;
     do {
-        if (decoder->fifo == NULL) {
+        if (decoder == NULL) {
+            ret = kErrorCode_Invalid_State;
+            break;
+        }
+
+        if (index < 0 || index >= kFramePoolSize) {
+            ret = kErrorCode_Invalid_Param;
             break;
-        }	
+        }
 
-        availableBytes = av_fifo_size(decoder->fifo);
-        if (availableBytes <= 0) {
+        slot = &decoder->framePool[index];
+        if (!slot->inUse) {
+            ret = kErrorCode_Invalid_Param;
             break;
         }
 
-        canReadLen = MIN(availableBytes, len);
-        av_fifo_generic_read(decoder->fifo, data, canReadLen, NULL);
-        ret = canReadLen;
+        if (slot->frame != NULL) {
+            av_frame_unref(slot->frame);
+        }
+        memset(&slot->view, 0, sizeof(FrameView));
+        slot->inUse = 0;
+        --decoder->framesInUse;
     } while (0);
-    //simpleLog("readFromFifo ret %d, left %d.", ret, av_fifo_size(decoder->fifo));
     return ret;
 }
 
-int readCallback(void *opaque, uint8_t *data, int len) {
-    //simpleLog("readCallback %d.", len);
-    int32_t ret         = -1;
+//Plain copy plus a few live gauges, cheap enough to poll every tick.
+ErrorCode getStats(WebDecoder *decoder, DecoderStats *stats) {
+    ErrorCode ret = kErrorCode_Success;
     do {
         if (decoder == NULL) {
+            ret = kErrorCode_Invalid_State;
             break;
         }
 
-        if (data == NULL || len <= 0) {
+        if (stats == NULL) {
+            ret = kErrorCode_Invalid_Param;
             break;
-        }		
+        }
 
-        ret = decoder->isStream ? readFromFifo(data, len) : readFromFile(data, len);
+        memcpy(stats, &decoder->stats, sizeof(DecoderStats));
+        stats->bufferedBytes    = getAailableDataSize(decoder);
+        stats->ringCapacity     = decoder->ring.capacity;
+        stats->cacheBytes       = (double)decoder->cache.extentCount * kCacheExtentSize;
+        stats->cacheLimit       = (double)decoder->cache.maxExtents * kCacheExtentSize;
+        stats->liveLatencyMs    = getLiveLatency(decoder);
+        stats->qualityLevel     = decoder->qualityLevel;
+        stats->videoQueueBytes  = decoder->packetQueues[kStreamType_Video].bytes;
+        stats->audioQueueBytes  = decoder->packetQueues[kStreamType_Audio].bytes;
+        stats->videoQueueMs     = packetQueueDurationMs(&decoder->packetQueues[kStreamType_Video]);
+        stats->audioQueueMs     = packetQueueDurationMs(&decoder->packetQueues[kStreamType_Audio]);
+        stats->presentQueueFrames = decoder->present.tail - __atomic_load_n(&decoder->present.head, __ATOMIC_ACQUIRE);
     } while (0);
-    //simpleLog("readCallback ret %d.", ret);
     return ret;
 }
 
-int64_t seekCallback(void *opaque, int64_t offset, int whence) {
-    int64_t ret         = -1;
-    int64_t pos         = -1;
-    int64_t req_pos     = -1;
-    //simpleLog("seekCallback %lld %d.", offset, whence);
-    do {
-        if (decoder == NULL || decoder->isStream || decoder->fp == NULL) {
-            break;
-        }
+ErrorCode resetStats(WebDecoder *decoder) {
+    if (decoder == NULL) {
+        return kErrorCode_Invalid_State;
+    }
 
-        if (whence == AVSEEK_SIZE) {
-            ret = decoder->fileSize;
+    memset(&decoder->stats, 0, sizeof(DecoderStats));
+    decoder->stats.firstFrameMs = decoder->firstFrameDuration;
+    decoder->memoryPeak         = memoryInUse(decoder);
+    return kErrorCode_Success;
+}
+
+//Formats pending log events as lines into buff, or prints them when buff is NULL.
+//Returns bytes written, events that don't fit stay queued. One drainer at a time.
+int drainLog(char *buff, int size) {
+    int written = 0;
+#if DECODER_LOG_LEVEL > 0
+    char line[kLogLineSize];
+    double wallOffsetUs = logWallOffsetUs();
+    uint32_t writeSeq   = 0;
+    uint32_t readSeq    = 0;
+    uint32_t seq        = 0;
+    int len             = 0;
+    LogEvent *ev        = NULL;
+    LogEvent event;
+
+    while (1) {
+        writeSeq    = __atomic_load_n(&logRing.writeSeq, __ATOMIC_ACQUIRE);
+        readSeq     = logRing.readSeq;
+        if (readSeq == writeSeq) {
             break;
         }
 
-        if (whence != SEEK_END && whence != SEEK_SET && whence != SEEK_CUR) {
-            break;
+        // Producers lapped us, skip to the oldest event still in the ring.
+        if (writeSeq - readSeq > kLogRingSize) {
+            logRing.lost    += writeSeq - readSeq - kLogRingSize;
+            readSeq         = writeSeq - kLogRingSize;
+            logRing.readSeq = readSeq;
         }
 
-        ret = fseek(decoder->fp, (long)offset, whence);
-        if (ret == -1) {
-            break;
+        ev  = &logRing.events[readSeq & (kLogRingSize - 1)];
+        seq = __atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE);
+        if (seq != readSeq + 1) {
+            if (seq == 0 || (int32_t)(seq - (readSeq + 1)) < 0) {
+                break;  // Still being written.
+            }
+            ++logRing.lost;
+            ++logRing.readSeq;
+            continue;
         }
 
-        pos = (int64_t)ftell(decoder->fp);
-        if (pos < decoder->lastRequestOffset || pos > decoder->fileWritePos) {
-            decoder->lastRequestOffset  = pos;
-            decoder->fileReadPos        = pos;
-            decoder->fileWritePos       = pos;
-            req_pos                     = pos;
-            ret                         = -1;  // Forcing not to call read at once.
-            decoder->requestCallback(pos, getAailableDataSize());
-            simpleLog("Will request %lld and return %lld.", pos, ret);
-            break;
+        memcpy(&event, ev, sizeof(LogEvent));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&ev->seq, __ATOMIC_RELAXED) != seq) {
+            ++logRing.lost;
+            ++logRing.readSeq;
+            continue;
         }
 
-        decoder->fileReadPos = pos;
-        ret = pos;
-    } while (0);
-    //simpleLog("seekCallback return %lld.", ret);
+        len = logFormatEvent(&event, wallOffsetUs, line, sizeof(line));
+        if (buff == NULL) {
+            printf("%s\n", line);
+        } else {
+            if (written + len + 1 > size) {
+                break;
+            }
+            memcpy(buff + written, line, len);
+            buff[written + len] = '\n';
+        }
+        written += len + 1;
+        ++logRing.readSeq;
+    }
 
-    if (decoder != NULL && decoder->requestCallback != NULL) {
-        decoder->requestCallback(req_pos, getAailableDataSize());
+    if (logRing.lost > 0 && (buff == NULL || written + 48 <= size)) {
+        len = snprintf(line, sizeof(line), "[Log] %u events lost.", logRing.lost);
+        if (buff == NULL) {
+            printf("%s\n", line);
+        } else {
+            memcpy(buff + written, line, len);
+            buff[written + len] = '\n';
+        }
+        written += len + 1;
+        logRing.lost = 0;
     }
-    return ret;
+#endif
+    return written;
 }
 
-int writeToFile(unsigned char *buff, int size) {
-    int ret = 0;
-    int64_t leftBytes = 0;
-    int canWriteBytes = 0;
+//Fast open, 0 keeps the FFmpeg default. Takes effect on the next openDecoder.
+ErrorCode setProbeLimits(WebDecoder *decoder, int probeSize, int analyzeDurationMs) {
+    ErrorCode ret = kErrorCode_Success;
     do {
-        if (decoder->fp == NULL) {
-            ret = -1;
+        if (decoder == NULL) {
+            ret = kErrorCode_Invalid_State;
             break;
         }
 
-        leftBytes = decoder->fileSize - decoder->fileWritePos;
-        if (leftBytes <= 0) {
+        // avformat rejects probesize below 32.
+        if (probeSize < 0 || (probeSize > 0 && probeSize < 32) || analyzeDurationMs < 0) {
+            ret = kErrorCode_Invalid_Param;
             break;
         }
 
-        canWriteBytes = MIN(leftBytes, size);
-        fseek(decoder->fp, decoder->fileWritePos, SEEK_SET);
-        fwrite(buff, canWriteBytes, 1, decoder->fp);
-        decoder->fileWritePos += canWriteBytes;
-        ret = canWriteBytes;
+        decoder->probeSize          = probeSize;
+        decoder->analyzeDurationMs  = analyzeDurationMs;
+        simpleLog("Probe limits set to %d bytes, %dms.", probeSize, analyzeDurationMs);
     } while (0);
     return ret;
 }
 
-int writeToFifo(unsigned char *buff, int size) {
-    int ret = 0;
+//A NULL hint or codecId 0 clears it. Takes effect on the next openDecoder.
+ErrorCode setStreamHint(WebDecoder *decoder, int type, const StreamHint *hint) {
+    ErrorCode ret = kErrorCode_Success;
+    StreamHint *dst = NULL;
     do {
-        if (decoder->fifo == NULL) {
-            ret = -1;
+        if (decoder == NULL) {
+            ret = kErrorCode_Invalid_State;
             break;
         }
 
-        int64_t leftSpace = av_fifo_space(decoder->fifo);
-        if (leftSpace < size) {
-            int growSize = 0;
-            do {
-                leftSpace += decoder->fifoSize;
-                growSize += decoder->fifoSize;
-                decoder->fifoSize += decoder->fifoSize;
-            } while (leftSpace < size);
-            av_fifo_grow(decoder->fifo, growSize);
+        if (type != kStreamType_Video && type != kStreamType_Audio) {
+            ret = kErrorCode_Invalid_Param;
+            break;
+        }
 
-            simpleLog("Fifo size growed to %d.", decoder->fifoSize);
-            if (decoder->fifoSize >= kMaxFifoSize) {
-                simpleLog("[Warn] Fifo size larger than %d.", kMaxFifoSize);
-            }
+        dst = &decoder->streamHints[type];
+        freeStreamHint(dst);
+        if (hint == NULL || hint->codecId == AV_CODEC_ID_NONE) {
+            break;
         }
 
-        //simpleLog("Wrote %d bytes to fifo, total %d.", size, av_fifo_size(decoder->fifo));
-        ret = av_fifo_generic_write(decoder->fifo, buff, size, NULL);
+        *dst = *hint;
+        dst->extradata      = NULL;
+        dst->extradataSize  = 0;
+        if (hint->extradata != NULL && hint->extradataSize > 0) {
+            dst->extradata = (unsigned char *)av_malloc(hint->extradataSize);
+            if (dst->extradata == NULL) {
+                ret = kErrorCode_NULL_Pointer;
+                break;
+            }
+            memcpy(dst->extradata, hint->extradata, hint->extradataSize);
+            dst->extradataSize = hint->extradataSize;
+        }
+        simpleLog("Stream %d hint codec %d, extradata %d bytes.", type, dst->codecId, dst->extradataSize);
     } while (0);
     return ret;
 }
 
-int getAailableDataSize() {
-    int ret = 0;
+int getTimeToFirstFrame(WebDecoder *decoder) {
+    return decoder == NULL ? -1 : decoder->firstFrameDuration;
+}
+
+//Keyframes the demuxer indexed (MP4 sample table, FLV keyframes metadata). Copies up to
+//maxCount entries and returns the total, call with NULL first to size the array.
+int getKeyframeIndex(WebDecoder *decoder, KeyframeEntry *entries, int maxCount) {
+    AVStream *video         = NULL;
+    const AVIndexEntry *ie  = NULL;
+    KeyframeEntry *prev     = NULL;
+    int64_t offset          = 0;
+    int count               = 0;
+    int frames              = 0;
+    int entryCount          = 0;
+    int i                   = 0;
+
+    if (decoder == NULL || decoder->avformatContext == NULL || decoder->videoStreamIdx < 0) {
+        return -1;
+    }
+
+    video = decoder->avformatContext->streams[decoder->videoStreamIdx];
+    entryCount = streamIndexCount(video);
+    for (i = 0; i < entryCount; ++i) {
+        ie = streamIndexEntry(video, i);
+        if (!(ie->flags & AVINDEX_KEYFRAME)) {
+            ++frames;
+            continue;
+        }
+
+        offset = keyframeOffset(decoder, ie);
+        if (prev != NULL) {
+            prev->size      = (double)FFMAX(offset - (int64_t)prev->offset, 0);
+            prev->frames    = frames;
+            prev            = NULL;
+        }
+
+        if (entries != NULL && count < maxCount) {
+            prev = &entries[count];
+            prev->timestamp = ie->timestamp * av_q2d(video->time_base);
+            prev->offset    = (double)offset;
+            prev->size      = 0;
+            prev->frames    = 0;
+        }
+        ++count;
+        frames = 1;
+    }
+
+    if (prev != NULL) {
+        prev->size      = decoder->fileSize > 0 ? (double)FFMAX(decoder->fileSize - (int64_t)prev->offset, 0) : 0;
+        prev->frames    = frames;
+    }
+    return count;
+}
+
+//File mode, walks the demuxer index from the current demux position in dts order and
+//returns the uncached byte ranges needed within horizonMs, in the order they will be read.
+//Returns 0 without an index (FLV without keyframes metadata), the download stays linear.
+int getReadaheadPlan(WebDecoder *decoder, ReadaheadRange *ranges, int maxCount, int horizonMs) {
+    AVStream *streams[2]    = { NULL, NULL };
+    int next[2]             = { 0 };
+    double endTime          = 0.0;
+    double ts[2]            = { 0.0 };
+    const AVIndexEntry *ie  = NULL;
+    int count               = 0;
+    int pick                = 0;
+    int i                   = 0;
+
+    if (decoder == NULL || decoder->avformatContext == NULL || decoder->isStream) {
+        return -1;
+    }
+
+    if (ranges == NULL || maxCount <= 0) {
+        return 0;
+    }
+
+    endTime = decoder->demuxTime + horizonMs / 1000.0;
+    streams[0] = decoder->videoStreamIdx >= 0 ? decoder->avformatContext->streams[decoder->videoStreamIdx] : NULL;
+    streams[1] = decoder->audioStreamIdx >= 0 ? decoder->avformatContext->streams[decoder->audioStreamIdx] : NULL;
+    for (i = 0; i < 2; ++i) {
+        if (streams[i] == NULL) {
+            continue;
+        }
+
+        next[i] = av_index_search_timestamp(streams[i],
+            (int64_t)(decoder->demuxTime / av_q2d(streams[i]->time_base)),
+            AVSEEK_FLAG_BACKWARD | AVSEEK_FLAG_ANY);
+        next[i] = FFMAX(next[i], 0);
+    }
+
+    while (1) {
+        pick = -1;
+        for (i = 0; i < 2; ++i) {
+            if (streams[i] == NULL || next[i] >= streamIndexCount(streams[i])) {
+                continue;
+            }
+
+            ts[i] = streamIndexEntry(streams[i], next[i])->timestamp * av_q2d(streams[i]->time_base);
+            if (ts[i] <= endTime && (pick < 0 || ts[i] < ts[pick])) {
+                pick = i;
+            }
+        }
+
+        if (pick < 0) {
+            break;
+        }
+
+        ie = streamIndexEntry(streams[pick], next[pick]++);
+        if (!planReadahead(decoder, ranges, &count, maxCount, ie->pos, ie->pos + ie->size, ts[pick])) {
+            break;
+        }
+    }
+    return count;
+}
+
+//Stream mode only. The packet queue cap, catch-up and thresholds follow at once, 0 disables
+//that catch-up step. Probe limits, AVFMT_FLAG_NOBUFFER and low-delay codec flags wait for the
+//next openDecoder.
+ErrorCode setLiveMode(WebDecoder *decoder, int enable, int dropThresholdMs, int jumpThresholdMs) {
+    ErrorCode ret = kErrorCode_Success;
     do {
-        if (decoder == NULL) {
+        if (decoder == NULL || !decoder->isStream) {
+            ret = kErrorCode_Invalid_State;
             break;
         }
 
-        if (decoder->isStream) {
-            ret = decoder->fifo == NULL ? 0 : av_fifo_size(decoder->fifo);
-        } else {
-            ret = decoder->fileWritePos - decoder->fileReadPos;
+        if (dropThresholdMs < 0 || jumpThresholdMs < 0) {
+            ret = kErrorCode_Invalid_Param;
+            break;
         }
+
+        decoder->liveMode               = enable ? 1 : 0;
+        decoder->liveDropThresholdMs    = dropThresholdMs;
+        decoder->liveJumpThresholdMs    = jumpThresholdMs;
+        if (!decoder->liveMode) {
+            decoder->liveJumping = 0;
+        }
+        simpleLog("Live mode %d, drop above %dms, jump above %dms.", decoder->liveMode, dropThresholdMs, jumpThresholdMs);
     } while (0);
     return ret;
 }
 
-//////////////////////////////////Export methods////////////////////////////////////////
-ErrorCode initDecoder(int fileSize, int logLv) {
+//Milliseconds between the newest received and the last demuxed timestamp, -1 if unknown.
+int getLiveLatency(WebDecoder *decoder) {
+    if (decoder == NULL || !decoder->isStream || decoder->flvScanner.newestTs < 0 || decoder->avformatContext == NULL) {
+        return -1;
+    }
+    return (int)FFMAX(decoder->flvScanner.newestTs - (int64_t)(decoder->demuxTime * 1000), 0);
+}
+
+//lowWater/highWater are in the unit the host reports to reportQueueDepth, e.g. buffered ms.
+ErrorCode setQualityLadder(WebDecoder *decoder, int enable, int lowWater, int highWater) {
     ErrorCode ret = kErrorCode_Success;
     do {
-        //Log level.
-        logLevel = logLv;
+        if (decoder == NULL) {
+            ret = kErrorCode_Invalid_State;
+            break;
+        }
 
-        if (decoder != NULL) {
+        if (enable && (lowWater < 0 || highWater <= lowWater)) {
+            ret = kErrorCode_Invalid_Param;
             break;
         }
 
-        decoder = (WebDecoder *)av_mallocz(sizeof(WebDecoder));
-        if (fileSize >= 0) {
-            decoder->fileSize = fileSize;
-            sprintf(decoder->fileName, "tmp-%lu.mp4", getTickCount());
-            decoder->fp = fopen(decoder->fileName, "wb+");
-            if (decoder->fp == NULL) {
-                simpleLog("Open file %s failed, err: %d.", decoder->fileName, errno);
-                ret = kErrorCode_Open_File_Error;
-                av_free(decoder);
-                decoder = NULL;
-            }
-        } else {
-            decoder->isStream = 1;
-            decoder->fifoSize = kDefaultFifoSize;
-            decoder->fifo = av_fifo_alloc(decoder->fifoSize);
+        decoder->qualityAuto        = enable ? 1 : 0;
+        decoder->qualityLowWater    = lowWater;
+        decoder->qualityHighWater   = highWater;
+        if (!decoder->qualityAuto) {
+            applyQualityLevel(decoder, kQualityLevel_Full);
+        }
+        simpleLog("Quality ladder %d, low %d, high %d.", decoder->qualityAuto, lowWater, highWater);
+    } while (0);
+    return ret;
+}
+
+//Decoded but not yet presented frames on the host side, a draining queue means falling behind.
+//Not while decoding waits for input, then the network is behind and lower quality won't help.
+ErrorCode reportQueueDepth(WebDecoder *decoder, int depth) {
+    unsigned long held = 0;
+    if (decoder == NULL) {
+        return kErrorCode_Invalid_State;
+    }
+
+    if (!decoder->qualityAuto) {
+        return kErrorCode_Success;
+    }
+
+    held = getTickCount() - decoder->qualityChangeTick;
+    if (depth < decoder->qualityLowWater &&
+        !decoder->inputStarved &&
+        decoder->qualityLevel < kQualityLevel_KeyframeOnly &&
+        held >= (unsigned long)kQualityDownHoldMs) {
+        applyQualityLevel(decoder, decoder->qualityLevel + 1);
+    } else if (depth >= decoder->qualityHighWater &&
+        decoder->qualityLevel > kQualityLevel_Full &&
+        held >= (unsigned long)kQualityUpHoldMs) {
+        applyQualityLevel(decoder, decoder->qualityLevel - 1);
+    }
+    return kErrorCode_Success;
+}
+
+ErrorCode setQualityLevel(WebDecoder *decoder, int level) {
+    if (decoder == NULL) {
+        return kErrorCode_Invalid_State;
+    }
+
+    if (level < kQualityLevel_Full || level > kQualityLevel_KeyframeOnly) {
+        return kErrorCode_Invalid_Param;
+    }
+
+    applyQualityLevel(decoder, (QualityLevel)level);
+    return kErrorCode_Success;
+}
+
+int getQualityLevel(WebDecoder *decoder) {
+    return decoder == NULL ? -1 : decoder->qualityLevel;
+}
+
+//File mode scrub previews. Takes the first keyframe at or after startMs, then the first one
+//at least intervalMs after the previous preview, until request->count. Every preview is
+//YUV420P of request->width x request->height, back to back in buffer, its timestamp in
+//timestamps. Uses its own demuxer and decoder and reads only cached bytes, so playback and
+//the download position are untouched. Returns previews written, -1 on error.
+//request->missingOffset is the uncached byte that ended the batch, -1 if none.
+int extractThumbnails(WebDecoder *decoder, ThumbnailRequest *request, unsigned char *buffer, double *timestamps) {
+    ThumbnailContext *thumb = NULL;
+    AVFrame *frame          = NULL;
+    int64_t target          = 0;
+    double timestamp        = 0.0;
+    double last             = -1.0;
+    int size                = 0;
+    int count               = 0;
+    int stalls              = 0;
+    ErrorCode ret           = kErrorCode_Success;
+
+    if (decoder == NULL || decoder->avformatContext == NULL || decoder->videoCodecContext == NULL || decoder->isStream) {
+        return -1;
+    }
+
+    if (request == NULL || buffer == NULL || timestamps == NULL) {
+        return -1;
+    }
+
+    if (request->count <= 0 || request->width < 2 || request->height < 2 || (request->width & 1) || (request->height & 1)) {
+        return -1;
+    }
+
+    thumb = &decoder->thumbnail;
+    thumb->missingPos = -1;
+    request->missingOffset = -1;
+    ret = openThumbnailContext(decoder);
+    if (ret != kErrorCode_Success) {
+        request->missingOffset = (int)thumb->missingPos;
+        return -1;
+    }
+
+    size    = request->width * request->height * 3 / 2;
+    target  = (int64_t)request->startMs * 1000;
+    frame   = thumb->frame;
+    while (count < request->count && stalls < kThumbnailMaxStalls) {
+        if (avformat_seek_file(thumb->formatContext, -1, target, target, INT64_MAX, 0) < 0 ||
+            readThumbnail(thumb) != 0) {
+            break;
         }
-    } while (0);
-    simpleLog("Decoder initialized %d.", ret);
-    return ret;
-}
 
-ErrorCode uninitDecoder() {
-    if (decoder != NULL) {
-        if (decoder->fp != NULL) {
-            fclose(decoder->fp);
-            decoder->fp = NULL;
-            remove(decoder->fileName);
+        timestamp = (double)frame->pts * av_q2d(thumb->timeBase);
+        if (timestamp <= last || !isSupportedPixelFormat(frame->format)) {
+            // Seek fell back onto a keyframe already taken, look further ahead.
+            target += (int64_t)FFMAX(request->intervalMs, 1) * 1000;
+            ++stalls;
+            av_frame_unref(frame);
+            continue;
         }
 
-        if (decoder->fifo != NULL) {
-             av_fifo_freep(&decoder->fifo);
+        av_fast_malloc(&thumb->scratch, &thumb->scratchSize,
+            outputScratchSize(frame->width, frame->height, request->width, request->height));
+        if (convertYuvData(frame, buffer + count * size, frame->width, frame->height,
+            request->width, request->height, kOutputFormat_YUV420P, thumb->scratch) != kErrorCode_Success) {
+            av_frame_unref(frame);
+            break;
         }
+        av_frame_unref(frame);
 
-        av_freep(&decoder);
+        timestamps[count++] = timestamp;
+        last    = timestamp;
+        target  = (int64_t)(timestamp * AV_TIME_BASE) + (int64_t)FFMAX(request->intervalMs, 1) * 1000;
+        stalls  = 0;
     }
 
-    av_log_set_callback(NULL);
-
-    simpleLog("Decoder uninitialized.");
-    return kErrorCode_Success;
+    request->missingOffset = (int)thumb->missingPos;
+    simpleLog("Extracted %d thumbnails from %dms, stopped at %lld.", count, request->startMs, thumb->missingPos);
+    return count;
 }
 
-ErrorCode openDecoder(int *paramArray, int paramCount, long videoCallback, long audioCallback, long requestCallback) {
-    ErrorCode ret = kErrorCode_Success;
-    int r = 0;
-    int i = 0;
-    int params[7] = { 0 };
+//Per track switch by StreamType, before openDecoder or while playing. A disabled track is
+//discarded by the demuxer, its decoder is not opened (at open) or left idle (at runtime).
+//Enabling flushes the decoder, video restarts at the next keyframe.
+ErrorCode setTrackEnabled(WebDecoder *decoder, int type, int enable) {
+    ErrorCode ret   = kErrorCode_Success;
+    int streamIdx   = -1;
     do {
-        simpleLog("Opening decoder.");
-
-        av_register_all();
-        avcodec_register_all();
-
-        if (logLevel == kLogLevel_All) {
-            av_log_set_callback(ffmpegLogCallback);
+        if (decoder == NULL) {
+            ret = kErrorCode_Invalid_State;
+            break;
         }
-        
-        decoder->avformatContext = avformat_alloc_context();
-        decoder->customIoBuffer = (unsigned char*)av_mallocz(kCustomIoBufferSize);
 
-        AVIOContext* ioContext = avio_alloc_context(
-            decoder->customIoBuffer,
-            kCustomIoBufferSize,
-            0,
-            NULL,
-            readCallback,
-            NULL,
-            seekCallback);
-        if (ioContext == NULL) {
-            ret = kErrorCode_FFmpeg_Error;
-            simpleLog("avio_alloc_context failed.");
+        if (type != kStreamType_Video && type != kStreamType_Audio) {
+            ret = kErrorCode_Invalid_Param;
             break;
         }
 
-        decoder->avformatContext->pb = ioContext;
-        decoder->avformatContext->flags = AVFMT_FLAG_CUSTOM_IO;
-
-        r = avformat_open_input(&decoder->avformatContext, NULL, NULL, NULL);
-        if (r != 0) {
-            ret = kErrorCode_FFmpeg_Error;
-            char err_info[32] = { 0 };
-            av_strerror(ret, err_info, 32);
-            simpleLog("avformat_open_input failed %d %s.", ret, err_info);
+        enable = enable ? 1 : 0;
+        if (decoder->trackEnabled[type] == enable) {
             break;
         }
-        
-        simpleLog("avformat_open_input success.");
+        decoder->trackEnabled[type] = enable;
+        simpleLog("Track %d %s.", type, enable ? "enabled" : "disabled");
 
-        r = avformat_find_stream_info(decoder->avformatContext, NULL);
-        if (r != 0) {
-            ret = kErrorCode_FFmpeg_Error;
-            simpleLog("av_find_stream_info failed %d.", ret);
+        streamIdx = type == kStreamType_Video ? decoder->videoStreamIdx : decoder->audioStreamIdx;
+        if (decoder->avformatContext == NULL || streamIdx < 0) {
             break;
         }
 
-        simpleLog("avformat_find_stream_info success.");
-
-        for (i = 0; i < decoder->avformatContext->nb_streams; i++) {
-            decoder->avformatContext->streams[i]->discard = AVDISCARD_DEFAULT;
+        if (!enable) {
+            decoder->avformatContext->streams[streamIdx]->discard = AVDISCARD_ALL;
+            packetQueueFlush(decoder, &decoder->packetQueues[type]);
+            break;
         }
 
-        r = openCodecContext(
-            decoder->avformatContext,
-            AVMEDIA_TYPE_VIDEO,
-            &decoder->videoStreamIdx,
-            &decoder->videoCodecContext);
-        if (r != 0) {
-            ret = kErrorCode_FFmpeg_Error;
-            simpleLog("Open video codec context failed %d.", ret);
+        ret = openTrack(decoder, (StreamType)type);
+        if (ret != kErrorCode_Success) {
+            decoder->trackEnabled[type] = 0;
             break;
         }
 
-        simpleLog("Open video codec context success, video stream index %d %x.",
-            decoder->videoStreamIdx, (unsigned int)decoder->videoCodecContext);
-
-        simpleLog("Video stream index:%d pix_fmt:%d resolution:%d*%d.",
-            decoder->videoStreamIdx,
-            decoder->videoCodecContext->pix_fmt,
-            decoder->videoCodecContext->width,
-            decoder->videoCodecContext->height);
+        if (type == kStreamType_Video) {
+            avcodec_flush_buffers(decoder->videoCodecContext);
+            decoder->drainState[kStreamType_Video] = 0;
+            decoder->videoWaitKey = 1;
+        } else {
+            avcodec_flush_buffers(decoder->audioCodecContext);
+            decoder->drainState[kStreamType_Audio] = 0;
+            resetAudioOutput(decoder);
+        }
+    } while (0);
+    return ret;
+}
 
-        r = openCodecContext(
-            decoder->avformatContext,
-            AVMEDIA_TYPE_AUDIO,
-            &decoder->audioStreamIdx,
-            &decoder->audioCodecContext);
-        if (r != 0) {
-            ret = kErrorCode_FFmpeg_Error;
-            simpleLog("Open audio codec context failed %d.", ret);
+//Copy mode only, frames are downscaled to fit width x height, never upscaled. Takes effect
+//with the next frame, 0 x 0 restores the coded size. Lent frames keep the coded size.
+ErrorCode setOutputSize(WebDecoder *decoder, int width, int height) {
+    ErrorCode ret = kErrorCode_Success;
+    do {
+        if (decoder == NULL) {
+            ret = kErrorCode_Invalid_State;
             break;
         }
 
-        simpleLog("Open audio codec context success, audio stream index %d %x.",
-            decoder->audioStreamIdx, (unsigned int)decoder->audioCodecContext);
-
-        simpleLog("Audio stream index:%d sample_fmt:%d channel:%d, sample rate:%d.",
-            decoder->audioStreamIdx,
-            decoder->audioCodecContext->sample_fmt,
-            decoder->audioCodecContext->channels,
-            decoder->audioCodecContext->sample_rate);
-
-        av_seek_frame(decoder->avformatContext, -1, 0, AVSEEK_FLAG_BACKWARD);
-
-        /* For RGB Renderer(2D WebGL).
-        decoder->swsCtx = sws_getContext(
-            decoder->videoCodecContext->width,
-            decoder->videoCodecContext->height,
-            decoder->videoCodecContext->pix_fmt, 
-            decoder->videoCodecContext->width,
-            decoder->videoCodecContext->height,
-            AV_PIX_FMT_RGB32,
-            SWS_BILINEAR, 
-            0, 
-            0, 
-            0);
-        if (decoder->swsCtx == NULL) {
-            simpleLog("sws_getContext failed.");
-            ret = kErrorCode_FFmpeg_Error;
+        if (width < 0 || height < 0 || (width == 0) != (height == 0)) {
+            ret = kErrorCode_Invalid_Param;
             break;
         }
-        */
-        
-        decoder->videoSize = avpicture_get_size(
-            decoder->videoCodecContext->pix_fmt,
-            decoder->videoCodecContext->width,
-            decoder->videoCodecContext->height);
 
-        decoder->videoBufferSize = 3 * decoder->videoSize;
-        decoder->yuvBuffer = (unsigned char *)av_mallocz(decoder->videoBufferSize);
-        decoder->avFrame = av_frame_alloc();
-        
-        params[0] = 1000 * (decoder->avformatContext->duration + 5000) / AV_TIME_BASE;
-        params[1] = decoder->videoCodecContext->pix_fmt;
-        params[2] = decoder->videoCodecContext->width;
-        params[3] = decoder->videoCodecContext->height;
-        params[4] = decoder->audioCodecContext->sample_fmt;
-        params[5] = decoder->audioCodecContext->channels;
-        params[6] = decoder->audioCodecContext->sample_rate;
+        decoder->outputWidth    = width;
+        decoder->outputHeight   = height;
+        simpleLog("Output size set to %dx%d.", width, height);
+    } while (0);
+    return ret;
+}
 
-        enum AVSampleFormat sampleFmt = decoder->audioCodecContext->sample_fmt;
-        if (av_sample_fmt_is_planar(sampleFmt)) {
-            const char *packed = av_get_sample_fmt_name(sampleFmt);
-            params[4] = av_get_packed_sample_fmt(sampleFmt);
+//Copy mode only, the layout of the pictures handed to videoCallback, any OutputFormat.
+ErrorCode setOutputFormat(WebDecoder *decoder, int format) {
+    ErrorCode ret = kErrorCode_Success;
+    do {
+        if (decoder == NULL) {
+            ret = kErrorCode_Invalid_State;
+            break;
         }
 
-        if (paramArray != NULL && paramCount > 0) {
-            for (int i = 0; i < paramCount; ++i) {
-                paramArray[i] = params[i];
-            }
+        if (format != kOutputFormat_YUV420P && format != kOutputFormat_NV12) {
+            ret = kErrorCode_Invalid_Param;
+            break;
         }
 
-        decoder->videoCallback = (VideoCallback)videoCallback;
-        decoder->audioCallback = (AudioCallback)audioCallback;
-        decoder->requestCallback = (RequestCallback)requestCallback;
-
-        simpleLog("Decoder opened, duration %ds, picture size %d.", params[0], decoder->videoSize);
+        decoder->outputFormat = (OutputFormat)format;
+        simpleLog("Output format set to %d.", format);
     } while (0);
+    return ret;
+}
 
-    if (ret != kErrorCode_Success && decoder != NULL) {
-        av_freep(&decoder);
+//Size of the pictures videoCallback gets from now on, needs an open decoder.
+ErrorCode getOutputSize(WebDecoder *decoder, int *width, int *height) {
+    if (decoder == NULL || decoder->videoCodecContext == NULL) {
+        return kErrorCode_Invalid_State;
     }
-    return ret;
+
+    if (width == NULL || height == NULL) {
+        return kErrorCode_NULL_Pointer;
+    }
+
+    getEffectiveOutputSize(decoder, width, height);
+    return kErrorCode_Success;
 }
 
-ErrorCode closeDecoder() {
-    ErrorCode ret = kErrorCode_Success;
+//Caps the decoder's own heap: output buffers, the stream ring or file cache and the picture
+//pool. Meant to be set before openDecoder, which then fails with kErrorCode_Memory_Budget if
+//the minimum doesn't fit. On an open decoder the split is redone, idle pictures above the new
+//limit are freed. 0 removes the cap. FFmpeg's own tables and packets are not counted.
+ErrorCode setMemoryBudget(WebDecoder *decoder, int bytes) {
+    ErrorCode ret       = kErrorCode_Success;
+    int64_t previous    = 0;
     do {
-        if (decoder == NULL || decoder->avformatContext == NULL) {
+        if (decoder == NULL) {
+            ret = kErrorCode_Invalid_State;
             break;
         }
 
-        if (decoder->videoCodecContext != NULL) {
-            closeCodecContext(decoder->avformatContext, decoder->videoCodecContext, decoder->videoStreamIdx);
-            decoder->videoCodecContext = NULL;
-            simpleLog("Video codec context closed.");
+        if (bytes < 0) {
+            ret = kErrorCode_Invalid_Param;
+            break;
         }
 
-        if (decoder->audioCodecContext != NULL) {
-            closeCodecContext(decoder->avformatContext, decoder->audioCodecContext, decoder->audioStreamIdx);
-            decoder->audioCodecContext = NULL;
-            simpleLog("Audio codec context closed.");
+        previous = decoder->memoryBudget;
+        decoder->memoryBudget = bytes;
+        ret = applyMemoryBudget(decoder);
+        if (ret != kErrorCode_Success) {
+            decoder->memoryBudget = previous;
+            applyMemoryBudget(decoder);
+            break;
         }
+        simpleLog("Memory budget set to %d bytes.", bytes);
+    } while (0);
+    return ret;
+}
 
-        AVIOContext *pb = decoder->avformatContext->pb;
-        if (pb != NULL) {
-            if (pb->buffer != NULL) {
-                av_freep(&pb->buffer);
-                decoder->customIoBuffer = NULL;
-            }
-            av_freep(&decoder->avformatContext->pb);
-            simpleLog("IO context released.");
+ErrorCode getMemoryStats(WebDecoder *decoder, MemoryStats *stats) {
+    ErrorCode ret = kErrorCode_Success;
+    do {
+        if (decoder == NULL) {
+            ret = kErrorCode_Invalid_State;
+            break;
         }
 
-        avformat_close_input(&decoder->avformatContext);
-        decoder->avformatContext = NULL;
-        simpleLog("Input closed.");
-
-        if (decoder->yuvBuffer != NULL) {
-            av_freep(&decoder->yuvBuffer);
+        if (stats == NULL) {
+            ret = kErrorCode_Invalid_Param;
+            break;
         }
 
-        if (decoder->pcmBuffer != NULL) {
-            av_freep(&decoder->pcmBuffer);
-        }
-        
-        if (decoder->avFrame != NULL) {
-            av_freep(&decoder->avFrame);
-        }
-        simpleLog("All buffer released.");
+        updateMemoryPeak(decoder);
+        stats->budget       = (double)decoder->memoryBudget;
+        stats->current      = (double)memoryInUse(decoder);
+        stats->peak         = (double)__atomic_load_n(&decoder->memoryPeak, __ATOMIC_RELAXED);
+        stats->pictureBytes = (double)__atomic_load_n(&decoder->pictureBytes, __ATOMIC_RELAXED);
+        stats->pictures     = __atomic_load_n(&decoder->pictureCount, __ATOMIC_RELAXED);
+        stats->pictureLimit = decoder->pictureLimit;
+        stats->pictureSize  = decoder->pictureSize;
+        stats->outputBytes  = (double)outputMemory(decoder);
+        stats->inputBytes   = (double)inputMemory(decoder);
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+        stats->heapBytes    = (double)mallinfo2().uordblks;
+#elif defined(__EMSCRIPTEN__) || defined(__GLIBC__)
+        stats->heapBytes    = (double)mallinfo().uordblks;
+#else
+        stats->heapBytes    = -1;
+#endif
     } while (0);
     return ret;
 }
 
-int sendData(unsigned char *buff, int size) {
-    int ret = 0;
-    int64_t leftBytes = 0;
-    int canWriteBytes = 0;
+//Per track demux run-ahead, the demuxer pauses once either active queue holds maxBytes or
+//maxDurationMs of packets. Live mode caps the duration lower. 0 lifts a limit.
+ErrorCode setPacketQueueLimits(WebDecoder *decoder, int type, int maxBytes, int maxDurationMs) {
+    ErrorCode ret       = kErrorCode_Success;
+    PacketQueue *queue  = NULL;
+    PacketQueue saved;
     do {
         if (decoder == NULL) {
-            ret = -1;
+            ret = kErrorCode_Invalid_State;
             break;
         }
 
-        if (buff == NULL || size == 0) {
-            ret = -2;
+        if ((type != kStreamType_Video && type != kStreamType_Audio) || maxBytes < 0 || maxDurationMs < 0) {
+            ret = kErrorCode_Invalid_Param;
             break;
         }
 
-        ret = decoder->isStream ? writeToFifo(buff, size) : writeToFile(buff, size);
+        queue = &decoder->packetQueues[type];
+        saved = *queue;
+        queue->maxBytes      = maxBytes;
+        queue->maxDurationMs = maxDurationMs;
+        ret = applyMemoryBudget(decoder);
+        if (ret != kErrorCode_Success) {
+            queue->maxBytes      = saved.maxBytes;
+            queue->maxDurationMs = saved.maxDurationMs;
+            applyMemoryBudget(decoder);
+            break;
+        }
+        simpleLog("Track %d packet queue limited to %d bytes, %dms.", type, maxBytes, maxDurationMs);
     } while (0);
     return ret;
 }
 
-ErrorCode decodeOnePacket() {
-    ErrorCode ret	= kErrorCode_Success;
-    int decodedLen	= 0;
-    int r			= 0;
+//Demux stage on its own schedule, e.g. as soon as data arrives, while decodePackets drains
+//the queues on the decode schedule. Returns packets read, -1 if not open.
+int demuxPackets(WebDecoder *decoder, int maxPackets) {
+    int count = 0;
+    if (decoder == NULL || decoder->avformatContext == NULL) {
+        return -1;
+    }
 
-    AVPacket packet;
-    av_init_packet(&packet);
+    while ((maxPackets <= 0 || count < maxPackets) && !packetQueuesFull(decoder)) {
+        if (demuxPacket(decoder) != kErrorCode_Success) {
+            break;
+        }
+        ++count;
+    }
+    return count;
+}
+
+//Video frames wait in a ring of slots (2 to 16) for getFrameForTime instead of going to
+//videoCallback, in either output mode. Set before openDecoder, 0 turns it off.
+ErrorCode setPresentQueue(WebDecoder *decoder, int slots) {
+    ErrorCode ret = kErrorCode_Success;
     do {
-        if (decoder == NULL) {
+        if (decoder == NULL || decoder->avformatContext != NULL) {
             ret = kErrorCode_Invalid_State;
             break;
         }
 
-        if (getAailableDataSize() <= 0) {
-            ret = kErrorCode_Invalid_State;
+        if (slots != 0 && (slots < 2 || slots > kMaxPresentSlots)) {
+            ret = kErrorCode_Invalid_Param;
             break;
         }
 
-        packet.data = NULL;
-        packet.size = 0;
+        decoder->present.slots = slots;
+        simpleLog("Presentation queue of %d slots.", slots);
+    } while (0);
+    return ret;
+}
 
-        r = av_read_frame(decoder->avformatContext, &packet);
-        if (r == AVERROR_EOF) {
-            ret = kErrorCode_Eof;
+//Master clock for getFrameForTime, the audio output plays mediaTime (seconds) now and moves
+//on at rate, 0 while paused. One writer, it need not be the decoding or presenting thread.
+ErrorCode setAudioClock(WebDecoder *decoder, double mediaTime, double rate) {
+    ErrorCode ret       = kErrorCode_Success;
+    PresentQueue *q     = NULL;
+    unsigned int seq    = 0;
+    double timeUs       = getTimeUs();
+    do {
+        if (decoder == NULL) {
+            ret = kErrorCode_Invalid_State;
             break;
         }
 
-        if (r < 0 || packet.size == 0) {
+        if (rate < 0.0) {
+            ret = kErrorCode_Invalid_Param;
             break;
         }
 
-        do {
-            ret = decodePacket(&packet, &decodedLen);
-            if (ret != kErrorCode_Success) {
-                break;
-            }
-
-            if (decodedLen <= 0) {
-                break;
-            }
-
-            packet.data += decodedLen;
-            packet.size -= decodedLen;
-        } while (packet.size > 0);
+        q = &decoder->present;
+        seq = __atomic_load_n(&q->clockSeq, __ATOMIC_RELAXED);
+        __atomic_store_n(&q->clockSeq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store(&q->clockMedia, &mediaTime, __ATOMIC_RELAXED);
+        __atomic_store(&q->clockTimeUs, &timeUs, __ATOMIC_RELAXED);
+        __atomic_store(&q->clockRate, &rate, __ATOMIC_RELAXED);
+        __atomic_store_n(&q->clockSeq, seq + 2, __ATOMIC_RELEASE);
     } while (0);
-    av_packet_unref(&packet);
     return ret;
 }
 
-ErrorCode seekTo(int ms, int accurateSeek) {
-    int ret = 0;
-    int64_t pts = (int64_t)ms * 1000;
-    decoder->accurateSeek = accurateSeek;
-    ret = avformat_seek_file(decoder->avformatContext,
-                                 -1,
-                                 INT64_MIN,
-                                 pts,
-                                 pts,
-                                 AVSEEK_FLAG_BACKWARD);
-    simpleLog("Native seek to %d return %d %d.", ms, ret, decoder->accurateSeek);
-    if (ret == -1) {
-        return kErrorCode_FFmpeg_Error;
-    } else {
-        avcodec_flush_buffers(decoder->videoCodecContext);
-        avcodec_flush_buffers(decoder->audioCodecContext);
+//Consumer side, one call per display refresh, time < 0 reads the audio clock. Frames a newer
+//due frame made late are dropped unseen. Returns 1 with view filled when the picture to show
+//changed, 0 to keep the current one, -1 without a presentation queue. view stays valid until
+//the next call, its index is -1 as there is nothing to release.
+int getFrameForTime(WebDecoder *decoder, double time, FrameView *view) {
+    PresentQueue *q         = NULL;
+    AVFrame *frame          = NULL;
+    unsigned int head       = 0;
+    unsigned int tail       = 0;
+    unsigned int flushTail  = 0;
+    int i                   = 0;
+    if (decoder == NULL || view == NULL || decoder->avformatContext == NULL || decoder->present.slots <= 0) {
+        return -1;
+    }
 
-        // Trigger seek callback
-        AVPacket packet;
-        av_init_packet(&packet);
-        av_read_frame(decoder->avformatContext, &packet);
+    q = &decoder->present;
+    if (time < 0.0) {
+        time = presentationClock(q);
+    }
 
-        decoder->beginTimeOffset = (double)ms / 1000;
-        return kErrorCode_Success;
+    head = q->head;
+    flushTail = __atomic_load_n(&q->flushTail, __ATOMIC_ACQUIRE);
+    if ((int)(flushTail - head) > 0) {
+        for (; head != flushTail; ++head) {
+            av_frame_unref(q->frames[head % q->slots]);
+        }
+        q->shown    = 0;
+        q->primed   = 0;
     }
+
+    tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    while (time >= 0.0 && tail - head > 1 && q->timestamps[(head + 1) % q->slots] <= time) {
+        if (!q->shown) {
+            ++decoder->stats.lateFrames;
+        }
+        av_frame_unref(q->frames[head % q->slots]);
+        ++head;
+        q->shown = 0;
+    }
+    __atomic_store_n(&q->head, head, __ATOMIC_RELEASE);
+
+    // After open or a seek the first frame goes up before its time, as the still picture.
+    if (head == tail || q->shown || (q->primed && !(q->timestamps[head % q->slots] <= time))) {
+        return 0;
+    }
+
+    frame = q->frames[head % q->slots];
+    for (i = 0; i < 3; ++i) {
+        view->data[i]       = frame->data[i];
+        view->linesize[i]   = frame->linesize[i];
+    }
+    view->width     = frame->width;
+    view->height    = frame->height;
+    view->format    = frame->format;
+    view->index     = -1;
+    view->timestamp = q->timestamps[head % q->slots];
+    q->shown    = 1;
+    q->primed   = 1;
+    ++decoder->stats.presentedFrames;
+    return 1;
 }
 
+#ifdef __EMSCRIPTEN__
 int main() {
     //simpleLog("Native loaded.");
     return 0;
 }
+#endif
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,255 @@
+#ifndef WEB_DECODER_H
+#define WEB_DECODER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void(*VideoCallback)(unsigned char *buff, int size, double timestamp);
+typedef void(*AudioCallback)(unsigned char *buff, int size, double timestamp);
+typedef void(*RequestCallback)(int offset, int available);
+
+typedef enum ErrorCode {
+    kErrorCode_Success = 0,
+    kErrorCode_Invalid_Param,
+    kErrorCode_Invalid_State,
+    kErrorCode_Invalid_Data,
+    kErrorCode_Invalid_Format,
+    kErrorCode_NULL_Pointer,
+    kErrorCode_Open_File_Error,
+    kErrorCode_Eof,
+    kErrorCode_FFmpeg_Error,
+    kErrorCode_Old_Frame,
+    kErrorCode_Frame_Pool_Full,
+    kErrorCode_Memory_Budget
+} ErrorCode;
+
+typedef enum LogLevel {
+    kLogLevel_None, //Not logging.
+    kLogLevel_Core, //Only logging core module(without ffmpeg).
+    kLogLevel_All   //Logging all, with ffmpeg.
+} LogLevel;
+
+typedef enum OutputMode {
+    kOutputMode_Copy,   //Copy into yuvBuffer as OutputFormat, callback with (buffer, size, timestamp).
+    kOutputMode_Frame   //Lend a pooled frame, callback with (FrameView*, sizeof(FrameView), timestamp), native hosts only.
+} OutputMode;
+
+//Copy mode picture layout, always 8-bit limited range. 10-bit and full range (yuvj420p)
+//sources are converted in the output copy.
+typedef enum OutputFormat {
+    kOutputFormat_YUV420P,  //Y plane, U plane, V plane.
+    kOutputFormat_NV12      //Y plane, interleaved UV plane.
+} OutputFormat;
+
+typedef enum AudioLayout {
+    kAudioLayout_Interleaved,   //L R L R ...
+    kAudioLayout_Planar         //L L ... R R ...
+} AudioLayout;
+
+typedef enum StreamType {
+    kStreamType_Video = 0,
+    kStreamType_Audio
+} StreamType;
+
+//Known codec parameters for fast open, zero fields are unknown. Once every stream the
+//demuxer created has a hint, openDecoder skips avformat_find_stream_info.
+typedef struct StreamHint {
+    int codecId;                // AVCodecID.
+    int width;
+    int height;
+    int sampleRate;
+    int channels;
+    unsigned char *extradata;   // Copied, the caller keeps ownership.
+    int extradataSize;
+} StreamHint;
+
+typedef enum QualityLevel {
+    kQualityLevel_Full = 0,
+    kQualityLevel_SkipLoopFilter,   //No deblocking, pictures stay decodable.
+    kQualityLevel_SkipNonRef,       //Plus discard non-reference pictures.
+    kQualityLevel_KeyframeOnly      //Plus discard everything but keyframes.
+} QualityLevel;
+
+typedef enum DecodeStopReason {
+    kDecodeStop_FrameLimit, //maxFrames reached.
+    kDecodeStop_TimeBudget, //timeBudgetMs used up.
+    kDecodeStop_Starved,    //No more input data buffered.
+    kDecodeStop_Eof,        //End of file, decoders drained.
+    kDecodeStop_PoolFull,   //All pooled frames are borrowed.
+    kDecodeStop_Error       //Demux or decode error, see lastError.
+} DecodeStopReason;
+
+//Filled by decodePackets, all int32 so the host can read it as an Int32Array.
+typedef struct DecodeStatus {
+    int framesOut;
+    int videoFrames;
+    int audioFrames;
+    int packets;
+    int bytesConsumed;
+    int elapsedMs;
+    int stopReason;
+    int lastError;
+} DecodeStatus;
+
+//Borrowed picture, valid until releaseFrame(index) is called.
+typedef struct FrameView {
+    unsigned char *data[3];
+    int linesize[3];
+    int width;
+    int height;
+    int format;
+    int index;
+    double timestamp;
+} FrameView;
+
+enum {
+    kStatsBucketCount = 16
+};
+
+typedef enum StatsStage {
+    kStatsStage_Demux = 0,      // av_read_frame.
+    kStatsStage_Decode,         // avcodec_send_packet and avcodec_receive_frame.
+    kStatsStage_VideoOutput,    // Picture copy, conversion and scaling, or frame lending.
+    kStatsStage_AudioOutput,    // Sample conversion and interleaving.
+    kStatsStage_VideoCallback,
+    kStatsStage_AudioCallback,
+    kStatsStage_Count
+} StatsStage;
+
+//Bucket i counts samples below (64us << i), the last bucket is open ended.
+typedef struct StageStats {
+    double count;
+    double totalUs;
+    double maxUs;
+    double buckets[kStatsBucketCount];
+} StageStats;
+
+//All double so the host can read it as a Float64Array.
+typedef struct DecoderStats {
+    StageStats stages[kStatsStage_Count];
+    double bytesIn;
+    double bytesRejected;
+    double videoBytesOut;
+    double audioBytesOut;
+    double packets;
+    double videoFrames;
+    double audioFrames;
+    double oldFrames;
+    double droppedFrames;
+    double bufferedBytes;
+    double ringPeak;
+    double ringCapacity;
+    double cacheBytes;
+    double cacheLimit;
+    double seekCount;
+    double lastSeekMs;
+    double totalSeekMs;
+    double openMs;
+    double openBytes;           // Read by the demuxer before openDecoder returned.
+    double firstFrameMs;        // From openDecoder to the first video frame, -1 until then.
+    double liveLatencyMs;       // Newest received minus demuxed timestamp, -1 if unknown.
+    double liveJumps;           // Catch-ups that skipped to a keyframe.
+    double qualityLevel;        // Active QualityLevel.
+    double qualitySteps;        // Ladder changes, automatic or set.
+    double videoQueueBytes;     // Demuxed, not yet decoded.
+    double audioQueueBytes;
+    double videoQueueMs;
+    double audioQueueMs;
+    double presentedFrames;     // Handed out by getFrameForTime.
+    double lateFrames;          // Never shown, a newer frame was already due.
+    double presentQueueFrames;  // Decoded, waiting in the presentation queue.
+} DecoderStats;
+
+//One video keyframe, all double so the host can read it as a Float64Array.
+typedef struct KeyframeEntry {
+    double timestamp;           // Seconds, the keyframe's dts in the stream time base.
+    double offset;              // First byte needed from here on, interleaved audio included.
+    double size;                // Bytes up to the next keyframe's offset, to the file end for the last one.
+    double frames;              // GOP length in video samples.
+} KeyframeEntry;
+
+//Bytes the demuxer will read next, all double so the host can read it as a Float64Array.
+typedef struct ReadaheadRange {
+    double offset;
+    double size;
+    double deadline;            // dts in seconds of the first packet needing this range.
+} ReadaheadRange;
+
+//Scrub preview batch for extractThumbnails, all int32 so the host can fill it as an Int32Array.
+typedef struct ThumbnailRequest {
+    int startMs;
+    int intervalMs;             // Minimum spacing between previews.
+    int count;                  // Previews wanted, buffer takes count * width * height * 3 / 2 bytes.
+    int width;                  // Even, previews are YUV420P stretched to width x height.
+    int height;
+    int missingOffset;          // Out, the uncached byte the batch stopped at, -1 if none.
+} ThumbnailRequest;
+
+//Decoder heap use in bytes, all double so the host can read it as a Float64Array.
+typedef struct MemoryStats {
+    double budget;              // 0 is unlimited.
+    double current;             // Pictures plus output plus input.
+    double peak;
+    double pictureBytes;        // Pooled pictures, held by the codec, the host or idle in the pool.
+    double pictures;
+    double pictureLimit;        // Pool cap derived from the budget, 0 is unlimited.
+    double pictureSize;         // Bytes per pooled picture, padding included.
+    double outputBytes;         // yuvBuffer, pcmBuffer and conversion scratch.
+    double inputBytes;          // Stream ring or cached file extents.
+    double heapBytes;           // malloc in use by the whole module, -1 if unknown.
+} MemoryStats;
+
+typedef struct WebDecoder WebDecoder;
+
+//////////////////////////////////Export methods////////////////////////////////////////
+WebDecoder *initDecoder(int fileSize, int logLv);
+ErrorCode uninitDecoder(WebDecoder *decoder);
+ErrorCode openDecoder(WebDecoder *decoder, int *paramArray, int paramCount, long videoCallback, long audioCallback, long requestCallback, int threadCount);
+ErrorCode closeDecoder(WebDecoder *decoder);
+int sendData(WebDecoder *decoder, unsigned char *buff, int size);
+int sendDataAt(WebDecoder *decoder, int offset, unsigned char *buff, int size);
+int getWriteSpan(WebDecoder *decoder, int offset, unsigned char **span);
+int commitWrite(WebDecoder *decoder, int size);
+ErrorCode decodeOnePacket(WebDecoder *decoder);
+ErrorCode decodePackets(WebDecoder *decoder, int maxFrames, int timeBudgetMs, DecodeStatus *status);
+ErrorCode seekTo(WebDecoder *decoder, int ms, int accurateSeek);
+ErrorCode setOutputMode(WebDecoder *decoder, int mode);
+ErrorCode setAudioLayout(WebDecoder *decoder, int layout);
+ErrorCode setAudioOutput(WebDecoder *decoder, int sampleRate, int channels, int blockMs);
+int getLastSeekDuration(WebDecoder *decoder);
+ErrorCode setCacheLimit(WebDecoder *decoder, int limit);
+ErrorCode releaseFrame(WebDecoder *decoder, int index);
+ErrorCode getStats(WebDecoder *decoder, DecoderStats *stats);
+ErrorCode resetStats(WebDecoder *decoder);
+ErrorCode setProbeLimits(WebDecoder *decoder, int probeSize, int analyzeDurationMs);
+ErrorCode setStreamHint(WebDecoder *decoder, int type, const StreamHint *hint);
+int getTimeToFirstFrame(WebDecoder *decoder);
+int getKeyframeIndex(WebDecoder *decoder, KeyframeEntry *entries, int maxCount);
+int getReadaheadPlan(WebDecoder *decoder, ReadaheadRange *ranges, int maxCount, int horizonMs);
+ErrorCode setLiveMode(WebDecoder *decoder, int enable, int dropThresholdMs, int jumpThresholdMs);
+int getLiveLatency(WebDecoder *decoder);
+ErrorCode setQualityLadder(WebDecoder *decoder, int enable, int lowWater, int highWater);
+ErrorCode reportQueueDepth(WebDecoder *decoder, int depth);
+ErrorCode setQualityLevel(WebDecoder *decoder, int level);
+int getQualityLevel(WebDecoder *decoder);
+int extractThumbnails(WebDecoder *decoder, ThumbnailRequest *request, unsigned char *buffer, double *timestamps);
+ErrorCode setTrackEnabled(WebDecoder *decoder, int type, int enable);
+ErrorCode setOutputSize(WebDecoder *decoder, int width, int height);
+ErrorCode setOutputFormat(WebDecoder *decoder, int format);
+ErrorCode getOutputSize(WebDecoder *decoder, int *width, int *height);
+ErrorCode setMemoryBudget(WebDecoder *decoder, int bytes);
+ErrorCode setPacketQueueLimits(WebDecoder *decoder, int type, int maxBytes, int maxDurationMs);
+int demuxPackets(WebDecoder *decoder, int maxPackets);
+ErrorCode getMemoryStats(WebDecoder *decoder, MemoryStats *stats);
+ErrorCode setPresentQueue(WebDecoder *decoder, int slots);
+ErrorCode setAudioClock(WebDecoder *decoder, double mediaTime, double rate);
+int getFrameForTime(WebDecoder *decoder, double time, FrameView *view);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //WEB_DECODER_H
@@ -10,21 +10,47 @@ self.importScripts("libffmpeg.js");
 function Decoder() {
     this.logger             = new Logger("Decoder");
     this.coreLogLevel       = 1;
+    this.threadCount        = 0;  // 0 for auto, only effective in threads build.
     this.accurateSeek       = true;
     this.wasmLoaded         = false;
+    this.handle             = 0;
     this.tmpReqQue          = [];
-    this.cacheBuffer        = null;
+    this.spanSlot           = null;     // Out pointer for getWriteSpan.
+    this.isStream           = false;
+    this.pendingData        = [];     // Stream data not yet accepted by the native ring.
+    this.bufferFull         = false;
     this.decodeTimer        = null;
+    this.decodeStatus       = null;
+    this.statsBuffer        = null;
+    this.memoryStatsBuffer  = null;
+    this.logBuffer          = null;
+    this.readaheadBuffer    = null;
+    this.readaheadTime      = 0;
+    this.readaheadFirst     = -1;     // First offset of the last published plan.
+    this.logTimer           = null;
+    this.logDecoder         = new TextDecoder("utf-8");
+    this.requestedWidth     = 0;     // Downscale target, 0 keeps the coded size.
+    this.requestedHeight    = 0;
+    this.outputWidth        = 0;     // Size of the frames posted from now on.
+    this.outputHeight       = 0;
+    this.outputFormat       = kOutputFormatYUV420P;
+    this.batchFrames        = 8;   // Frames per decode tick.
+    this.batchBudgetMs      = 4;   // Time per decode tick, keep below the timer interval.
     this.videoCallback      = null;
     this.audioCallback      = null;
     this.requestCallback    = null;
 }
 
 Decoder.prototype.initDecoder = function (fileSize, chunkSize) {
-    var ret = Module._initDecoder(fileSize, this.coreLogLevel);
-    this.logger.logInfo("initDecoder return " + ret + ".");
+    this.handle = Module._initDecoder(fileSize, this.coreLogLevel);
+    this.isStream = fileSize < 0;
+    this.pendingData = [];
+    this.bufferFull = false;
+    var ret = this.handle != 0 ? 0 : kErrorInitDecoder;
+    this.logger.logInfo("initDecoder return " + this.handle + ".");
     if (0 == ret) {
-        this.cacheBuffer = Module._malloc(chunkSize);
+        this.spanSlot = Module._malloc(4);
+        this.startLogTimer();
     }
     var objData = {
         t: kInitDecoderRsp,
@@ -34,18 +60,144 @@ Decoder.prototype.initDecoder = function (fileSize, chunkSize) {
 };
 
 Decoder.prototype.uninitDecoder = function () {
-    var ret = Module._uninitDecoder();
+    var ret = Module._uninitDecoder(this.handle);
+    this.handle = 0;
+    this.stopLogTimer();
+    if (this.decodeStatus != null) {
+        Module._free(this.decodeStatus);
+        this.decodeStatus = null;
+    }
+    if (this.statsBuffer != null) {
+        Module._free(this.statsBuffer);
+        this.statsBuffer = null;
+    }
+    if (this.memoryStatsBuffer != null) {
+        Module._free(this.memoryStatsBuffer);
+        this.memoryStatsBuffer = null;
+    }
+    if (this.readaheadBuffer != null) {
+        Module._free(this.readaheadBuffer);
+        this.readaheadBuffer = null;
+    }
     this.logger.logInfo("Uninit ffmpeg decoder return " + ret + ".");
-    if (this.cacheBuffer != null) {
-        Module._free(this.cacheBuffer);
-        this.cacheBuffer = null;
+    if (this.spanSlot != null) {
+        Module._free(this.spanSlot);
+        this.spanSlot = null;
+    }
+};
+
+Decoder.prototype.startLogTimer = function () {
+    if (this.coreLogLevel == 0 || this.logTimer) {
+        return;
+    }
+
+    if (this.logBuffer == null) {
+        this.logBuffer = Module._malloc(kLogDrainSize);
+    }
+    this.logTimer = setInterval(this.drainLog.bind(this), kLogDrainInterval);
+};
+
+Decoder.prototype.stopLogTimer = function () {
+    if (this.logTimer) {
+        clearInterval(this.logTimer);
+        this.logTimer = null;
+    }
+
+    if (this.logBuffer != null) {
+        this.drainLog();
+        Module._free(this.logBuffer);
+        this.logBuffer = null;
+    }
+};
+
+// Native logs are recorded in binary and only formatted here, off the decode path.
+Decoder.prototype.drainLog = function () {
+    var len = 0;
+    do {
+        len = Module._drainLog(this.logBuffer, kLogDrainSize);
+        if (len > 0) {
+            var text = this.logDecoder.decode(Module.HEAPU8.slice(this.logBuffer, this.logBuffer + len - 1));
+            console.log(text);
+        }
+    } while (len > kLogDrainSize / 2);
+};
+
+Decoder.prototype.setStreamHint = function (type, h) {
+    var hint = Module._malloc(kStreamHintSize);
+    var extradata = 0;
+    var extradataSize = 0;
+    if (h && h.extradata && h.extradata.length > 0) {
+        extradataSize = h.extradata.length;
+        extradata = Module._malloc(extradataSize);
+        Module.HEAPU8.set(h.extradata, extradata);
+    }
+
+    var fields = Module.HEAP32.subarray(hint >> 2, (hint >> 2) + 7);
+    fields[0] = h ? (h.codecId || 0) : 0;
+    fields[1] = h ? (h.width || 0) : 0;
+    fields[2] = h ? (h.height || 0) : 0;
+    fields[3] = h ? (h.sampleRate || 0) : 0;
+    fields[4] = h ? (h.channels || 0) : 0;
+    fields[5] = extradata;
+    fields[6] = extradataSize;
+    Module._setStreamHint(this.handle, type, hint);
+
+    if (extradata != 0) {
+        Module._free(extradata);
+    }
+    Module._free(hint);
+};
+
+Decoder.prototype.setPacketQueueLimits = function (type, limits) {
+    if (!limits) {
+        return;
+    }
+    var ret = Module._setPacketQueueLimits(this.handle, type, limits.maxBytes || 0, limits.maxDuration || 0);
+    if (ret != 0) {
+        this.logger.logError("setPacketQueueLimits " + type + " return " + ret + ".");
     }
 };
 
-Decoder.prototype.openDecoder = function () {
+Decoder.prototype.applyOpenOptions = function (options) {
+    options = options || {};
+    Module._setProbeLimits(this.handle, options.probeSize || 0, options.analyzeDuration || 0);
+    this.setPacketQueueLimits(kStreamTypeVideo, options.packetQueue && options.packetQueue.video);
+    this.setPacketQueueLimits(kStreamTypeAudio, options.packetQueue && options.packetQueue.audio);
+    Module._setMemoryBudget(this.handle, options.memoryBudget || 0);
+    var output = options.audioOutput || {};
+    Module._setAudioOutput(this.handle, output.sampleRate || 0, output.channels || 0, output.blockMs || 0);
+    if (options.quality === false) {
+        Module._setQualityLadder(this.handle, 0, 0, 0);
+    } else {
+        var quality = options.quality || {};
+        Module._setQualityLadder(this.handle, 1,
+            quality.lowWater != undefined ? quality.lowWater : kQualityLowWaterMs,
+            quality.highWater != undefined ? quality.highWater : kQualityHighWaterMs);
+    }
+    if (this.isStream && options.live) {
+        var drop = options.live.dropThreshold != undefined ? options.live.dropThreshold : kLiveDropThresholdMs;
+        var jump = options.live.jumpThreshold != undefined ? options.live.jumpThreshold : kLiveJumpThresholdMs;
+        Module._setLiveMode(this.handle, 1, drop, jump);
+    }
+    this.setStreamHint(0, options.video);
+    this.setStreamHint(1, options.audio);
+    var tracks = options.tracks || {};
+    Module._setTrackEnabled(this.handle, kStreamTypeVideo, tracks.video === false ? 0 : 1);
+    Module._setTrackEnabled(this.handle, kStreamTypeAudio, tracks.audio === false ? 0 : 1);
+    var format = options.outputFormat == "nv12" ? kOutputFormatNV12 : kOutputFormatYUV420P;
+    //videoCallback reads a packed picture, frame mode lends FrameViews to native hosts only.
+    Module._setOutputMode(this.handle, kOutputModeCopy);
+    if (Module._setOutputFormat(this.handle, format) == 0) {
+        this.outputFormat = format;
+    }
+};
+
+Decoder.prototype.openDecoder = function (options) {
+    this.applyOpenOptions(options);
+    Module._setOutputSize(this.handle, this.requestedWidth, this.requestedHeight);
     var paramCount = 7, paramSize = 4;
     var paramByteBuffer = Module._malloc(paramCount * paramSize);
-    var ret = Module._openDecoder(paramByteBuffer, paramCount, this.videoCallback, this.audioCallback, this.requestCallback);
+    var ret = Module._openDecoder(this.handle, paramByteBuffer, paramCount, this.videoCallback, this.audioCallback, this.requestCallback, this.threadCount);
     this.logger.logInfo("openDecoder return " + ret);
 
     if (ret == 0) {
@@ -58,6 +210,7 @@ Decoder.prototype.openDecoder = function () {
         var audioSampleFmt  = paramArray[4];
         var audioChannels   = paramArray[5];
         var audioSampleRate = paramArray[6];
+        this.updateOutputSize();
 
         var objData = {
             t: kOpenDecoderRsp,
@@ -85,6 +238,28 @@ Decoder.prototype.openDecoder = function () {
     Module._free(paramByteBuffer);
 };
 
+Decoder.prototype.setOutputSize = function (width, height) {
+    this.requestedWidth = width;
+    this.requestedHeight = height;
+    if (this.handle == 0) {
+        return;
+    }
+
+    var ret = Module._setOutputSize(this.handle, width, height);
+    this.logger.logInfo("setOutputSize " + width + "x" + height + " return " + ret + ".");
+    this.updateOutputSize();
+};
+
+// Native clamps the request to the coded size, read back what frames will actually be.
+Decoder.prototype.updateOutputSize = function () {
+    var sizeBuffer = Module._malloc(8);
+    if (Module._getOutputSize(this.handle, sizeBuffer, sizeBuffer + 4) == 0) {
+        this.outputWidth = Module.HEAP32[sizeBuffer >> 2];
+        this.outputHeight = Module.HEAP32[(sizeBuffer >> 2) + 1];
+    }
+    Module._free(sizeBuffer);
+};
+
 Decoder.prototype.closeDecoder = function () {
     this.logger.logInfo("closeDecoder.");
     if (this.decodeTimer) {
@@ -93,7 +268,7 @@ Decoder.prototype.closeDecoder = function () {
         this.logger.logInfo("Decode timer stopped.");
     }
 
-    var ret = Module._closeDecoder();
+    var ret = Module._closeDecoder(this.handle);
     this.logger.logInfo("Close ffmpeg decoder return " + ret + ".");
 
     var objData = {
@@ -120,31 +295,131 @@ Decoder.prototype.pauseDecoding = function () {
 };
 
 Decoder.prototype.decode = function () {
-    var ret = Module._decodeOnePacket();
-    if (ret == 7) {
-        self.decoder.logger.logInfo("Decoder finished.");
-        self.decoder.pauseDecoding();
+    var decoder = self.decoder;
+    if (decoder.pendingData.length > 0) {
+        decoder.flushPendingData();
+    }
+
+    if (decoder.decodeStatus == null) {
+        decoder.decodeStatus = Module._malloc(kDecodeStatusSize);
+    }
+
+    // Old frames during accurate seek are skipped natively.
+    Module._decodePackets(decoder.handle, decoder.batchFrames, decoder.batchBudgetMs, decoder.decodeStatus);
+    decoder.publishReadahead(false);
+    var stopReason = Module.HEAP32[(decoder.decodeStatus >> 2) + kDecodeStatusStopReason];
+    if (stopReason == kDecodeStopEof) {
+        decoder.logger.logInfo("Decoder finished.");
+        decoder.pauseDecoding();
         var objData = {
             t: kDecodeFinishedEvt,
         };
         self.postMessage(objData);
     }
+};
 
-    while (ret == 9) {
-        //self.decoder.logger.logInfo("One old frame");
-        ret = Module._decodeOnePacket();
+Decoder.prototype.sendData = function (data, offset) {
+    var typedArray = new Uint8Array(data);
+    if (!this.isStream) {
+        this.ingest(typedArray, offset);
+        // Demux runs ahead as data arrives, decode drains the packet queues on its timer.
+        Module._demuxPackets(this.handle, 0);
+        this.publishReadahead(false);
+        return;
     }
+
+    this.pendingData.push(typedArray);
+    this.flushPendingData();
 };
 
-Decoder.prototype.sendData = function (data) {
-    var typedArray = new Uint8Array(data);
-    Module.HEAPU8.set(typedArray, this.cacheBuffer);
-    Module._sendData(this.cacheBuffer, typedArray.length);
+// Copies straight into the native ring or cache, the only copy before demuxing. Returns the
+// bytes taken, fewer than data.length when the ring is full, negative on error.
+Decoder.prototype.ingest = function (data, offset) {
+    var taken = 0;
+    while (taken < data.length) {
+        var len = Module._getWriteSpan(this.handle, offset + taken, this.spanSlot);
+        if (len <= 0) {
+            return taken > 0 || len == 0 ? taken : len;
+        }
+
+        len = Math.min(len, data.length - taken);
+        var span = Module.HEAP32[this.spanSlot >> 2];
+        Module.HEAPU8.set(data.subarray(taken, taken + len), span);
+        Module._commitWrite(this.handle, len);
+        taken += len;
+    }
+    return taken;
+};
+
+Decoder.prototype.flushPendingData = function () {
+    while (this.pendingData.length > 0) {
+        var chunk = this.pendingData[0];
+        var accepted = this.ingest(chunk, 0);
+        if (accepted < 0) {
+            this.logger.logError("ingest return " + accepted + ", drop pending data.");
+            this.pendingData = [];
+            break;
+        }
+
+        if (accepted < chunk.length) {
+            this.pendingData[0] = chunk.subarray(accepted);
+            // Native ring is full, demuxing into the packet queues frees it until they fill
+            // up too, then keep the rest until decoding drains it.
+            if (Module._demuxPackets(this.handle, 0) > 0) {
+                continue;
+            }
+            break;
+        }
+        this.pendingData.shift();
+    }
+    Module._demuxPackets(this.handle, 0);
+
+    var full = this.pendingData.length > 0;
+    if (full != this.bufferFull) {
+        this.bufferFull = full;
+        var objData = {
+            t: kBufferFullEvt,
+            f: full
+        };
+        self.postMessage(objData);
+    }
+};
+
+// File mode, tells the downloader which ranges the demuxer reads next.
+Decoder.prototype.publishReadahead = function (force) {
+    if (this.isStream) {
+        return;
+    }
+
+    var now = Date.now();
+    if (!force && now - this.readaheadTime < kReadaheadInterval) {
+        return;
+    }
+    this.readaheadTime = now;
+
+    if (this.readaheadBuffer == null) {
+        this.readaheadBuffer = Module._malloc(kReadaheadMaxRanges * kReadaheadRangeSize);
+    }
+
+    var count = Module._getReadaheadPlan(this.handle, this.readaheadBuffer, kReadaheadMaxRanges, kReadaheadHorizonMs);
+    var first = count > 0 ? Module.HEAPF64[this.readaheadBuffer >> 3] : -1;
+    if (count < 0 || (first == this.readaheadFirst && !force)) {
+        return;
+    }
+    this.readaheadFirst = first;
+
+    var begin = this.readaheadBuffer >> 3;
+    var objData = {
+        t: kReadaheadEvt,
+        d: new Float64Array(Module.HEAPF64.subarray(begin, begin + count * kReadaheadRangeFields))
+    };
+    self.postMessage(objData, [objData.d.buffer]);
 };
 
 Decoder.prototype.seekTo = function (ms) {
     var accurateSeek = this.accurateSeek ? 1 : 0;
-    var ret = Module._seekTo(ms, accurateSeek);
+    var ret = Module._seekTo(this.handle, ms, accurateSeek);
+    this.publishReadahead(true);
     var objData = {
         t: kSeekToRsp,
         r: ret
@@ -152,6 +427,81 @@ Decoder.prototype.seekTo = function (ms) {
     self.postMessage(objData);
 };
 
+Decoder.prototype.getStats = function () {
+    if (this.statsBuffer == null) {
+        this.statsBuffer = Module._malloc(kDecoderStatsSize);
+    }
+
+    var ret = Module._getStats(this.handle, this.statsBuffer);
+    var stats = null;
+    if (ret == 0) {
+        var begin = this.statsBuffer >> 3;
+        stats = new Float64Array(Module.HEAPF64.subarray(begin, begin + (kDecoderStatsSize >> 3)));
+    }
+
+    if (this.memoryStatsBuffer == null) {
+        this.memoryStatsBuffer = Module._malloc(kMemoryStatsSize);
+    }
+    var memory = null;
+    if (Module._getMemoryStats(this.handle, this.memoryStatsBuffer) == 0) {
+        var memoryBegin = this.memoryStatsBuffer >> 3;
+        memory = new Float64Array(Module.HEAPF64.subarray(memoryBegin, memoryBegin + (kMemoryStatsSize >> 3)));
+    }
+    var objData = {
+        t: kStatsRsp,
+        r: ret,
+        d: stats,
+        m: memory
+    };
+    self.postMessage(objData);
+};
+
+Decoder.prototype.getKeyframes = function () {
+    var count = Module._getKeyframeIndex(this.handle, 0, 0);
+    var index = null;
+    if (count > 0) {
+        var entries = Module._malloc(count * kKeyframeEntrySize);
+        count = Module._getKeyframeIndex(this.handle, entries, count);
+        var begin = entries >> 3;
+        index = new Float64Array(Module.HEAPF64.subarray(begin, begin + count * kKeyframeEntryFields));
+        Module._free(entries);
+    }
+    var objData = {
+        t: kKeyframesRsp,
+        d: index
+    };
+    self.postMessage(objData);
+};
+
+// Previews are YUV420P of req.w x req.h, back to back in d, timestamps in s.
+Decoder.prototype.getThumbnails = function (req) {
+    var size = req.w * req.h * 3 / 2;
+    var request = Module._malloc(kThumbnailRequestSize);
+    var buffer = Module._malloc(req.c * size);
+    var stamps = Module._malloc(req.c * 8);
+    var fields = request >> 2;
+    Module.HEAP32.set([req.s, req.i, req.c, req.w, req.h, -1], fields);
+
+    var count = Module._extractThumbnails(this.handle, request, buffer, stamps);
+    var objData = {
+        t: kThumbnailsRsp,
+        r: count,
+        w: req.w,
+        h: req.h,
+        m: Module.HEAP32[fields + kThumbnailRequestFields - 1],
+        d: null,
+        s: null
+    };
+    if (count > 0) {
+        objData.d = new Uint8Array(Module.HEAPU8.subarray(buffer, buffer + count * size));
+        objData.s = new Float64Array(Module.HEAPF64.subarray(stamps >> 3, (stamps >> 3) + count));
+    }
+    Module._free(stamps);
+    Module._free(buffer);
+    Module._free(request);
+    self.postMessage(objData, objData.d ? [objData.d.buffer] : []);
+};
+
 Decoder.prototype.processReq = function (req) {
     //this.logger.logInfo("processReq " + req.t + ".");
     switch (req.t) {
@@ -162,7 +512,7 @@ Decoder.prototype.processReq = function (req) {
             this.uninitDecoder();
             break;
         case kOpenDecoderReq:
-            this.openDecoder();
+            this.openDecoder(req.o);
             break;
         case kCloseDecoderReq:
             this.closeDecoder();
@@ -174,11 +524,29 @@ Decoder.prototype.processReq = function (req) {
             this.pauseDecoding();
             break;
         case kFeedDataReq:
-            this.sendData(req.d);
+            this.sendData(req.d, req.o);
             break;
         case kSeekToReq:
             this.seekTo(req.ms);
             break;
+        case kGetStatsReq:
+            this.getStats();
+            break;
+        case kGetKeyframesReq:
+            this.getKeyframes();
+            break;
+        case kQueueDepthReq:
+            Module._reportQueueDepth(this.handle, req.d);
+            break;
+        case kSetOutputSizeReq:
+            this.setOutputSize(req.w, req.h);
+            break;
+        case kThumbnailsReq:
+            this.getThumbnails(req);
+            break;
+        case kSetTrackReq:
+            Module._setTrackEnabled(this.handle, req.k, req.e ? 1 : 0);
+            break;
         default:
             this.logger.logError("Unsupport messsage " + req.t);
     }
@@ -200,6 +568,9 @@ Decoder.prototype.onWasmLoaded = function () {
         var objData = {
             t: kVideoFrame,
             s: timestamp,
+            w: self.decoder.outputWidth,
+            h: self.decoder.outputHeight,
+            f: self.decoder.outputFormat,
             d: data
         };
         self.postMessage(objData, [objData.d.buffer]);
@@ -62,6 +62,11 @@ PCMPlayer.prototype.feed = function(data) {
 };
 
 PCMPlayer.prototype.getFormatedValue = function(data) {
+    if (this.typedArray === Float32Array) {
+        // Decoder already outputs normalized Float32, just view it.
+        return new Float32Array(data.buffer, data.byteOffset, data.byteLength >> 2);
+    }
+
     var data = new this.typedArray(data.buffer),
         float32 = new Float32Array(data.length),
         i;
@@ -57,8 +57,11 @@ function Player() {
     this.audioEncoding      = "";
     this.audioChannels      = 0;
     this.audioSampleRate    = 0;
+    this.audioPresent       = true;   // The file has an audio stream.
+    this.audioEnabled       = true;   // Audio frames will arrive, otherwise the audio context is only a clock.
     this.seeking            = false;  // Flag to preventing multi seek from track.
     this.justSeeked         = false;  // Flag to preventing multi seek from ffmpeg.
+    this.seekResumeOffset   = 0;      // Download offset before a seek prefetch moved it.
     this.urgent             = false;
     this.seekWaitLen        = 524288; // Default wait for 512K, will be updated in onVideoParam.
     this.seekReceivedLen    = 0;
@@ -70,6 +73,15 @@ function Player() {
     this.firstAudioFrame    = true;
     this.fetchController    = null;
     this.streamPauseParam   = null;
+    this.streamBackpressure = false;  // Decoder ring full, stop reading the stream.
+    this.streamResume       = null;
+    this.statsCallbacks     = [];     // Pending getStats callers, answered in order.
+    this.thumbnailCallbacks = [];     // Pending getThumbnails callers, answered in order.
+    this.openOptions        = null;   // Fast open, see setOpenOptions.
+    this.deviceSampleRate   = 0;      // Audio output target, see getDeviceSampleRate.
+    this.keyframes          = null;   // Float64Array of native KeyframeEntry, file mode only.
+    this.readahead          = null;   // Float64Array of native ReadaheadRange, consumed as requested.
+    this.queueDepthTime     = 0;
     this.logger             = new Logger("Player");
     this.initDownloadWorker();
     this.initDecodeWorker();
@@ -118,6 +130,21 @@ Player.prototype.initDecodeWorker = function () {
             case kSeekToRsp:
                 self.onSeekToRsp(objData.r);
                 break;
+            case kBufferFullEvt:
+                self.onBufferFull(objData.f);
+                break;
+            case kStatsRsp:
+                self.onStats(objData.r, objData.d, objData.m);
+                break;
+            case kKeyframesRsp:
+                self.onKeyframes(objData.d);
+                break;
+            case kReadaheadEvt:
+                self.onReadahead(objData.d);
+                break;
+            case kThumbnailsRsp:
+                self.onThumbnails(objData);
+                break;
         }
     }
 };
@@ -384,6 +411,8 @@ Player.prototype.stop = function () {
 
     this.stopDownloadTimer();
     this.stopTrackTimer();
+    this.keyframes = null;
+    this.readahead = null;
     this.hideLoading();
 
     this.fileInfo           = null;
@@ -453,6 +482,15 @@ Player.prototype.seekTo = function(ms) {
     // Clear frame buffer.
     this.frameBuffer.length = 0;
 
+    // Fetch the keyframe's range while the decoder seeks instead of waiting for its request.
+    var offset = this.getKeyframeOffset(ms);
+    this.seekResumeOffset = this.fileInfo.offset;
+    if (offset >= 0) {
+        this.logger.logInfo("Prefetch from keyframe offset " + offset);
+        this.fileInfo.offset = offset;
+        this.startDownloadTimer();
+    }
+
     // Request decoder to seek.
     this.decodeWorker.postMessage({
         t: kSeekToReq,
@@ -480,6 +518,120 @@ Player.prototype.getState = function () {
     return this.playerState;
 };
 
+// Fast open, applies to the next play. All fields optional:
+// {probeSize, analyzeDuration(ms), video: {codecId, width, height, extradata},
+//  audio: {codecId, sampleRate, channels, extradata}, live: {dropThreshold, jumpThreshold}},
+// extradata is a Uint8Array. With both hints given MP4 opens without probing, time to first
+// frame is in getStats. live (stream only) opens low delay and catches up with the live edge,
+// dropping non-reference frames above dropThreshold ms and jumping to the newest keyframe
+// above jumpThreshold ms, current latency is liveLatencyMs in getStats.
+// quality: {lowWater, highWater} in buffered ms steps the decoder's quality ladder down while
+// the frame buffer drains and back up once it refills, false turns the ladder off.
+// tracks: {video: false} or {audio: false} opens without that track, it is neither demuxed nor
+// decoded. A file missing a track plays with the other one alone.
+// outputFormat: "nv12" hands over interleaved chroma, one texture upload less per frame.
+// packetQueue: {video: {maxBytes, maxDuration}, audio: {...}} bounds how far demuxing runs
+// ahead of decoding per track, duration in ms, 0 lifts a limit.
+// memoryBudget: bytes this decoder may hold in pictures, output buffers, packet queues and
+// cache, the open fails if the stream can't be decoded within it. Usage and peak are in
+// getStats' memory.
+// audioOutput: {sampleRate, channels, blockMs} has the decoder resample to sampleRate, mix to
+// channels (1 or 2) and post blocks of blockMs. Defaults to the audio device's rate, the
+// source's channels and kAudioBlockMs, false posts every decoded frame as it is.
+Player.prototype.setOpenOptions = function (options) {
+    this.openOptions = options || null;
+};
+
+// Rate of a default AudioContext, the decoder resamples to it so WebAudio doesn't have to.
+Player.prototype.getDeviceSampleRate = function () {
+    if (!this.deviceSampleRate) {
+        var context = new (window.AudioContext || window.webkitAudioContext)();
+        this.deviceSampleRate = context.sampleRate;
+        if (context.close) {
+            context.close();
+        }
+    }
+    return this.deviceSampleRate;
+};
+
+Player.prototype.getOpenOptions = function () {
+    var options = Object.assign({}, this.openOptions);
+    if (options.audioOutput === undefined) {
+        options.audioOutput = {
+            sampleRate: this.getDeviceSampleRate(),
+            channels: 0,
+            blockMs: kAudioBlockMs
+        };
+    }
+    return options;
+};
+
+// Decode straight to the display size, e.g. the canvas size times devicePixelRatio, so a 1080p
+// source feeding a small canvas transfers and uploads a quarter of the bytes. Never upscales,
+// 0, 0 goes back to the coded size. Takes effect with the next decoded frame.
+Player.prototype.setOutputSize = function (width, height) {
+    if (!this.decodeWorker) {
+        return;
+    }
+
+    this.decodeWorker.postMessage({
+        t: kSetOutputSizeReq,
+        w: width,
+        h: height
+    });
+};
+
+// callback(ret, stats, memory), stats and memory are Float64Arrays laid out as native
+// DecoderStats and MemoryStats.
+Player.prototype.getStats = function (callback) {
+    if (!this.decodeWorker) {
+        return;
+    }
+
+    this.statsCallbacks.push(callback);
+    this.decodeWorker.postMessage({
+        t: kGetStatsReq
+    });
+};
+
+// Seek bar previews, file mode. callback(count, previews, missingOffset): previews.d holds count
+// YUV420P pictures of width x height, previews.s their timestamps in seconds. Keyframes only,
+// the first at or after startMs, then at least intervalMs apart. Only downloaded bytes are
+// used, missingOffset >= 0 is where the batch ran out, retry once more of the file is in.
+Player.prototype.getThumbnails = function (startMs, intervalMs, count, width, height, callback) {
+    if (!this.decodeWorker) {
+        return;
+    }
+
+    this.thumbnailCallbacks.push(callback);
+    this.decodeWorker.postMessage({
+        t: kThumbnailsReq,
+        s: startMs,
+        i: intervalMs,
+        c: count,
+        w: width,
+        h: height
+    });
+};
+
+// Turns a track off or back on while playing, e.g. audio of a muted tile. Off costs nothing,
+// the track is discarded at demux time. Video resumes at its next keyframe.
+Player.prototype.setTrackEnabled = function (kind, enable) {
+    if (kind == "audio") {
+        this.audioEnabled = enable && this.audioPresent;
+    }
+
+    if (!this.decodeWorker) {
+        return;
+    }
+
+    this.decodeWorker.postMessage({
+        t: kSetTrackReq,
+        k: kind == "audio" ? kStreamTypeAudio : kStreamTypeVideo,
+        e: enable
+    });
+};
+
 Player.prototype.setTrack = function (timeTrack, timeLabel) {
     this.timeTrack = timeTrack;
     this.timeLabel = timeLabel;
@@ -547,11 +699,11 @@ Player.prototype.onFileData = function (data, start, end, seq) {
         }
     }
 
-    var len = end - start + 1;
-    this.fileInfo.offset += len;
+    this.fileInfo.offset = end + 1;
 
     var objData = {
         t: kFeedDataReq,
+        o: start,
         d: data
     };
     this.decodeWorker.postMessage(objData, [objData.d]);
@@ -580,7 +732,8 @@ Player.prototype.onFileDataUnderDecoderIdle = function () {
         this.logger.logInfo("Opening decoder.");
         this.decoderState = decoderStateInitializing;
         var req = {
-            t: kOpenDecoderReq
+            t: kOpenDecoderReq,
+            o: this.getOpenOptions()
         };
         this.decodeWorker.postMessage(req);
     }
@@ -620,8 +773,16 @@ Player.prototype.onOpenDecoder = function (objData) {
     if (objData.e == 0) {
         this.onVideoParam(objData.v);
         this.onAudioParam(objData.a);
+        var tracks = (this.openOptions && this.openOptions.tracks) || {};
+        this.audioPresent = objData.a.c > 0;
+        this.audioEnabled = this.audioPresent && tracks.audio !== false;
         this.decoderState = decoderStateReady;
         this.logger.logInfo("Decoder ready now.");
+        if (!this.isStream) {
+            this.decodeWorker.postMessage({
+                t: kGetKeyframesReq
+            });
+        }
         this.startDecoding();
     } else {
         this.reportPlayError(objData.e);
@@ -682,6 +843,14 @@ Player.prototype.onAudioParam = function (a) {
     var channels = a.c;
     var sampleRate = a.r;
 
+    // No audio stream, keep an idle audio context as the presentation clock.
+    if (channels <= 0) {
+        this.logger.logInfo("No audio stream, audio clock only.");
+        sampleFmt = 3;
+        channels = 1;
+        sampleRate = 48000;
+    }
+
     var encoding = "16bitInt";
     switch (sampleFmt) {
         case 0:
@@ -803,6 +972,12 @@ Player.prototype.displayVideoFrame = function (frame) {
         this.urgent = false;
     }
 
+    // Without audio frames the stream's time base comes from the first picture.
+    if (this.isStream && this.firstAudioFrame && !this.audioEnabled) {
+        this.firstAudioFrame = false;
+        this.beginTimeOffset = frame.s;
+    }
+
     var audioCurTs = this.pcmPlayer.getTimestamp();
     var audioTimestamp = audioCurTs + this.beginTimeOffset;
     var delay = frame.s - audioTimestamp;
@@ -811,7 +986,7 @@ Player.prototype.displayVideoFrame = function (frame) {
 
     if (audioTimestamp <= 0 || delay <= 0) {
         var data = new Uint8Array(frame.d);
-        this.renderVideoFrame(data);
+        this.renderVideoFrame(data, frame.w, frame.h, frame.f);
         return true;
     }
     return false;
@@ -824,27 +999,121 @@ Player.prototype.onSeekToRsp = function (ret) {
     }
 };
 
+Player.prototype.onBufferFull = function (full) {
+    this.streamBackpressure = full;
+    if (!full && this.streamResume) {
+        var resume = this.streamResume;
+        this.streamResume = null;
+        resume();
+    }
+};
+
+Player.prototype.onKeyframes = function (index) {
+    this.keyframes = index;
+    this.logger.logInfo("Keyframe index " + (index ? index.length / kKeyframeEntryFields : 0) + " entries.");
+};
+
+// Byte offset of the last keyframe at or before ms, -1 without an index.
+Player.prototype.getKeyframeOffset = function (ms) {
+    if (!this.keyframes || this.keyframes.length == 0) {
+        return -1;
+    }
+
+    var seconds = ms / 1000;
+    var low = 0;
+    var high = this.keyframes.length / kKeyframeEntryFields - 1;
+    while (low < high) {
+        var mid = (low + high + 1) >> 1;
+        if (this.keyframes[mid * kKeyframeEntryFields] <= seconds) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return this.keyframes[low * kKeyframeEntryFields + 1];
+};
+
+Player.prototype.onReadahead = function (plan) {
+    this.readahead = plan;
+    if (plan.length > 0 && this.downloadTimer == null && this.playerState != playerStateIdle) {
+        this.startDownloadTimer();
+    }
+};
+
+// Next [start, end] from the demuxer's readahead plan, null when it has nothing pending.
+Player.prototype.nextReadaheadChunk = function () {
+    var plan = this.readahead;
+    if (!plan) {
+        return null;
+    }
+
+    for (var i = 0; i < plan.length; i += kReadaheadRangeFields) {
+        var size = plan[i + 1];
+        if (size <= 0) {
+            continue;
+        }
+
+        var start = plan[i];
+        var len = Math.min(size, this.fileInfo.chunkSize);
+        plan[i] += len;
+        plan[i + 1] -= len;
+        return {
+            s: start,
+            e: start + len - 1
+        };
+    }
+    return null;
+};
+
+Player.prototype.onThumbnails = function (objData) {
+    var callback = this.thumbnailCallbacks.shift();
+    if (callback) {
+        callback(objData.r, objData.r > 0 ? { w: objData.w, h: objData.h, d: objData.d, s: objData.s } : null, objData.m);
+    }
+};
+
+Player.prototype.onStats = function (ret, stats, memory) {
+    var callback = this.statsCallbacks.shift();
+    if (callback) {
+        callback(ret, stats, memory);
+    }
+};
+
 Player.prototype.onRequestData = function (offset, available) {
     if (this.justSeeked) {
         this.logger.logInfo("Request data " + offset + ", available " + available);
         if (offset == -1) {
-            // Hit in buffer.
+            // Hit in buffer, the decoder reads on to where the download stood before the seek.
+            if (this.fileInfo.offset != this.seekResumeOffset) {
+                this.fileInfo.offset = this.seekResumeOffset;
+                this.stopDownloadTimer();
+            }
             let left = this.fileInfo.size - this.fileInfo.offset;
             if (available >= left) {
                 this.logger.logInfo("No need to wait");
                 this.resume();
-            } else {
+            } else if (this.downloadTimer == null) {
                 this.startDownloadTimer();
             }
         } else {
-            if (offset >= 0 && offset < this.fileInfo.size) {
+            // Keep a prefetch only if it already heads where the decoder asks.
+            if (offset >= 0 && offset < this.fileInfo.size && offset != this.fileInfo.offset) {
                 this.fileInfo.offset = offset;
+                this.stopDownloadTimer();
+            }
+            if (this.downloadTimer == null) {
+                this.startDownloadTimer();
             }
-            this.startDownloadTimer();
         }
 
         //this.restartAudio();
         this.justSeeked = false;
+    } else if (offset >= 0 && offset <= this.fileInfo.size && offset != this.fileInfo.offset) {
+        // Decoder cache wants a different range, e.g. skipping data it already has.
+        this.logger.logInfo("Redirect download to " + offset + ", available " + available);
+        this.fileInfo.offset = offset;
+        this.stopDownloadTimer();
+        this.startDownloadTimer();
     }
 };
 
@@ -890,6 +1159,8 @@ Player.prototype.displayLoop = function() {
         }
     }
 
+    this.reportQueueDepth();
+
     if (this.getBufferTimerLength() < maxBufferTimeLength / 2) {
         if (!this.decoding) {
             //this.logger.logInfo("Buffer time length < " + maxBufferTimeLength / 2 + ", restart decoding.");
@@ -907,6 +1178,23 @@ Player.prototype.displayLoop = function() {
     }
 };
 
+// Buffered time ahead drives the native quality ladder, a draining buffer means decoding is too slow.
+// The decoder ignores it while its input ran dry, a slow network is not helped by lower quality.
+Player.prototype.reportQueueDepth = function () {
+    var now = Date.now();
+    if (now - this.queueDepthTime < kQueueDepthInterval || this.seeking || this.buffering) {
+        return;
+    }
+    this.queueDepthTime = now;
+
+    // Decoding paused on a full buffer is not falling behind.
+    var depth = Math.round((this.decoding ? this.getBufferTimerLength() : maxBufferTimeLength) * 1000);
+    this.decodeWorker.postMessage({
+        t: kQueueDepthReq,
+        d: depth
+    });
+};
+
 Player.prototype.startBuffering = function () {
     this.buffering = true;
     this.showLoading();
@@ -919,8 +1207,15 @@ Player.prototype.stopBuffering = function () {
     this.resume();
 }
 
-Player.prototype.renderVideoFrame = function (data) {
-    this.webglPlayer.renderFrame(data, this.videoWidth, this.videoHeight, this.yLength, this.uvLength);
+// Frames carry their own size, it changes with setOutputSize while older frames are still queued.
+Player.prototype.renderVideoFrame = function (data, width, height, format) {
+    if (width > 0 && height > 0 && (width != this.videoWidth || height != this.videoHeight)) {
+        this.videoWidth = width;
+        this.videoHeight = height;
+        this.yLength = width * height;
+        this.uvLength = (width / 2) * (height / 2);
+    }
+    this.webglPlayer.renderFrame(data, this.videoWidth, this.videoHeight, this.yLength, this.uvLength, format == kOutputFormatNV12);
 };
 
 Player.prototype.downloadOneChunk = function () {
@@ -928,14 +1223,16 @@ Player.prototype.downloadOneChunk = function () {
         return;
     }
 
-    var start = this.fileInfo.offset;
+    // What the demuxer reads next comes first, linear download fills the rest.
+    var chunk = this.nextReadaheadChunk();
+    var start = chunk ? chunk.s : this.fileInfo.offset;
     if (start >= this.fileInfo.size) {
         this.logger.logError("Reach file end.");
         this.stopDownloadTimer();
         return;
     }
 
-    var end = this.fileInfo.offset + this.fileInfo.chunkSize - 1;
+    var end = chunk ? chunk.e : this.fileInfo.offset + this.fileInfo.chunkSize - 1;
     if (end >= this.fileInfo.size) {
         end = this.fileInfo.size - 1;
     }
@@ -1106,7 +1403,8 @@ Player.prototype.onStreamDataUnderDecoderIdle = function (length) {
         this.logger.logInfo("Opening decoder.");
         this.decoderState = decoderStateInitializing;
         var req = {
-            t: kOpenDecoderReq
+            t: kOpenDecoderReq,
+            o: this.getOpenOptions()
         };
         this.decodeWorker.postMessage(req);
     } else {
@@ -1157,6 +1455,14 @@ Player.prototype.requestStream = function (url) {
                 self.onStreamDataUnderDecoderIdle(dataLength);
             }
 
+            if (self.streamBackpressure) {
+                return new Promise(function (resolve) {
+                    self.streamResume = resolve;
+                }).then(function () {
+                    return reader.read().then(processData);
+                });
+            }
+
             return reader.read().then(processData);
         });
     }).catch(err => {
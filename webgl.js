@@ -17,10 +17,12 @@ Texture.prototype.bind = function (n, program, name) {
     gl.uniform1i(gl.getUniformLocation(program, name), n);
 };
 
-Texture.prototype.fill = function (width, height, data) {
+// format defaults to LUMINANCE, LUMINANCE_ALPHA takes interleaved NV12 chroma.
+Texture.prototype.fill = function (width, height, data, format) {
     var gl = this.gl;
+    format = format || gl.LUMINANCE;
     gl.bindTexture(gl.TEXTURE_2D, this.texture);
-    gl.texImage2D(gl.TEXTURE_2D, 0, gl.LUMINANCE, width, height, 0, gl.LUMINANCE, gl.UNSIGNED_BYTE, data);
+    gl.texImage2D(gl.TEXTURE_2D, 0, format, width, height, 0, format, gl.UNSIGNED_BYTE, data);
 };
 
 function WebGLPlayer(canvas, options) {
@@ -56,6 +58,7 @@ WebGLPlayer.prototype.initGL = function (options) {
         "uniform sampler2D YTexture;",
         "uniform sampler2D UTexture;",
         "uniform sampler2D VTexture;",
+        "uniform bool NV12;",
         "const mat4 YUV2RGB = mat4",
         "(",
         " 1.1643828125, 0, 1.59602734375, -.87078515625,",
@@ -64,7 +67,9 @@ WebGLPlayer.prototype.initGL = function (options) {
         " 0, 0, 0, 1",
         ");",
         "void main(void) {",
-        " gl_FragColor = vec4( texture2D(YTexture, vTextureCoord).x, texture2D(UTexture, vTextureCoord).x, texture2D(VTexture, vTextureCoord).x, 1) * YUV2RGB;",
+        " vec4 uv = texture2D(UTexture, vTextureCoord);",
+        " float v = NV12 ? uv.a : texture2D(VTexture, vTextureCoord).x;",
+        " gl_FragColor = vec4( texture2D(YTexture, vTextureCoord).x, uv.x, v, 1) * YUV2RGB;",
         "}"
     ].join("\n");
 
@@ -98,9 +103,11 @@ WebGLPlayer.prototype.initGL = function (options) {
     gl.y.bind(0, program, "YTexture");
     gl.u.bind(1, program, "UTexture");
     gl.v.bind(2, program, "VTexture");
+    gl.nv12 = gl.getUniformLocation(program, "NV12");
 }
 
-WebGLPlayer.prototype.renderFrame = function (videoFrame, width, height, uOffset, vOffset) {
+// nv12: videoFrame is Y followed by interleaved UV of 2 * vOffset bytes.
+WebGLPlayer.prototype.renderFrame = function (videoFrame, width, height, uOffset, vOffset, nv12) {
     if (!this.gl) {
         console.log("[ER] Render frame failed due to WebGL not supported.");
         return;
@@ -112,8 +119,13 @@ WebGLPlayer.prototype.renderFrame = function (videoFrame, width, height, uOffset
     gl.clear(gl.COLOR_BUFFER_BIT);
 
     gl.y.fill(width, height, videoFrame.subarray(0, uOffset));
-    gl.u.fill(width >> 1, height >> 1, videoFrame.subarray(uOffset, uOffset + vOffset));
-    gl.v.fill(width >> 1, height >> 1, videoFrame.subarray(uOffset + vOffset, videoFrame.length));
+    gl.uniform1i(gl.nv12, nv12 ? 1 : 0);
+    if (nv12) {
+        gl.u.fill(width >> 1, height >> 1, videoFrame.subarray(uOffset, videoFrame.length), gl.LUMINANCE_ALPHA);
+    } else {
+        gl.u.fill(width >> 1, height >> 1, videoFrame.subarray(uOffset, uOffset + vOffset));
+        gl.v.fill(width >> 1, height >> 1, videoFrame.subarray(uOffset + vOffset, videoFrame.length));
+    }
 
     gl.drawArrays(gl.TRIANGLE_STRIP, 0, 4);
 };